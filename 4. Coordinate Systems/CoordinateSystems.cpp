@@ -1,5 +1,7 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -7,6 +9,8 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <chrono>
+#include <cstring>
 
 #define WINDOW_WIDTH	1024
 #define WINDOW_HEIGHT	768
@@ -14,6 +18,15 @@
 
 /* Functions */
 static void RenderScene();
+static void ParseArguments(int argc, char **argv);
+static double GetTime();
+
+namespace Headless {
+    static bool CreateContext();
+    static void CreateFramebuffer(int width, int height, int samples);
+    static void Present();
+    static void DestroyContext();
+}
 
 namespace Shader {
     static GLuint CreateShaderProgram(const std::string &vertexPath, const std::string &fragmentPath);
@@ -43,8 +56,16 @@ static const char fragmentShaderPath[] = "fragmentShader.glsl";
 
 static GLuint shaderProgram;
 static GLuint modelMatrixLocation;
-static GLuint viewMatrixLocation;
-static GLuint projectionMatrixLocation;
+
+/* Camera uniform block shared by every program, laid out with std140 rules */
+typedef struct {
+    glm::mat4 viewMatrix;
+    glm::mat4 projectionMatrix;
+    glm::mat4 viewProjectionMatrix;
+} CameraBlock;
+
+static const GLuint cameraBindingPoint = 0;
+static GLuint cameraUBO;
 
 static GLuint VAO;
 static GLuint VBO;
@@ -56,55 +77,82 @@ typedef struct {
     glm::vec3 color;
 } Vertex;
 
-int main()
-{
-    /* Initialize GLFW */
-    if (!glfwInit()) {
-        std::cerr << "Failed to initialize GLFW" << std::endl;
-        std::exit(-1);
-    }
-
-    /* Enable 4x MSAA */
-    glfwWindowHint(GLFW_SAMPLES, 4);
+/* Command line options. --headless renders into an offscreen framebuffer
+ * without a window, --frames N stops after N frames and prints throughput
+ */
+static bool headless = false;
+static int benchmarkFrames = 0;
 
-    /* Setting OpenGL version 3.3 */
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-
-    /* Uses the more modern OpenGL(3.0 or above) and doesn't use the old
-     * functionality
-	 */
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-
-    /* Uses only modern OpenGL APIs and does not rely on legacy features which
-     * may not be available on all hardware
-	 */
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
-    /* Creating Window */
-    window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE,
-							  nullptr, nullptr);
-    if (window == nullptr) {
-        std::cerr << "Failed to Create GLFW window" << std::endl;
-        glfwTerminate();
-        std::exit(-1);
+int main(int argc, char **argv)
+{
+    ParseArguments(argc, argv);
+
+    if (headless) {
+        if (!Headless::CreateContext()) {
+            std::cerr << "Failed to create headless EGL context" << std::endl;
+            std::exit(-1);
+        }
+    } else {
+        /* Initialize GLFW */
+        if (!glfwInit()) {
+            std::cerr << "Failed to initialize GLFW" << std::endl;
+            std::exit(-1);
+        }
+
+        /* Enable 4x MSAA */
+        glfwWindowHint(GLFW_SAMPLES, 4);
+
+        /* Setting OpenGL version 3.3 */
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+
+        /* Uses the more modern OpenGL(3.0 or above) and doesn't use the old
+         * functionality
+         */
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+
+        /* Uses only modern OpenGL APIs and does not rely on legacy features which
+         * may not be available on all hardware
+         */
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+        /* Creating Window */
+        window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE,
+                                  nullptr, nullptr);
+        if (window == nullptr) {
+            std::cerr << "Failed to Create GLFW window" << std::endl;
+            glfwTerminate();
+            std::exit(-1);
+        }
+
+        /* set OpenGL context to window. This means that all subsequent OpenGL
+         * operations perform will impact this window
+         */
+        glfwMakeContextCurrent(window);
+
+        /* setting GLFW manages keyboard key input */
+        glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
+
+        /* Don't wait for vsync when measuring throughput */
+        if (benchmarkFrames > 0)
+            glfwSwapInterval(0);
     }
 
-    /* set OpenGL context to window. This means that all subsequent OpenGL
-     * operations perform will impact this window
-	 */
-    glfwMakeContextCurrent(window);
-
-    /* setting GLFW manages keyboard key input */
-    glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
-
-    // Initialize GLEW
-    if (glewInit() != GLEW_OK) {
+    /* Initialize GLEW. GLEW built for GLX reports a missing X display when
+     * the context comes from EGL, even though every entry point was loaded
+     */
+    glewExperimental = GL_TRUE;
+    GLenum glewStatus = glewInit();
+    if (glewStatus != GLEW_OK && !(headless && glewStatus == GLEW_ERROR_NO_GLX_DISPLAY)) {
         std::cerr << "Failed to initialize GLEW" << std::endl;
         glfwTerminate();
         std::exit(-1);
     }
 
+    /* Match the 4x MSAA default framebuffer GLFW would have given us */
+    if (headless)
+        Headless::CreateFramebuffer(WINDOW_WIDTH, WINDOW_HEIGHT, 4);
+
     glEnable(GL_DEPTH_TEST);
 
     Vertex vertices[] = {
@@ -180,23 +228,60 @@ int main()
     glUseProgram(shaderProgram);
 
     modelMatrixLocation      = glGetUniformLocation(shaderProgram, "ModelMatrix");
-    viewMatrixLocation       = glGetUniformLocation(shaderProgram, "ViewMatrix");
-    projectionMatrixLocation = glGetUniformLocation(shaderProgram, "ProjectionMatrix");
 
-    /* Check if the ESC key was pressed or the window was closed */
-    while (glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_PRESS && !glfwWindowShouldClose(window)) {
+    /* The camera and window never change here, so view, projection and
+     * their product are uploaded once instead of every frame
+     */
+    CameraBlock camera;
+    camera.viewMatrix = Transformation::Translation(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -2.0f));
+    camera.projectionMatrix = CoordinateSystems::PerspectiveProjectionMatrix(90.0f, (float)WINDOW_WIDTH / WINDOW_HEIGHT, 1.0f, 100.f);
+    camera.viewProjectionMatrix = camera.projectionMatrix * camera.viewMatrix;
+
+    glGenBuffers(1, &cameraUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, cameraUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(CameraBlock), &camera, GL_STATIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, cameraBindingPoint, cameraUBO);
+
+    /* GLSL 3.30 has no layout(binding = N), so point the block at the
+     * shared binding point from here
+     */
+    glUniformBlockBinding(shaderProgram, glGetUniformBlockIndex(shaderProgram, "Camera"), cameraBindingPoint);
+
+    double startTime = GetTime();
+    int frameCount = 0;
+
+    /* Check if the ESC key was pressed or the window was closed. Headless
+     * runs have no window, so they only stop after the requested frames
+     */
+    while (benchmarkFrames == 0 || frameCount < benchmarkFrames) {
+        if (!headless && (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS || glfwWindowShouldClose(window)))
+            break;
 
 		RenderScene();
+        frameCount++;
+    }
 
+    if (benchmarkFrames > 0) {
+        /* Wait for the last frame so the GPU work is part of the measurement */
+        glFinish();
+        double elapsed = GetTime() - startTime;
+
+        std::cout << "Rendered " << frameCount << " frames in " << elapsed << " s: "
+                  << frameCount / elapsed << " frames/s, "
+                  << elapsed * 1000.0 / frameCount << " ms/frame" << std::endl;
     }
 
     /* Clean up */
+    glDeleteBuffers(1, &cameraUBO);
     glDeleteProgram(shaderProgram);
     glDeleteBuffers(1, &IBO);
     glDeleteBuffers(1, &VBO);
     glDeleteVertexArrays(1, &VAO);
 
-    glfwTerminate();
+    if (headless)
+        Headless::DestroyContext();
+    else
+        glfwTerminate();
 
     return 0;
 }
@@ -211,22 +296,19 @@ void RenderScene()
 
     glm::mat4 modelMatrix(1.0f);
     modelMatrix = CoordinateSystems::ModelMatrix(glm::vec3(0.0f, 0.0f, 0.0f),
-            -(float)glfwGetTime() * 60.0f,glm::vec3(0.0f, 1.0f, 0.0f),
+            -(float)GetTime() * 60.0f,glm::vec3(0.0f, 1.0f, 0.0f),
             glm::vec3(1.0f));
 
-    glm::mat4 viewMatrix(1.0f);
-    viewMatrix = Transformation::Translation(viewMatrix, glm::vec3(0.0f, 0.0f, -2.0f));
-
-    glm::mat4 projectionMatrix(1.0f);
-    projectionMatrix = CoordinateSystems::PerspectiveProjectionMatrix(90.0f,(float)WINDOW_WIDTH / WINDOW_HEIGHT, 1.0f, 100.f);
-
     glUniformMatrix4fv(modelMatrixLocation, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-    glUniformMatrix4fv(viewMatrixLocation, 1, GL_FALSE, glm::value_ptr(viewMatrix));
-    glUniformMatrix4fv(projectionMatrixLocation, 1, GL_FALSE, glm::value_ptr(projectionMatrix));
 
     /* Draw Triangle */
     glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
 
+    if (headless) {
+        Headless::Present();
+        return;
+    }
+
 	/* swapping double buffers. This is used when drawing objects or images
 	 * and can prevent flickering or an uneven appearance
 	 */
@@ -239,6 +321,175 @@ void RenderScene()
 	glfwPollEvents();
 }
 
+void ParseArguments(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            benchmarkFrames = atoi(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--headless] [--frames N]" << std::endl;
+            std::exit(-1);
+        }
+    }
+
+    /* Without a window there is nothing to close, so pick a frame count */
+    if (headless && benchmarkFrames <= 0)
+        benchmarkFrames = 1000;
+}
+
+double GetTime()
+{
+    if (!headless)
+        return glfwGetTime();
+
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+namespace Headless {
+    /* Number of frames that may be queued before Present() waits, the same
+     * latency a double buffered swap chain gives us
+     */
+    static const int framesInFlight = 2;
+
+    static EGLDisplay display = EGL_NO_DISPLAY;
+    static EGLContext context = EGL_NO_CONTEXT;
+
+    static GLuint framebuffer;
+    static GLuint colorBuffer;
+    static GLuint depthBuffer;
+    static GLuint resolveFramebuffer;
+    static GLuint resolveColorBuffer;
+    static GLsizei framebufferWidth;
+    static GLsizei framebufferHeight;
+
+    static GLsync frameFences[framesInFlight];
+    static int frameIndex;
+}
+
+bool Headless::CreateContext()
+{
+    /* Surfaceless platform needs no X or DRM device, Mesa will fall back to
+     * llvmpipe when there is no GPU at all
+     */
+    auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay != nullptr)
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+        return false;
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+        return false;
+
+    const EGLint configAttributes[] = {
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+            EGL_NONE
+    };
+
+    EGLConfig config;
+    EGLint configCount;
+    if (!eglChooseConfig(display, configAttributes, &config, 1, &configCount) || configCount == 0)
+        return false;
+
+    /* Same OpenGL 3.3 core profile the window gets */
+    const EGLint contextAttributes[] = {
+            EGL_CONTEXT_MAJOR_VERSION, 3,
+            EGL_CONTEXT_MINOR_VERSION, 3,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+            EGL_NONE
+    };
+
+    context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+    if (context == EGL_NO_CONTEXT)
+        return false;
+
+    /* No surface at all, everything is drawn into our own framebuffer */
+    return eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
+
+void Headless::CreateFramebuffer(int width, int height, int samples)
+{
+    framebufferWidth = width;
+    framebufferHeight = height;
+
+    glGenRenderbuffers(1, &colorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+
+    glGenRenderbuffers(1, &depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH24_STENCIL8, width, height);
+
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cerr << "Headless framebuffer is incomplete" << std::endl;
+
+    /* Single sampled target the multisampled image gets resolved into, like
+     * the window system does on swap
+     */
+    glGenRenderbuffers(1, &resolveColorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, resolveColorBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+    glGenFramebuffers(1, &resolveFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, resolveFramebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, resolveColorBuffer);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glViewport(0, 0, width, height);
+}
+
+void Headless::Present()
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolveFramebuffer);
+    glBlitFramebuffer(0, 0, framebufferWidth, framebufferHeight,
+                      0, 0, framebufferWidth, framebufferHeight,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+    /* Throttle the CPU like a blocking swap would, otherwise we only measure
+     * how fast commands can be queued
+     */
+    GLsync &fence = frameFences[frameIndex];
+    if (fence != nullptr) {
+        glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(fence);
+    }
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    frameIndex = (frameIndex + 1) % framesInFlight;
+}
+
+void Headless::DestroyContext()
+{
+    for (GLsync &fence : frameFences) {
+        if (fence != nullptr)
+            glDeleteSync(fence);
+        fence = nullptr;
+    }
+
+    glDeleteFramebuffers(1, &resolveFramebuffer);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteRenderbuffers(1, &resolveColorBuffer);
+    glDeleteRenderbuffers(1, &depthBuffer);
+    glDeleteRenderbuffers(1, &colorBuffer);
+
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+    eglTerminate(display);
+}
+
 GLuint Shader::CreateShaderProgram(const std::string &vertexPath, const std::string &fragmentPath)
 {
     // Read shader source code from files
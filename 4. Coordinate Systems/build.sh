@@ -1,6 +1,6 @@
 #!/bin/bash
 
 CC=g++
-LDFLAGS=$(pkg-config --libs glew glfw3)
+LDFLAGS=$(pkg-config --libs glew glfw3 egl)
 
-$CC CoordinateSystems.cpp "$LDFLAGS"
+$CC CoordinateSystems.cpp $LDFLAGS
@@ -0,0 +1,682 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "Bvh.hpp"
+#include "CoordinateSystem.hpp"
+#include "Culling.hpp"
+#include "EntityStore.hpp"
+#include "JobSystem.hpp"
+#include "MeshImporter.hpp"
+#include "MeshOptimizer.hpp"
+#include "MeshSimplifier.hpp"
+#include "RenderQueue.hpp"
+#include "SceneGraph.hpp"
+#include "Shader.hpp"
+#include "TransformBatch.hpp"
+#include "Transformation.hpp"
+
+// Microbenchmarks for the hand-written matrix code and shader loading, each
+// measured next to the glm (or libc) function it replaces. Results are
+// written to stdout as JSON so runs can be diffed and tracked over time.
+//
+//   ./benchmark [--min-time seconds] [--filter text] [--shader path]
+
+namespace Benchmark {
+    struct Result {
+        std::string group;
+        std::string name;
+        uint64_t operations;
+        double nsPerOp;
+        double cyclesPerOp;
+        double allocationsPerOp;
+    };
+
+    template <typename Function>
+    static void Run(const char *group, const char *name, uint64_t operationsPerCall, Function function);
+    template <typename T>
+    static void DoNotOptimize(T const &value);
+    static uint64_t ReadCycles();
+    static void WriteJson(std::ostream &output);
+}
+
+// Every allocation in the process goes through here so we can report
+// allocations per operation
+static std::atomic<uint64_t> allocationCount{0};
+
+void *operator new(size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    void *pointer = std::malloc(size == 0 ? 1 : size);
+    if (pointer == nullptr)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+    std::free(pointer);
+}
+
+static double minTime = 0.25;
+static const char *filter = nullptr;
+static const char *shaderPath = "vertexShader.glsl";
+
+static std::vector<Benchmark::Result> results;
+
+// Inputs are cycled through so the compiler can't fold the calls away
+static const int inputCount = 64;
+
+struct Inputs {
+    glm::mat4 matrix[inputCount];
+    glm::vec3 position[inputCount];
+    glm::vec3 target[inputCount];
+    glm::vec3 axis[inputCount];
+    glm::vec3 scale[inputCount];
+    float angle[inputCount];
+    float aspect[inputCount];
+};
+
+static std::string readFileWithFread(const char *path);
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            minTime = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--shader") == 0 && i + 1 < argc) {
+            shaderPath = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--min-time seconds] [--filter text] [--shader path]" << std::endl;
+            std::exit(-1);
+        }
+    }
+
+    static Inputs in;
+    for (int i = 0; i < inputCount; i++) {
+        float f = (float)i;
+        in.matrix[i] = glm::mat4(1.0f);
+        in.matrix[i][3] = glm::vec4(f * 0.1f, -f * 0.2f, f * 0.3f, 1.0f);
+        in.position[i] = glm::vec3(f * 0.5f, 1.0f + f * 0.25f, 3.0f - f);
+        in.target[i] = glm::vec3(-f * 0.1f, f * 0.2f, -10.0f);
+        in.axis[i] = glm::vec3(0.3f + f * 0.01f, 1.0f, 0.2f - f * 0.01f);
+        in.scale[i] = glm::vec3(1.0f + f * 0.01f, 2.0f, 0.5f + f * 0.02f);
+        in.angle[i] = f * 7.0f - 200.0f;
+        in.aspect[i] = 1.0f + f * 0.01f;
+    }
+    const glm::vec3 up(0.0f, 1.0f, 0.0f);
+
+    int k = 0;
+    auto next = [&k]() { k = (k + 1) & (inputCount - 1); return k; };
+
+    Benchmark::Run("Translation", "Transformation::Translation", 1, [&]() {
+        int i = next();
+        return Transformation::Translation(in.matrix[i], in.position[i]);
+    });
+    Benchmark::Run("Translation", "glm::translate", 1, [&]() {
+        int i = next();
+        return glm::translate(in.matrix[i], in.position[i]);
+    });
+
+    Benchmark::Run("Rotation", "Transformation::Rotation", 1, [&]() {
+        int i = next();
+        return Transformation::Rotation(in.matrix[i], in.angle[i], in.axis[i]);
+    });
+    Benchmark::Run("Rotation", "glm::rotate", 1, [&]() {
+        int i = next();
+        return glm::rotate(in.matrix[i], glm::radians(in.angle[i]), in.axis[i]);
+    });
+
+    Benchmark::Run("Scaling", "Transformation::Scaling", 1, [&]() {
+        int i = next();
+        return Transformation::Scaling(in.matrix[i], in.scale[i]);
+    });
+    Benchmark::Run("Scaling", "glm::scale", 1, [&]() {
+        int i = next();
+        return glm::scale(in.matrix[i], in.scale[i]);
+    });
+
+    Benchmark::Run("ModelMatrix", "CoordinateSystem::ModelMatrix", 1, [&]() {
+        int i = next();
+        return CoordinateSystem::ModelMatrix(in.position[i], in.angle[i], in.axis[i], in.scale[i]);
+    });
+    Benchmark::Run("ModelMatrix", "glm::translate*rotate*scale", 1, [&]() {
+        int i = next();
+        glm::mat4 model = glm::translate(glm::mat4(1.0f), in.position[i]);
+        model = glm::rotate(model, glm::radians(in.angle[i]), in.axis[i]);
+        return glm::scale(model, in.scale[i]);
+    });
+
+    // Batch kernels report time per matrix, so they line up with the
+    // single object versions above
+    const size_t batchSize = 4096;
+    std::vector<float> soa(10 * batchSize);
+    for (size_t i = 0; i < batchSize; i++) {
+        int j = i % inputCount;
+        const float values[10] = {
+                in.position[j].x, in.position[j].y, in.position[j].z, in.angle[j],
+                in.axis[j].x, in.axis[j].y, in.axis[j].z,
+                in.scale[j].x, in.scale[j].y, in.scale[j].z
+        };
+        for (int field = 0; field < 10; field++)
+            soa[field * batchSize + i] = values[field];
+    }
+    TransformBatch::Transforms transforms = {
+            &soa[0 * batchSize], &soa[1 * batchSize], &soa[2 * batchSize], &soa[3 * batchSize],
+            &soa[4 * batchSize], &soa[5 * batchSize], &soa[6 * batchSize],
+            &soa[7 * batchSize], &soa[8 * batchSize], &soa[9 * batchSize]
+    };
+    std::vector<glm::mat4> batchOutput(batchSize);
+
+    Benchmark::Run("ModelMatrix", "TransformBatch::ModelMatricesScalar", batchSize, [&]() {
+        TransformBatch::ModelMatricesScalar(transforms, 0, batchSize, batchOutput.data());
+        return batchOutput[next()];
+    });
+#ifdef TRANSFORM_BATCH_X86
+    Benchmark::Run("ModelMatrix", "TransformBatch::ModelMatricesSSE", batchSize, [&]() {
+        TransformBatch::ModelMatricesSSE(transforms, 0, batchSize, batchOutput.data());
+        return batchOutput[next()];
+    });
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        Benchmark::Run("ModelMatrix", "TransformBatch::ModelMatricesAVX2", batchSize, [&]() {
+            TransformBatch::ModelMatricesAVX2(transforms, 0, batchSize, batchOutput.data());
+            return batchOutput[next()];
+        });
+    }
+#endif
+
+    // A tree of 64k nodes, four children each, reported per node. Every
+    // world matrix rebuilt from its parent's each frame the way it would be
+    // without a scene graph, against the graph with nothing, one leaf and
+    // everything moving
+    const uint32_t nodeCount = 1 << 16;
+    SceneGraph::Graph scene;
+    SceneGraph::Create(scene, nodeCount);
+    for (uint32_t i = 0; i < nodeCount; i++) {
+        int j = i % inputCount;
+        SceneGraph::AddNode(scene, i == 0 ? SceneGraph::noParent : (i - 1) / 4, in.position[j], in.angle[j], in.axis[j], in.scale[j]);
+    }
+    std::vector<glm::mat4> sceneWorld(nodeCount);
+    Benchmark::Run("SceneGraph", "CoordinateSystem::ModelMatrix per node", nodeCount, [&]() {
+        for (uint32_t i = 0; i < nodeCount; i++) {
+            int j = i % inputCount;
+            glm::mat4 local = CoordinateSystem::ModelMatrix(in.position[j], in.angle[j], in.axis[j], in.scale[j]);
+            sceneWorld[i] = i == 0 ? local : sceneWorld[(i - 1) / 4] * local;
+        }
+        return sceneWorld[next()];
+    });
+    SceneGraph::Update(scene);
+    Benchmark::Run("SceneGraph", "SceneGraph::Update static", nodeCount, [&]() {
+        return SceneGraph::Update(scene);
+    });
+    Benchmark::Run("SceneGraph", "SceneGraph::Update one leaf", nodeCount, [&]() {
+        SceneGraph::SetRotation(scene, nodeCount - 1, in.angle[next()]);
+        return SceneGraph::Update(scene);
+    });
+    Benchmark::Run("SceneGraph", "SceneGraph::Update all", nodeCount, [&]() {
+        float angle = in.angle[next()];
+        for (uint32_t i = 0; i < nodeCount; i++)
+            SceneGraph::SetRotation(scene, i, angle);
+        return SceneGraph::Update(scene);
+    });
+
+    Benchmark::Run("ViewMatrix", "CoordinateSystem::ViewMatrix", 1, [&]() {
+        int i = next();
+        return CoordinateSystem::ViewMatrix(in.position[i], in.target[i], up);
+    });
+    Benchmark::Run("ViewMatrix", "CameraMatrix", 1, [&]() {
+        int i = next();
+        return CameraMatrix(in.position[i], in.target[i], up);
+    });
+    Benchmark::Run("ViewMatrix", "glm::lookAt", 1, [&]() {
+        int i = next();
+        return glm::lookAt(in.position[i], in.target[i], up);
+    });
+
+    Benchmark::Run("PerspectiveProjection", "CoordinateSystem::PerspectiveProjectionMatrix", 1, [&]() {
+        int i = next();
+        return CoordinateSystem::PerspectiveProjectionMatrix(90.0f, in.aspect[i], 1.0f, 10.0f);
+    });
+    Benchmark::Run("PerspectiveProjection", "glm::perspective", 1, [&]() {
+        int i = next();
+        return glm::perspective(glm::radians(90.0f), in.aspect[i], 1.0f, 10.0f);
+    });
+
+    Benchmark::Run("OrthographicProjection", "CoordinateSystem::OrthographicProjectionMatrix", 1, [&]() {
+        int i = next();
+        return CoordinateSystem::OrthographicProjectionMatrix(-in.aspect[i], in.aspect[i], -1.0f, 1.0f, 0.1f, 100.0f);
+    });
+    Benchmark::Run("OrthographicProjection", "glm::ortho", 1, [&]() {
+        int i = next();
+        return glm::ortho(-in.aspect[i], in.aspect[i], -1.0f, 1.0f, 0.1f, 100.0f);
+    });
+
+    // One million spheres scattered around a camera looking down -z, about
+    // a quarter of them end up inside the frustum. Reported per sphere
+    const uint32_t sphereCount = 1 << 20;
+    std::vector<float> sphereData(4 * sphereCount);
+    std::vector<uint32_t> visible(sphereCount);
+    for (uint32_t i = 0; i < sphereCount; i++) {
+        sphereData[0 * sphereCount + i] = (rand() / (float) RAND_MAX - 0.5f) * 200.0f;
+        sphereData[1 * sphereCount + i] = (rand() / (float) RAND_MAX - 0.5f) * 200.0f;
+        sphereData[2 * sphereCount + i] = (rand() / (float) RAND_MAX - 0.5f) * 200.0f;
+        sphereData[3 * sphereCount + i] = rand() / (float) RAND_MAX + 0.5f;
+    }
+    Culling::Spheres spheres = {
+            &sphereData[0 * sphereCount], &sphereData[1 * sphereCount], &sphereData[2 * sphereCount], &sphereData[3 * sphereCount]
+    };
+    Culling::Frustum frustum = Culling::ExtractFrustum(
+            glm::perspective(glm::radians(90.0f), 4.0f / 3.0f, 0.1f, 100.0f) *
+            glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+
+    Benchmark::Run("Culling", "Culling::CullScalar", sphereCount, [&]() {
+        return Culling::CullScalar(frustum, spheres, 0, sphereCount, visible.data());
+    });
+#ifdef CULLING_X86
+    Benchmark::Run("Culling", "Culling::CullSSE", sphereCount, [&]() {
+        return Culling::CullSSE(frustum, spheres, 0, sphereCount, visible.data());
+    });
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        Benchmark::Run("Culling", "Culling::CullAVX2", sphereCount, [&]() {
+            return Culling::CullAVX2(frustum, spheres, 0, sphereCount, visible.data());
+        });
+    }
+#endif
+    int workerCount = std::min((int) std::thread::hardware_concurrency() - 1, 7);
+    if (workerCount > 0)
+        WorkerPool::Start(workerCount);
+    Benchmark::Run("Culling", "Culling::Cull", sphereCount, [&]() {
+        return Culling::Cull(frustum, spheres, sphereCount, visible.data());
+    });
+
+    // Half of the same spheres, in no particular spatial order, which is
+    // the worst case for refit. Build and refit are reported per tree
+    const uint32_t treeObjectCount = 500000;
+    Bvh::Tree tree;
+    Benchmark::Run("Bvh", "Bvh::Build", 1, [&]() {
+        Bvh::Build(tree, spheres, treeObjectCount);
+        return tree.nodeCount;
+    });
+    Benchmark::Run("Bvh", "Bvh::Refit", 1, [&]() {
+        Bvh::Refit(tree, spheres);
+        return tree.nodes[0].minX;
+    });
+    Benchmark::Run("Bvh", "Bvh::QueryFrustum", 1, [&]() {
+        return Bvh::QueryFrustum(tree, spheres, frustum, visible.data());
+    });
+    Benchmark::Run("Bvh", "Bvh::Raycast", 1, [&]() {
+        const glm::vec3 &direction = in.position[next()];
+        uint32_t index = 0;
+        float distance;
+        Bvh::Raycast(tree, spheres, glm::vec3(0.0f), direction, &index, &distance);
+        return index;
+    });
+
+    // A quarter million opaque draws over 4 programs and 64 materials at
+    // random depths, in the order they were recorded. Reported per draw
+    const uint32_t drawCount = 1 << 18;
+    std::vector<RenderQueue::Item> recordedDraws(drawCount), sortedDraws, sortScratch(drawCount);
+    for (uint32_t i = 0; i < drawCount; i++) {
+        float depth = 1.0f + rand() / (float) RAND_MAX * 999.0f;
+        recordedDraws[i] = { RenderQueue::MakeKey(RenderQueue::Opaque, rand() % 4, rand() % 64, depth), i };
+    }
+
+    Benchmark::Run("RenderQueue", "RenderQueue::SortItems", drawCount, [&]() {
+        sortedDraws = recordedDraws;
+        RenderQueue::SortItems(sortedDraws.data(), sortScratch.data(), drawCount);
+        return sortedDraws[0].value;
+    });
+    Benchmark::Run("RenderQueue", "std::sort", drawCount, [&]() {
+        sortedDraws = recordedDraws;
+        std::sort(sortedDraws.begin(), sortedDraws.end(), [](const RenderQueue::Item &a, const RenderQueue::Item &b) {
+            return a.key < b.key;
+        });
+        return sortedDraws[0].value;
+    });
+
+    // A sphere of about a million triangles in shuffled order, like a mesh
+    // that never went through an optimizer. Reported per mesh
+    const uint32_t sphereRings = 512, sphereSegments = 1024;
+    std::vector<glm::vec3> meshPositions;
+    std::vector<uint32_t> meshIndices;
+    for (uint32_t ring = 0; ring <= sphereRings; ring++) {
+        for (uint32_t segment = 0; segment <= sphereSegments; segment++) {
+            float theta = glm::radians(180.0f) * ring / sphereRings;
+            float phi = glm::radians(360.0f) * segment / sphereSegments;
+            meshPositions.push_back(glm::vec3(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi)));
+        }
+    }
+    for (uint32_t ring = 0; ring < sphereRings; ring++) {
+        for (uint32_t segment = 0; segment < sphereSegments; segment++) {
+            uint32_t a = ring * (sphereSegments + 1) + segment, b = a + 1;
+            uint32_t c = a + sphereSegments + 1, d = c + 1;
+            meshIndices.insert(meshIndices.end(), { a, b, c, b, d, c });
+        }
+    }
+    for (size_t triangle = meshIndices.size() / 3 - 1; triangle > 0; triangle--) {
+        size_t other = rand() % (triangle + 1);
+        for (int corner = 0; corner < 3; corner++)
+            std::swap(meshIndices[triangle * 3 + corner], meshIndices[other * 3 + corner]);
+    }
+    uint32_t meshVertexCount = (uint32_t) meshPositions.size();
+    MeshOptimizer::Positions meshPositionStream = { &meshPositions[0].x, sizeof(glm::vec3) };
+    std::vector<uint32_t> optimizedIndices;
+    std::vector<glm::vec3> optimizedPositions;
+
+    Benchmark::Run("MeshOptimizer", "MeshOptimizer::AnalyzeVertexCache", 1, [&]() {
+        return MeshOptimizer::AnalyzeVertexCache(meshIndices.data(), meshIndices.size(), meshVertexCount).acmr;
+    });
+    Benchmark::Run("MeshOptimizer", "MeshOptimizer::AnalyzeOverdraw", 1, [&]() {
+        return MeshOptimizer::AnalyzeOverdraw(meshIndices.data(), meshIndices.size(), meshPositionStream).overdraw;
+    });
+    Benchmark::Run("MeshOptimizer", "MeshOptimizer::OptimizeVertexCache", 1, [&]() {
+        optimizedIndices = meshIndices;
+        MeshOptimizer::OptimizeVertexCache(optimizedIndices.data(), optimizedIndices.size(), meshPositionStream);
+        return optimizedIndices[0];
+    });
+    Benchmark::Run("MeshOptimizer", "MeshOptimizer::Optimize", 1, [&]() {
+        optimizedIndices = meshIndices;
+        optimizedPositions = meshPositions;
+        return MeshOptimizer::Optimize(optimizedIndices.data(), optimizedIndices.size(), optimizedPositions.data(),
+                                       meshVertexCount, sizeof(glm::vec3));
+    });
+
+    // The top of the same sphere in order, its first 8 rings and their
+    // vertices only, halved by the simplifier. Reported per input triangle
+    uint32_t capRings = 8;
+    uint32_t capVertexCount = (capRings + 1) * (sphereSegments + 1);
+    std::vector<uint32_t> capIndices;
+    for (uint32_t ring = 0; ring < capRings; ring++) {
+        for (uint32_t segment = 0; segment < sphereSegments; segment++) {
+            uint32_t a = ring * (sphereSegments + 1) + segment, b = a + 1;
+            uint32_t c = a + sphereSegments + 1, d = c + 1;
+            capIndices.insert(capIndices.end(), { a, b, c, b, d, c });
+        }
+    }
+    std::vector<uint32_t> simplifiedIndices(capIndices.size());
+    Benchmark::Run("MeshSimplifier", "MeshSimplifier::Simplify", capIndices.size() / 3, [&]() {
+        return MeshSimplifier::Simplify(simplifiedIndices.data(), capIndices.data(), capIndices.size(), meshPositionStream,
+                                        capVertexCount, capIndices.size() / 2, FLT_MAX, nullptr);
+    });
+
+    // The first 64 rings of the same sphere written out as OBJ text, a few
+    // MB of it. Reported per byte, so 1e3 / ns_per_op is MB/s
+    std::string objText;
+    char objLine[96];
+    uint32_t objRings = 64;
+    for (uint32_t vertex = 0; vertex < (objRings + 1) * (sphereSegments + 1); vertex++) {
+        const glm::vec3 &position = meshPositions[vertex];
+        objText.append(objLine, snprintf(objLine, sizeof(objLine), "v %.6f %.6f %.6f\n", position.x, position.y, position.z));
+    }
+    for (uint32_t ring = 0; ring < objRings; ring++) {
+        for (uint32_t segment = 0; segment < sphereSegments; segment++) {
+            uint32_t a = ring * (sphereSegments + 1) + segment + 1, c = a + sphereSegments + 1;
+            objText.append(objLine, snprintf(objLine, sizeof(objLine), "f %u %u %u %u\n", a, a + 1, c + 1, c));
+        }
+    }
+    std::vector<MeshImporter::Submesh> importedMeshes;
+    std::string importError;
+    Benchmark::Run("MeshImporter", "MeshImporter::ImportObj", objText.size(), [&]() {
+        MeshImporter::ImportObj(objText.data(), objText.size(), importedMeshes, importError);
+        return importedMeshes[0].vertices.size();
+    });
+
+    // The million spheres again as entities with the components of Camera's
+    // instances, half of them spinning. Systems run a chunk per job: one
+    // turns the spinning ones, one culls everything against the frustum and
+    // extracts the model matrix and mesh of whatever is visible. Reported
+    // per entity
+    EntityStore::World world;
+    EntityStore::Create(world);
+    uint32_t positionComponent = EntityStore::RegisterComponent(world, sizeof(float), 3);
+    uint32_t rotationComponent = EntityStore::RegisterComponent(world, sizeof(float), 4);
+    uint32_t scaleComponent = EntityStore::RegisterComponent(world, sizeof(float), 3);
+    uint32_t boundsComponent = EntityStore::RegisterComponent(world, sizeof(float));
+    uint32_t meshComponent = EntityStore::RegisterComponent(world, sizeof(uint32_t));
+    uint32_t spinComponent = EntityStore::RegisterComponent(world, sizeof(float));
+    EntityStore::Signature renderable = EntityStore::Bit(positionComponent) | EntityStore::Bit(rotationComponent) |
+                                        EntityStore::Bit(scaleComponent) | EntityStore::Bit(boundsComponent) |
+                                        EntityStore::Bit(meshComponent);
+    EntityStore::Signature spinning = EntityStore::Bit(rotationComponent) | EntityStore::Bit(spinComponent);
+
+    std::vector<EntityStore::Entity> entities(sphereCount);
+    uint32_t created = EntityStore::CreateEntities(world, renderable, sphereCount / 2, entities.data());
+    created += EntityStore::CreateEntities(world, renderable | spinning, sphereCount / 2, entities.data() + sphereCount / 2);
+    if (created != sphereCount) {
+        std::cerr << "Failed to create " << sphereCount << " entities, only got " << created << std::endl;
+        std::exit(-1);
+    }
+    for (uint32_t i = 0; i < sphereCount; i++) {
+        EntityStore::Entity entity = entities[i];
+        int j = i % inputCount;
+        for (int c = 0; c < 3; c++) {
+            EntityStore::Field<float>(world, entity, positionComponent, c)[0] = sphereData[c * sphereCount + i];
+            EntityStore::Field<float>(world, entity, rotationComponent, c + 1)[0] = in.axis[j][c];
+            EntityStore::Field<float>(world, entity, scaleComponent, c)[0] = sphereData[3 * sphereCount + i];
+        }
+        *EntityStore::Field<float>(world, entity, rotationComponent) = in.angle[j];
+        *EntityStore::Field<float>(world, entity, boundsComponent) = sphereData[3 * sphereCount + i];
+        *EntityStore::Field<uint32_t>(world, entity, meshComponent) = i % 4;
+        if (i >= sphereCount / 2)
+            *EntityStore::Field<float>(world, entity, spinComponent) = 30.0f + (i % 7) * 15.0f;
+    }
+
+    Benchmark::Run("EntityStore", "EntityStore spin system", sphereCount, [&]() {
+        EntityStore::ParallelForEachChunk(world, spinning, [&](EntityStore::Archetype &archetype, EntityStore::Chunk &chunk) {
+            float *angle = EntityStore::Column<float>(archetype, chunk, rotationComponent);
+            const float *speed = EntityStore::Column<float>(archetype, chunk, spinComponent);
+            for (uint32_t i = 0; i < chunk.count; i++)
+                angle[i] = fmodf(angle[i] + speed[i] * (1.0f / 60.0f), 360.0f);
+        });
+        return EntityStore::EntityCount(world);
+    });
+
+    std::vector<glm::mat4> extractedMatrices(sphereCount);
+    std::vector<uint32_t> extractedMeshes(sphereCount);
+    std::atomic<uint32_t> extractedCount{0};
+    Benchmark::Run("EntityStore", "EntityStore extract system", sphereCount, [&]() {
+        static const Culling::Kernel cullKernel = Culling::SelectKernel();
+        static const TransformBatch::Kernel matrixKernel = TransformBatch::SelectKernel();
+        extractedCount = 0;
+        EntityStore::ParallelForEachChunk(world, renderable, [&](EntityStore::Archetype &archetype, EntityStore::Chunk &chunk) {
+            const float *positionX = EntityStore::Column<float>(archetype, chunk, positionComponent, 0);
+            const float *positionY = EntityStore::Column<float>(archetype, chunk, positionComponent, 1);
+            const float *positionZ = EntityStore::Column<float>(archetype, chunk, positionComponent, 2);
+            const float *radius = EntityStore::Column<float>(archetype, chunk, boundsComponent);
+            const uint32_t *mesh = EntityStore::Column<uint32_t>(archetype, chunk, meshComponent);
+            uint32_t chunkVisible[EntityStore::chunkBytes / sizeof(float)];
+            uint32_t visibleCount = cullKernel(frustum, { positionX, positionY, positionZ, radius }, 0, chunk.count, chunkVisible);
+            uint32_t output = extractedCount.fetch_add(visibleCount, std::memory_order_relaxed);
+
+            // Matrices are built for runs of 64 at a time and only the
+            // visible ones copied out
+            const uint32_t runSize = 64;
+            glm::mat4 run[runSize];
+            uint32_t next = 0;
+            for (uint32_t begin = 0; begin < chunk.count && next < visibleCount; begin += runSize) {
+                uint32_t end = std::min(begin + runSize, chunk.count);
+                if (chunkVisible[next] >= end)
+                    continue;
+                TransformBatch::Transforms transforms = {
+                        positionX + begin, positionY + begin, positionZ + begin,
+                        EntityStore::Column<float>(archetype, chunk, rotationComponent, 0) + begin,
+                        EntityStore::Column<float>(archetype, chunk, rotationComponent, 1) + begin,
+                        EntityStore::Column<float>(archetype, chunk, rotationComponent, 2) + begin,
+                        EntityStore::Column<float>(archetype, chunk, rotationComponent, 3) + begin,
+                        EntityStore::Column<float>(archetype, chunk, scaleComponent, 0) + begin,
+                        EntityStore::Column<float>(archetype, chunk, scaleComponent, 1) + begin,
+                        EntityStore::Column<float>(archetype, chunk, scaleComponent, 2) + begin
+                };
+                matrixKernel(transforms, 0, end - begin, run);
+                for (; next < visibleCount && chunkVisible[next] < end; next++) {
+                    extractedMatrices[output] = run[chunkVisible[next] - begin];
+                    extractedMeshes[output++] = mesh[chunkVisible[next]];
+                }
+            }
+        });
+        return extractedCount.load();
+    });
+
+    if (workerCount > 0)
+        WorkerPool::Stop();
+
+    // The job system on one thread up to every core: an empty job through
+    // Run() and Wait(), reported per job, and a quarter million matrices
+    // built in parallel, reported per matrix so the rows show the scaling
+    const uint32_t jobMatrixCount = 1 << 18;
+    std::vector<float> jobSoa(10 * (size_t) jobMatrixCount);
+    for (int field = 0; field < 10; field++)
+        for (uint32_t i = 0; i < jobMatrixCount; i++)
+            jobSoa[field * (size_t) jobMatrixCount + i] = soa[field * batchSize + i % batchSize];
+    TransformBatch::Transforms jobTransforms = {
+            &jobSoa[0 * jobMatrixCount], &jobSoa[1 * jobMatrixCount], &jobSoa[2 * jobMatrixCount], &jobSoa[3 * jobMatrixCount],
+            &jobSoa[4 * jobMatrixCount], &jobSoa[5 * jobMatrixCount], &jobSoa[6 * jobMatrixCount],
+            &jobSoa[7 * jobMatrixCount], &jobSoa[8 * jobMatrixCount], &jobSoa[9 * jobMatrixCount]
+    };
+    std::vector<glm::mat4> jobMatrices(jobMatrixCount);
+    JobSystem::JobFunction emptyJob = [](void *, uint32_t, uint32_t) {};
+    int maxThreads = std::max(std::min((int) std::thread::hardware_concurrency(), 8), 1);
+    for (int threads = 1; threads <= maxThreads; threads++) {
+        JobSystem::Start(threads - 1);
+        std::string suffix = " " + std::to_string(threads) + (threads == 1 ? " thread" : " threads");
+        JobSystem::Counter counter;
+        Benchmark::Run("JobSystem", ("JobSystem::Run" + suffix).c_str(), 256, [&]() {
+            for (int i = 0; i < 256; i++)
+                JobSystem::Run(emptyJob, nullptr, 0, 1, 1, counter);
+            JobSystem::Wait(counter);
+            return counter.pending.load();
+        });
+        Benchmark::Run("JobSystem", ("TransformBatch::ModelMatrices" + suffix).c_str(), jobMatrixCount, [&]() {
+            TransformBatch::ModelMatrices(jobTransforms, jobMatrixCount, jobMatrices.data());
+            return jobMatrices[0][3][0];
+        });
+        JobSystem::Stop();
+    }
+
+    if (readFileWithFread(shaderPath).empty()) {
+        std::cerr << "Skipping shader loading, can't read " << shaderPath << std::endl;
+    } else {
+        Benchmark::Run("ReadShaderFile", "Shader::ReadShaderFile", 1, [&]() {
+            return Shader::ReadShaderFile(shaderPath).size();
+        });
+        Benchmark::Run("ReadShaderFile", "fread", 1, [&]() {
+            return readFileWithFread(shaderPath).size();
+        });
+    }
+
+    Benchmark::WriteJson(std::cout);
+
+    return 0;
+}
+
+// Plain stdio reference for Shader::ReadShaderFile: one allocation sized
+// from the file length and a single read
+std::string readFileWithFread(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr)
+        return "";
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    std::string contents(size > 0 ? size : 0, '\0');
+    size_t read = fread(&contents[0], 1, contents.size(), file);
+    fclose(file);
+
+    contents.resize(read);
+    return contents;
+}
+
+template <typename T>
+void Benchmark::DoNotOptimize(T const &value)
+{
+    asm volatile("" : : "m"(value) : "memory");
+}
+
+uint64_t Benchmark::ReadCycles()
+{
+    // TSC ticks at a constant reference rate, so with turbo or power
+    // saving this is close to, but not exactly, core cycles
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+template <typename Function>
+void Benchmark::Run(const char *group, const char *name, uint64_t operationsPerCall, Function function)
+{
+    if (filter != nullptr && strstr(name, filter) == nullptr && strstr(group, filter) == nullptr)
+        return;
+
+    // Warm up caches and branch predictors, then keep doubling the number
+    // of calls until one measurement lasts at least minTime
+    for (int i = 0; i < 100; i++)
+        DoNotOptimize(function());
+
+    uint64_t calls = 1;
+    while (true) {
+        uint64_t allocationsBefore = allocationCount.load(std::memory_order_relaxed);
+        uint64_t cyclesBefore = ReadCycles();
+        auto begin = std::chrono::steady_clock::now();
+
+        for (uint64_t i = 0; i < calls; i++)
+            DoNotOptimize(function());
+
+        auto end = std::chrono::steady_clock::now();
+        uint64_t cycles = ReadCycles() - cyclesBefore;
+        uint64_t allocations = allocationCount.load(std::memory_order_relaxed) - allocationsBefore;
+
+        double elapsed = std::chrono::duration<double>(end - begin).count();
+        if (elapsed >= minTime || calls >= (1ull << 40)) {
+            uint64_t operations = calls * operationsPerCall;
+            results.push_back({ group, name, operations,
+                                elapsed * 1e9 / operations,
+                                (double) cycles / operations,
+                                (double) allocations / operations });
+            std::cerr << name << ": " << elapsed * 1e9 / operations << " ns/op" << std::endl;
+            return;
+        }
+        calls *= 2;
+    }
+}
+
+void Benchmark::WriteJson(std::ostream &output)
+{
+    output << "{\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &result = results[i];
+        output << (i == 0 ? "\n" : ",\n")
+               << "    {\"group\": \"" << result.group << "\""
+               << ", \"name\": \"" << result.name << "\""
+               << ", \"operations\": " << result.operations
+               << ", \"ns_per_op\": " << result.nsPerOp
+               << ", \"cycles_per_op\": " << result.cyclesPerOp
+               << ", \"allocations_per_op\": " << result.allocationsPerOp << "}";
+    }
+    output << "\n  ]\n}" << std::endl;
+}
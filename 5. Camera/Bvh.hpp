@@ -0,0 +1,461 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Culling.hpp"
+#include "WorkerPool.hpp"
+
+// Bounding volume hierarchy over object bounding spheres, for culling and
+// picking without touching every object. Nodes are split with a binned
+// surface area heuristic and stored flattened in one array, 32 bytes each,
+// with both children of a node next to each other and after their parent.
+//
+// The top of the tree is built on the calling thread until there are enough
+// independent subtrees to keep the WorkerPool busy, the subtrees are then
+// built in parallel, each into its own contiguous block of nodes. Refit()
+// updates the bounds of moving objects without changing the tree's shape,
+// one block per task with a single backwards sweep.
+namespace Bvh {
+    // Interior nodes have count 0 and their children at first and first + 1,
+    // leaves cover indices[first, first + count)
+    struct Node {
+        float minX, minY, minZ;
+        uint32_t first;
+        float maxX, maxY, maxZ;
+        uint32_t count;
+    };
+
+    // A subtree built by one task: its root and the block of nodes below it
+    struct Subtree {
+        uint32_t root;
+        uint32_t begin;
+        uint32_t end;
+    };
+
+    struct Tree {
+        std::vector<Node> nodes;
+        std::vector<uint32_t> indices;
+        uint32_t nodeCount;
+
+        std::vector<Subtree> subtrees;
+
+        // Nodes above the subtrees, in the order they were created
+        std::vector<uint32_t> topNodes;
+    };
+
+    static void Build(Tree &tree, const Culling::Spheres &spheres, uint32_t count);
+    static void Refit(Tree &tree, const Culling::Spheres &spheres);
+    static uint32_t QueryFrustum(const Tree &tree, const Culling::Spheres &spheres, const Culling::Frustum &frustum, uint32_t *visible);
+    static bool Raycast(const Tree &tree, const Culling::Spheres &spheres, const glm::vec3 &origin, const glm::vec3 &direction,
+                        uint32_t *hitIndex, float *hitDistance);
+}
+
+namespace Bvh {
+    static const uint32_t maxLeafSize = 4;
+    static const int binCount = 16;
+
+    // Past this depth nodes are split at the median instead, which bounds
+    // the depth of the whole tree and so the traversal stacks
+    static const int sahDepth = 48;
+    static const int maxDepth = sahDepth + 32;
+
+    // Build time copy of a sphere. The builder partitions these together
+    // with the object index, so every pass over a range reads memory in order
+    struct Primitive {
+        float center[3];
+        float radius;
+        uint32_t object;
+    };
+
+    struct Range {
+        uint32_t node;
+        uint32_t first;
+        uint32_t count;
+        int depth;
+    };
+
+    static bool SplitNode(Tree &tree, Primitive *primitives, const Range &range, uint32_t *nextNode);
+    static void BuildSubtree(Tree &tree, Primitive *primitives, const Range &range, uint32_t *nextNode);
+    static void RefitNode(Tree &tree, const Culling::Spheres &spheres, Node &node);
+
+    static float SurfaceArea(const float bounds[6])
+    {
+        float x = bounds[3] - bounds[0], y = bounds[4] - bounds[1], z = bounds[5] - bounds[2];
+        return x * y + y * z + z * x;
+    }
+
+    static void Grow(float bounds[6], const float center[3], float radius)
+    {
+        for (int axis = 0; axis < 3; axis++) {
+            bounds[axis] = std::min(bounds[axis], center[axis] - radius);
+            bounds[axis + 3] = std::max(bounds[axis + 3], center[axis] + radius);
+        }
+    }
+}
+
+void Bvh::Build(Tree &tree, const Culling::Spheres &spheres, uint32_t count)
+{
+    tree.subtrees.clear();
+    tree.topNodes.clear();
+    tree.nodeCount = 0;
+    if (count == 0)
+        return;
+
+    // A binary tree with at least one object per leaf never needs more
+    tree.nodes.resize(2 * count - 1);
+    tree.indices.resize(count);
+
+    std::vector<Primitive> primitives(count);
+    for (uint32_t i = 0; i < count; i++)
+        primitives[i] = { { spheres.centerX[i], spheres.centerY[i], spheres.centerZ[i] }, spheres.radius[i], i };
+
+    // Split serially, until the pieces are small enough to give every
+    // thread a few of them
+    uint32_t nextNode = 1;
+    uint32_t subtreeSize = std::max(4096u, count / (4 * WorkerPool::ThreadCount()));
+    std::vector<Range> pending = { { 0, 0, count, 0 } };
+    std::vector<Range> subtreeRanges;
+
+    while (!pending.empty()) {
+        Range range = pending.back();
+        pending.pop_back();
+
+        if (range.count <= subtreeSize) {
+            subtreeRanges.push_back(range);
+            continue;
+        }
+
+        SplitNode(tree, primitives.data(), range, &nextNode);
+        const Node &node = tree.nodes[range.node];
+        uint32_t leftCount = tree.nodes[node.first].count;
+        tree.topNodes.push_back(range.node);
+        pending.push_back({ node.first, range.first, leftCount, range.depth + 1 });
+        pending.push_back({ node.first + 1, range.first + leftCount, range.count - leftCount, range.depth + 1 });
+    }
+
+    // A subtree over n objects has at most 2n - 2 nodes below its root, so
+    // every subtree gets a block that size and the blocks never overlap
+    for (const Range &range : subtreeRanges) {
+        tree.subtrees.push_back({ range.node, nextNode, nextNode });
+        nextNode += 2 * range.count - 2;
+    }
+
+    WorkerPool::ParallelFor((uint32_t) subtreeRanges.size(), [&](uint32_t i) {
+        uint32_t subtreeNext = tree.subtrees[i].begin;
+        BuildSubtree(tree, primitives.data(), subtreeRanges[i], &subtreeNext);
+        tree.subtrees[i].end = subtreeNext;
+    });
+
+    for (uint32_t i = 0; i < count; i++)
+        tree.indices[i] = primitives[i].object;
+
+    tree.nodeCount = (uint32_t) tree.topNodes.size() + (uint32_t) tree.subtrees.size();
+    for (const Subtree &subtree : tree.subtrees)
+        tree.nodeCount += subtree.end - subtree.begin;
+}
+
+void Bvh::BuildSubtree(Tree &tree, Primitive *primitives, const Range &range, uint32_t *nextNode)
+{
+    if (!SplitNode(tree, primitives, range, nextNode))
+        return;
+
+    // SplitNode() leaves each child's object count in the child
+    uint32_t left = tree.nodes[range.node].first;
+    uint32_t leftCount = tree.nodes[left].count;
+    BuildSubtree(tree, primitives, { left, range.first, leftCount, range.depth + 1 }, nextNode);
+    BuildSubtree(tree, primitives, { left + 1, range.first + leftCount, range.count - leftCount, range.depth + 1 }, nextNode);
+}
+
+bool Bvh::SplitNode(Tree &tree, Primitive *primitives, const Range &range, uint32_t *nextNode)
+{
+    Node &node = tree.nodes[range.node];
+    Primitive *begin = primitives + range.first;
+    Primitive *end = begin + range.count;
+
+    // Node bounds from the spheres, split decisions from their centers
+    float bounds[6] = { FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    float centerBounds[6] = { FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (Primitive *primitive = begin; primitive != end; primitive++) {
+        Grow(bounds, primitive->center, primitive->radius);
+        Grow(centerBounds, primitive->center, 0.0f);
+    }
+
+    node.minX = bounds[0]; node.minY = bounds[1]; node.minZ = bounds[2];
+    node.maxX = bounds[3]; node.maxY = bounds[4]; node.maxZ = bounds[5];
+    node.first = range.first;
+    node.count = range.count;
+    if (range.count <= maxLeafSize)
+        return false;
+
+    int axis = 0;
+    for (int i = 1; i < 3; i++)
+        if (centerBounds[i + 3] - centerBounds[i] > centerBounds[axis + 3] - centerBounds[axis])
+            axis = i;
+
+    float extent = centerBounds[axis + 3] - centerBounds[axis];
+    float scale = binCount * (1.0f - 1e-5f) / extent;
+    Primitive *middle = begin;
+
+    if (extent > 0.0f && range.depth < sahDepth) {
+        float binBounds[binCount][6];
+        uint32_t binObjects[binCount] = {};
+        for (int b = 0; b < binCount; b++) {
+            std::fill(binBounds[b], binBounds[b] + 3, FLT_MAX);
+            std::fill(binBounds[b] + 3, binBounds[b] + 6, -FLT_MAX);
+        }
+
+        for (Primitive *primitive = begin; primitive != end; primitive++) {
+            int b = (int) ((primitive->center[axis] - centerBounds[axis]) * scale);
+            Grow(binBounds[b], primitive->center, primitive->radius);
+            binObjects[b]++;
+        }
+
+        // Sweep from the right to get the cost of every right hand side,
+        // then from the left to pick the cheapest split plane
+        float rightArea[binCount];
+        uint32_t rightObjects[binCount];
+        float sweep[6] = { FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        uint32_t sweepObjects = 0;
+        for (int b = binCount - 1; b > 0; b--) {
+            for (int a = 0; a < 3; a++) {
+                sweep[a] = std::min(sweep[a], binBounds[b][a]);
+                sweep[a + 3] = std::max(sweep[a + 3], binBounds[b][a + 3]);
+            }
+            sweepObjects += binObjects[b];
+            rightObjects[b] = sweepObjects;
+            rightArea[b] = sweepObjects > 0 ? SurfaceArea(sweep) : 0.0f;
+        }
+
+        float bestCost = FLT_MAX;
+        int bestSplit = -1;
+        std::fill(sweep, sweep + 3, FLT_MAX);
+        std::fill(sweep + 3, sweep + 6, -FLT_MAX);
+        sweepObjects = 0;
+        for (int b = 0; b < binCount - 1; b++) {
+            for (int a = 0; a < 3; a++) {
+                sweep[a] = std::min(sweep[a], binBounds[b][a]);
+                sweep[a + 3] = std::max(sweep[a + 3], binBounds[b][a + 3]);
+            }
+            sweepObjects += binObjects[b];
+            if (sweepObjects == 0 || rightObjects[b + 1] == 0)
+                continue;
+
+            float cost = sweepObjects * SurfaceArea(sweep) + rightObjects[b + 1] * rightArea[b + 1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+
+        if (bestSplit >= 0) {
+            middle = std::partition(begin, end, [&](const Primitive &primitive) {
+                return (int) ((primitive.center[axis] - centerBounds[axis]) * scale) <= bestSplit;
+            });
+        }
+    }
+
+    // All centers in one spot or too deep: halve it
+    if (middle == begin || middle == end) {
+        middle = begin + range.count / 2;
+        std::nth_element(begin, middle, end, [axis](const Primitive &a, const Primitive &b) {
+            return a.center[axis] < b.center[axis];
+        });
+    }
+
+    // The children are leaves until they are split themselves, their count
+    // tells the caller where the ranges divide
+    uint32_t leftCount = (uint32_t) (middle - begin);
+    uint32_t left = *nextNode;
+    *nextNode += 2;
+    tree.nodes[left].count = leftCount;
+    tree.nodes[left + 1].count = range.count - leftCount;
+    node.first = left;
+    node.count = 0;
+    return true;
+}
+
+void Bvh::Refit(Tree &tree, const Culling::Spheres &spheres)
+{
+    // Within a block children come after their parents, so walking it
+    // backwards always sees both children of a node before the node
+    WorkerPool::ParallelFor((uint32_t) tree.subtrees.size(), [&](uint32_t i) {
+        const Subtree &subtree = tree.subtrees[i];
+        for (uint32_t node = subtree.end; node-- > subtree.begin; )
+            RefitNode(tree, spheres, tree.nodes[node]);
+        RefitNode(tree, spheres, tree.nodes[subtree.root]);
+    });
+
+    for (auto node = tree.topNodes.rbegin(); node != tree.topNodes.rend(); ++node)
+        RefitNode(tree, spheres, tree.nodes[*node]);
+}
+
+void Bvh::RefitNode(Tree &tree, const Culling::Spheres &spheres, Node &node)
+{
+    if (node.count == 0) {
+        const Node &left = tree.nodes[node.first];
+        const Node &right = tree.nodes[node.first + 1];
+        node.minX = std::min(left.minX, right.minX);
+        node.minY = std::min(left.minY, right.minY);
+        node.minZ = std::min(left.minZ, right.minZ);
+        node.maxX = std::max(left.maxX, right.maxX);
+        node.maxY = std::max(left.maxY, right.maxY);
+        node.maxZ = std::max(left.maxZ, right.maxZ);
+        return;
+    }
+
+    float bounds[6] = { FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        uint32_t object = tree.indices[i];
+        float center[3] = { spheres.centerX[object], spheres.centerY[object], spheres.centerZ[object] };
+        Grow(bounds, center, spheres.radius[object]);
+    }
+    node.minX = bounds[0]; node.minY = bounds[1]; node.minZ = bounds[2];
+    node.maxX = bounds[3]; node.maxY = bounds[4]; node.maxZ = bounds[5];
+}
+
+uint32_t Bvh::QueryFrustum(const Tree &tree, const Culling::Spheres &spheres, const Culling::Frustum &frustum, uint32_t *visible)
+{
+    if (tree.nodeCount == 0)
+        return 0;
+
+    // Each stack entry carries the planes its node still straddles. Once a
+    // node is inside all of them its whole subtree is visible untested
+    struct Entry {
+        uint32_t node;
+        uint32_t planeMask;
+    };
+    Entry stack[maxDepth * 2];
+    int stackSize = 0;
+    stack[stackSize++] = { 0, 0x3f };
+
+    uint32_t visibleCount = 0;
+    while (stackSize > 0) {
+        Entry entry = stack[--stackSize];
+        const Node &node = tree.nodes[entry.node];
+
+        float centerX = (node.minX + node.maxX) * 0.5f, extentX = (node.maxX - node.minX) * 0.5f;
+        float centerY = (node.minY + node.maxY) * 0.5f, extentY = (node.maxY - node.minY) * 0.5f;
+        float centerZ = (node.minZ + node.maxZ) * 0.5f, extentZ = (node.maxZ - node.minZ) * 0.5f;
+
+        bool outside = false;
+        uint32_t planeMask = entry.planeMask;
+        for (int plane = 0; plane < 6 && !outside; plane++) {
+            if (!(planeMask & (1u << plane)))
+                continue;
+
+            float distance = frustum.normalX[plane] * centerX + frustum.normalY[plane] * centerY +
+                             frustum.normalZ[plane] * centerZ + frustum.distance[plane];
+            float radius = fabsf(frustum.normalX[plane]) * extentX + fabsf(frustum.normalY[plane]) * extentY +
+                           fabsf(frustum.normalZ[plane]) * extentZ;
+            if (distance < -radius)
+                outside = true;
+            else if (distance >= radius)
+                planeMask &= ~(1u << plane);
+        }
+        if (outside)
+            continue;
+
+        if (node.count == 0) {
+            stack[stackSize++] = { node.first, planeMask };
+            stack[stackSize++] = { node.first + 1, planeMask };
+            continue;
+        }
+
+        for (uint32_t i = node.first; i < node.first + node.count; i++) {
+            uint32_t object = tree.indices[i];
+            bool inside = true;
+            for (int plane = 0; plane < 6; plane++) {
+                if (!(planeMask & (1u << plane)))
+                    continue;
+
+                float distance = frustum.normalX[plane] * spheres.centerX[object] +
+                                 frustum.normalY[plane] * spheres.centerY[object] +
+                                 frustum.normalZ[plane] * spheres.centerZ[object] + frustum.distance[plane];
+                inside &= distance >= -spheres.radius[object];
+            }
+            visible[visibleCount] = object;
+            visibleCount += inside;
+        }
+    }
+    return visibleCount;
+}
+
+bool Bvh::Raycast(const Tree &tree, const Culling::Spheres &spheres, const glm::vec3 &origin, const glm::vec3 &direction,
+                  uint32_t *hitIndex, float *hitDistance)
+{
+    if (tree.nodeCount == 0)
+        return false;
+
+    glm::vec3 dir = glm::normalize(direction);
+    glm::vec3 inverseDirection(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+    float closest = FLT_MAX;
+    bool hit = false;
+
+    // Slab test, returns the entry distance or FLT_MAX for a miss or
+    // anything farther away than the closest hit so far
+    auto intersectNode = [&](const Node &node) {
+        float t1 = (node.minX - origin.x) * inverseDirection.x, t2 = (node.maxX - origin.x) * inverseDirection.x;
+        float nearT = std::min(t1, t2), farT = std::max(t1, t2);
+        t1 = (node.minY - origin.y) * inverseDirection.y; t2 = (node.maxY - origin.y) * inverseDirection.y;
+        nearT = std::max(nearT, std::min(t1, t2)); farT = std::min(farT, std::max(t1, t2));
+        t1 = (node.minZ - origin.z) * inverseDirection.z; t2 = (node.maxZ - origin.z) * inverseDirection.z;
+        nearT = std::max(nearT, std::min(t1, t2)); farT = std::min(farT, std::max(t1, t2));
+        return farT >= std::max(nearT, 0.0f) && nearT < closest ? nearT : FLT_MAX;
+    };
+
+    uint32_t stack[maxDepth * 2];
+    int stackSize = 0;
+    if (intersectNode(tree.nodes[0]) != FLT_MAX)
+        stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        const Node &node = tree.nodes[stack[--stackSize]];
+
+        if (node.count > 0) {
+            for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                uint32_t object = tree.indices[i];
+                glm::vec3 offset = origin - glm::vec3(spheres.centerX[object], spheres.centerY[object], spheres.centerZ[object]);
+                float b = glm::dot(offset, dir);
+                float c = glm::dot(offset, offset) - spheres.radius[object] * spheres.radius[object];
+                float discriminant = b * b - c;
+                if (discriminant < 0.0f)
+                    continue;
+
+                // Inside the sphere counts as a hit at distance zero
+                float t = std::max(-b - sqrtf(discriminant), 0.0f);
+                if ((t > 0.0f || c <= 0.0f) && t < closest) {
+                    closest = t;
+                    *hitIndex = object;
+                    hit = true;
+                }
+            }
+            continue;
+        }
+
+        // Visit the nearer child first so the far one is often skipped
+        float leftT = intersectNode(tree.nodes[node.first]);
+        float rightT = intersectNode(tree.nodes[node.first + 1]);
+        if (leftT > rightT) {
+            std::swap(leftT, rightT);
+            if (leftT != FLT_MAX) {
+                if (rightT != FLT_MAX)
+                    stack[stackSize++] = node.first;
+                stack[stackSize++] = node.first + 1;
+            }
+        } else if (leftT != FLT_MAX) {
+            if (rightT != FLT_MAX)
+                stack[stackSize++] = node.first + 1;
+            stack[stackSize++] = node.first;
+        }
+    }
+
+    if (hit)
+        *hitDistance = closest;
+    return hit;
+}
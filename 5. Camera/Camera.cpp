@@ -1,67 +1,256 @@
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <vector>
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include "Bvh.hpp"
+#include "CoordinateSystem.hpp"
+#include "Culling.hpp"
+#include "GeometryStore.hpp"
+#include "GlState.hpp"
+#include "GpuCulling.hpp"
+#include "MeshFile.hpp"
+#include "MeshImporter.hpp"
+#include "MeshOptimizer.hpp"
+#include "MeshSimplifier.hpp"
+#include "Profiler.hpp"
+#include "RenderQueue.hpp"
+#include "SceneGraph.hpp"
+#include "Shader.hpp"
+#include "ShaderWatcher.hpp"
+#include "SpscQueue.hpp"
+#include "StreamBuffer.hpp"
+#include "Transformation.hpp"
+#include "VertexFormat.hpp"
+#include "WorkerPool.hpp"
+
 #define WINDOW_WIDTH    1024
 #define WINDOW_HEIGHT   768
 
+// Meshes are written at full precision and only exist like this on the
+// CPU, the GPU gets them encoded into vertexLayout. Imported meshes come
+// out in the same layout
+typedef MeshImporter::Vertex Vertex;
+
 static void renderScene();
+static int runThreaded();
+static void setContextCurrent(bool current);
+static void reloadShaders();
 static void processInput(GLFWwindow *window);
-static void mouseCallback(GLFWwindow *window, double xPos, double yPos);
-
-namespace Shader {
-	static GLuint CreateShaderProgram(const std::string &vertexPath, const std::string &fragmentPath);
-	static GLuint LinkShaders(GLuint vertexShader, GLuint fragmentShader);
-	static GLuint CompileShader(GLenum shaderType, const std::string &shaderCode);
-	static std::string ReadShaderFile(const std::string &shaderFilePath);
+static void pickObject(float x, float y);
+static void compareCulling(const Culling::Frustum &frustum);
+static void mouseCallback(GLFWwindow *, double xPos, double yPos);
+static glm::vec3 lookDirection(float yaw, float pitch);
+static void parseArguments(int argc, char **argv);
+static VertexFormat::Source meshSource(const Vertex *vertices);
+static void addMeshRadius(uint32_t mesh, float radius);
+static uint32_t addMesh(const char *name, Vertex *vertices, GLuint vertexCount, GLuint *indices, GLuint indexCount);
+static double getTime();
+
+namespace Instancing {
+    static void AddMeshes();
+    static void CreateInstances(int count);
+    static uint32_t CullInstances(const Culling::Frustum &frustum);
+    static bool PickInstance(const glm::vec3 &origin, const glm::vec3 &direction, uint32_t *index, float *distance);
+    static void SelectLods(uint32_t visibleCount);
+    static void UpdateMatrices(float time, uint32_t visibleCount, glm::mat4 *matrices);
+    static void AddDraws(GeometryStore::Batch &batch);
+    static void BindMatrices(GLintptr offset);
+    static void DestroyInstances();
 }
 
-namespace Transformation {
-    static glm::mat4 Translation(glm::mat4 const &matrix, glm::vec3 const &position);
-    static glm::mat4 Rotation(glm::mat4 const &matrix, float angleDegrees, glm::vec3 const &axis);
-    static glm::mat4 Scaling(glm::mat4 const &matrix, glm::vec3 const &scale);
+namespace CameraUniforms {
+    // Shared by every program, laid out with std140 rules
+    struct Block {
+        glm::mat4 viewMatrix;
+        glm::mat4 projectionMatrix;
+        glm::mat4 viewProjectionMatrix;
+    };
+
+    static const GLuint bindingPoint = 0;
+
+    static void Create();
+    static void BindProgram(GLuint program);
+    static bool Update(glm::vec3 const &position, glm::vec3 const &target, glm::vec3 const &up, glm::mat4 const &projection);
+    static const glm::mat4 &ViewProjectionMatrix();
+    static void Destroy();
 }
 
-namespace CoordinateSystem {
-    static glm::mat4 ModelMatrix(glm::vec3 position, float angle, glm::vec3 rotationAxis, glm::vec3 const &scaling);
-    static glm::mat4 ViewMatrix(glm::vec3 cameraPosition, glm::vec3 cameraTarget, glm::vec3 cameraUp);
-    static glm::mat4 PerspectiveProjectionMatrix(float FoVY, float aspectRatio, float nearZ, float farZ);
-    static glm::mat4 OrthographicProjectionMatrix(float left, float right, float bottom, float top, float near, float far);
+namespace Headless {
+    static bool CreateContext();
+    static void CreateFramebuffer(int width, int height, int samples);
+    static void Present();
+    static void MakeCurrent(bool current);
+    static void DestroyContext();
 }
 
-glm::mat4 CameraMatrix(glm::vec3 const &position, glm::vec3 const &target, glm::vec3 const &up);
+// With --threaded the camera and the animation clock move in fixed steps on
+// a thread of their own. The main thread only pumps window events and hands
+// what it saw to the simulation, the render thread takes the last two
+// states the simulation finished and draws something in between them
+namespace Simulation {
+    // Everything the simulation owns after one step. stamp is the wall clock
+    // time the step belongs to, time is what animations run on; it falls
+    // behind stamp when the render thread can't keep up
+    struct State {
+        double stamp;
+        double time;
+        glm::vec3 cameraPos;
+        glm::vec3 cameraFront;
+
+        // Clicked since the previous state, in window coordinates
+        bool pick;
+        float pickX, pickY;
+    };
+
+    // Keyboard and mouse as the main thread last saw them
+    struct Input {
+        uint8_t moveKeys;
+        float yaw, pitch;
+        bool pick;
+        float cursorX, cursorY;
+    };
+
+    enum MoveKey {
+        MoveForward = 1,
+        MoveBackward = 2,
+        MoveLeft = 4,
+        MoveRight = 8
+    };
+
+    static const double step = 1.0 / 120.0;
+
+    static void Start();
+    static bool PushInput(const Input &input);
+    static State Interpolate(double now);
+    static void Stop();
+    static void PrintStats();
+}
 
 GLFWwindow *window;
 
 const char *vertexShaderPath = "vertexShader.glsl";
+const char *instancedVertexShaderPath = "instancedVertexShader.glsl";
 const char *fragmentShaderPath = "fragmentShader.glsl";
+const char *cullingComputeShaderPath = "cullingComputeShader.glsl";
 
 GLuint shaderProgram;
 GLuint shaderModelMatrixLocation;
-GLuint shaderViewMatrixLocation;
-GLuint shaderProjectionMatrixLocation;
 
-GLuint VAO;
-GLuint VBO;
-GLuint IBO;
+// Shader hot-reload. The watcher thread only hands over sources, so the
+// last known source of both stages is kept here to relink from
+const char *activeVertexShaderPath;
+std::string vertexShaderSource;
+std::string fragmentShaderSource;
+Shader::PendingProgram reloadProgram;
+bool reloadPending = false;
+
+// Every mesh lives in the same vertex and index buffers behind one VAO
+GeometryStore::Store geometry;
+uint32_t cubeMesh;
+
+// Simplified versions of a mesh, indexed by the mesh they were made from.
+// The first entry is the mesh itself, errors are in the mesh's own units
+// and grow along the chain. Meshes without levels have an empty chain
+struct LodChain {
+    std::vector<uint32_t> meshes;
+    std::vector<float> errors;
+};
+
+std::vector<LodChain> lodChains;
+
+// Radius of the sphere around its origin that holds each mesh, in the
+// mesh's own units. Imported meshes keep whatever size they had, so
+// culling, picking and spacing the instances go by this
+std::vector<float> meshRadius;
+
+// The instanced draws of the only material we have, one command per mesh
+GeometryStore::Batch instanceBatch;
+
+// With --sort-draws every visible instance goes through here each frame,
+// keyed by the draw it belongs to and its depth
+RenderQueue::Queue drawQueue;
+
+// Model matrices are rewritten every frame, straight into a mapped region
+// of this ring buffer
+StreamBuffer::Buffer instanceStream;
+
+// With --gpu-cull the matrices are built on the GPU instead, only for the
+// instances a compute shader found visible
+GpuCulling::Culler gpuCuller;
+
+// Per instance placement, structure of arrays like the scene graph that
+// turns it into model matrices
+struct Instances {
+    std::vector<float> positionX, positionY, positionZ;
+    std::vector<float> angularSpeed;
+    std::vector<float> axisX, axisY, axisZ;
+    std::vector<float> scaleX, scaleY, scaleZ;
+
+    // Bounding spheres for culling share the position arrays as centers
+    std::vector<float> radius;
+
+    // Index into meshes, which lists the meshes instances can be drawn with
+    std::vector<uint32_t> mesh;
+    std::vector<uint32_t> meshes;
+
+    // Level of detail every instance was drawn with last time it was
+    // visible. lodMeshes and lodErrors hold lodLevels entries per mesh,
+    // chains shorter than that repeat their last level
+    std::vector<uint8_t> lod;
+    std::vector<uint32_t> lodMeshes;
+    std::vector<float> lodErrors;
+    uint32_t lodLevels;
+
+    // One node per instance, in the same order. Only the spinning ones
+    // get their matrices rebuilt, and only the visible matrices are copied
+    // into the stream buffer
+    SceneGraph::Graph scene;
+    std::vector<uint32_t> spinning;
+    std::vector<uint32_t> visible;
+
+    // Visible instances per mesh and level this frame, their matrices are
+    // grouped by both so every draw command covers one contiguous range
+    std::vector<uint32_t> meshVisible;
+    std::vector<uint32_t> meshOffset;
+};
+
+Instances instances;
+
+// Hierarchy over the instance bounds, used for picking and, with --bvh,
+// for culling. The grid never moves, so it is only built once
+Bvh::Tree instanceTree;
+float farPlane = 10.0f;
+
+// The window never changes size, so this only has to be built once
+glm::mat4 projectionMatrix(1.0f);
 
 bool firstMouse = true;
 float yaw = -90.0f;
 float pitch = 0.0f;
 float lastX = WINDOW_WIDTH / 2.0f;
 float lastY = WINDOW_HEIGHT / 2.0f;
+bool pickButtonDown = false;
 
-struct Vertex {
-    glm::vec3 position;
-    uint32_t padding;
-    glm::vec3 color;
-};
+// Half float positions and unorm8 colors unless --vertex-format says
+// otherwise
+VertexFormat::Layout vertexLayout = VertexFormat::MakeLayout(VertexFormat::PositionHalf, VertexFormat::NormalNone,
+                                                             VertexFormat::ColorUnorm8);
 
 glm::vec3 cameraPos = glm::vec3(0.0f, 0.0f, 3.0f);
 glm::vec3 cameraFront = glm::vec3(0.0f, 0.0f, -1.0f);
@@ -70,68 +259,164 @@ glm::vec3 cameraUp = glm::vec3(0.0f, 1.0f, 0.0f);
 float deltaTime = 0.0f;
 float lastFrame = 0.0f;
 
-int main()
+// Input the simulation has not received yet, a click stays pending until
+// it has been handed over
+Simulation::Input pendingInput = {};
+
+// Command line options. --headless renders into an offscreen framebuffer
+// without a window, --frames N stops after N frames and prints throughput,
+// --profile writes a Chrome trace of every frame to the given file,
+// --instances N draws a grid of N spinning cubes with one instanced draw,
+// --bvh culls them through the bounding volume hierarchy, --gpu-cull
+// culls them in a compute shader and draws indirectly, --cull-compare
+// additionally culls on the CPU and reads the GPU result back to check it,
+// --optimize-meshes reorders every mesh for the vertex cache, overdraw and
+// vertex fetch before it is uploaded, --mesh draws the meshes of an OBJ or
+// PLY file, or of a file written by meshconvert, instead of the built-in ones,
+// --lod simplifies every mesh into a chain of levels of detail and draws
+// each instance with the coarsest one whose error stays under a pixel on
+// screen, --lod-error sets that limit in pixels, --threaded runs the
+// simulation, the rendering and the window events on three threads,
+// --sort-draws orders the instances of every draw front to back through a
+// radix sorted render queue, --static stops the instances from spinning
+bool headless = false;
+int benchmarkFrames = 0;
+const char *profilePath = nullptr;
+int instanceCount = 0;
+bool bvhCulling = false;
+bool gpuCulling = false;
+bool cullCompare = false;
+bool optimizeMeshes = false;
+const char *meshPath = nullptr;
+bool lodEnabled = false;
+float lodPixelError = 1.0f;
+bool threaded = false;
+bool sortDraws = false;
+bool staticInstances = false;
+
+// A level is only given up for a coarser one once its error is this much
+// under the limit, so instances near a switching distance don't flicker
+// between two levels every frame
+const float lodHysteresis = 0.75f;
+
+// Triangles submitted over the whole run, and how many there would have
+// been without levels of detail
+uint64_t lodTriangleTotal = 0;
+uint64_t fullTriangleTotal = 0;
+
+// World matrices the scene graph rebuilt over the whole run
+uint64_t sceneUpdateTotal = 0;
+
+// Culling totals over the whole run, for the summary after a benchmark
+uint64_t visibleTotal = 0;
+uint64_t culledTotal = 0;
+
+// CPU against GPU culling, only filled in with --cull-compare
+double cpuCullingTime = 0.0;
+int cullingMismatches = 0;
+
+int main(int argc, char **argv)
 {
-    // Initialize GLFW
-    if (!glfwInit()) {
-        std::cerr << "Failed to initialize GLFW" << std::endl;
-        std::exit(-1);
+    parseArguments(argc, argv);
+
+    if (headless) {
+        if (!Headless::CreateContext()) {
+            std::cerr << "Failed to create headless EGL context" << std::endl;
+            std::exit(-1);
+        }
+    } else {
+        // Initialize GLFW
+        if (!glfwInit()) {
+            std::cerr << "Failed to initialize GLFW" << std::endl;
+            std::exit(-1);
+        }
+
+        // Setup GLFW context OpenGL
+        // Enable 4x MSAA
+        glfwWindowHint(GLFW_SAMPLES, 4);
+
+        // Setting OpenGL version 3.3, compute shaders need 4.3
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, gpuCulling ? 4 : 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+
+        // Uses the more modern OpenGL(3.0 or above) and doesn't use the old
+        // functionality
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+
+        // Uses only modern OpenGL APIs and does not rely on legacy features which
+        // may not be available on all hardware
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+        // Creating Window
+        window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Triangle", nullptr, nullptr);
+        if (window == nullptr) {
+            std::cerr << "Failed to Create GLFW window" << std::endl;
+            glfwTerminate();
+            std::exit(-1);
+        }
+
+        // set OpenGL context to window. This means that all subsequent OpenGL
+        // operations perform will impact this window
+        glfwMakeContextCurrent(window);
+
+        // setting GLFW manages keyboard key input
+        glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
+        glfwSetCursorPosCallback(window, mouseCallback);
+
+        // Don't wait for vsync when measuring throughput
+        if (benchmarkFrames > 0)
+            glfwSwapInterval(0);
     }
 
-    // Setup GLFW context OpenGL
-    // Enable 4x MSAA
-    glfwWindowHint(GLFW_SAMPLES, 4);
-
-    // Setting OpenGL version 3.3
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-
-    // Uses the more modern OpenGL(3.0 or above) and doesn't use the old
-    // functionality
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-
-    // Uses only modern OpenGL APIs and does not rely on legacy features which
-    // may not be available on all hardware
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
-    // Creating Window
-    window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Triangle", nullptr, nullptr);
-    if (window == nullptr) {
-        std::cerr << "Failed to Create GLFW window" << std::endl;
+    // GLEW built for GLX reports a missing X display when the context comes
+    // from EGL, even though every entry point was loaded
+    glewExperimental = GL_TRUE;
+    GLenum glewStatus = glewInit();
+    if (glewStatus != GLEW_OK && !(headless && glewStatus == GLEW_ERROR_NO_GLX_DISPLAY)) {
+        std::cerr << "Failed to initialize GLEW" << std::endl;
         glfwTerminate();
         std::exit(-1);
     }
 
-    // set OpenGL context to window. This means that all subsequent OpenGL
-    // operations perform will impact this window
-    glfwMakeContextCurrent(window);
+    if (gpuCulling && !GpuCulling::Supported()) {
+        std::cerr << "GPU culling needs OpenGL 4.3, culling on the CPU instead" << std::endl;
+        gpuCulling = false;
+        cullCompare = false;
+    }
 
-    // setting GLFW manages keyboard key input
-    glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
-    glfwSetCursorPosCallback(window, mouseCallback);
+    // Match the 4x MSAA default framebuffer GLFW would have given us
+    if (headless)
+        Headless::CreateFramebuffer(WINDOW_WIDTH, WINDOW_HEIGHT, 4);
 
-    if (glewInit() != GLEW_OK) {
-        std::cerr << "Failed to initialize GLEW" << std::endl;
-        glfwTerminate();
-        std::exit(-1);
-    }
+    GlState::Enable(GL_DEPTH_TEST);
+
+    // The render thread takes part in every parallel loop, so leave it a core
+    int workerCount = std::min((int) std::thread::hardware_concurrency() - 1, 7);
+    if (workerCount > 0)
+        WorkerPool::Start(workerCount);
 
-    glEnable(GL_DEPTH_TEST);
+    // Hand the shaders to the driver first so they compile while the
+    // buffers and instances below are set up
+    activeVertexShaderPath = instanceCount > 0 ? instancedVertexShaderPath : vertexShaderPath;
+    vertexShaderSource = Shader::ReadShaderFile(activeVertexShaderPath);
+    fragmentShaderSource = Shader::ReadShaderFile(fragmentShaderPath);
+    Shader::PendingProgram pendingProgram = Shader::SubmitShaderSources(
+            vertexShaderSource, fragmentShaderSource, "", activeVertexShaderPath, fragmentShaderPath);
 
 	// Define an array of vertices for a simple triangle
     Vertex vertices[] = {
-            // Position - pos 0       Padding      Color - pos 1
+            // Position - pos 0       Color - pos 1
             // Front 
-		{ { -0.5f, -0.5f,  0.5f },	0,		{ 1.0f, 0.0f, 0.0f } },  // Bottom-left
-   		{ {  0.5f, -0.5f,  0.5f },	0,		{ 0.0f, 1.0f, 0.0f } },  // Bottom-right
-   		{ {  0.5f,  0.5f,  0.5f },	0,		{ 0.0f, 0.0f, 1.0f } },  // Top-right
-   		{ { -0.5f,  0.5f,  0.5f },	0,		{ 0.0f, 1.0f, 1.0f } },  // Top-left
+		{ { -0.5f, -0.5f,  0.5f },	{ 1.0f, 0.0f, 0.0f } },  // Bottom-left
+   		{ {  0.5f, -0.5f,  0.5f },	{ 0.0f, 1.0f, 0.0f } },  // Bottom-right
+   		{ {  0.5f,  0.5f,  0.5f },	{ 0.0f, 0.0f, 1.0f } },  // Top-right
+   		{ { -0.5f,  0.5f,  0.5f },	{ 0.0f, 1.0f, 1.0f } },  // Top-left
 
             // Back face
-   		{ { -0.5f, -0.5f, -0.5f },	0,		{ 1.0f, 0.0f, 0.0f } },  // Bottom-left
-   		{ {  0.5f, -0.5f, -0.5f },	0,		{ 0.0f, 1.0f, 0.0f } },  // Bottom-right
-   		{ {  0.5f,  0.5f, -0.5f },	0,		{ 0.0f, 0.0f, 1.0f } },  // Top-right
-   		{ { -0.5f,  0.5f, -0.5f }, 0,		{ 0.0f, 1.0f, 1.0f } }  // Top-left
+   		{ { -0.5f, -0.5f, -0.5f },	{ 1.0f, 0.0f, 0.0f } },  // Bottom-left
+   		{ {  0.5f, -0.5f, -0.5f },	{ 0.0f, 1.0f, 0.0f } },  // Bottom-right
+   		{ {  0.5f,  0.5f, -0.5f },	{ 0.0f, 0.0f, 1.0f } },  // Top-right
+   		{ { -0.5f,  0.5f, -0.5f },	{ 0.0f, 1.0f, 1.0f } }  // Top-left
     };
 
 	GLuint indices[] = {
@@ -160,309 +445,1250 @@ int main()
     5, 4, 0
 };
 
-	// Create and bind a Vertex Array Object (VAO)
-    glGenVertexArrays(1, &VAO);
-    glBindVertexArray(VAO);
-
-	// Create and bind a Vertex Buffer Object (VBO)
-    glGenBuffers(1, &VBO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-
-	// Create and bind a Index Buffer Object (IBO)
-	glGenBuffers(1, &IBO);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IBO);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+	// Collect the meshes, then create the shared VAO, VBO and IBO holding
+	// all of them. The store also defines how the attributes are laid out
+    bool importMesh = meshPath != nullptr && !MeshFile::IsMeshFile(meshPath);
+    std::vector<MeshImporter::Submesh> submeshes;
+    if (importMesh) {
+        double importStart = getTime();
+        if (!MeshImporter::Import(meshPath, submeshes)) {
+            std::cerr << "Failed to import " << meshPath << std::endl;
+            std::exit(-1);
+        }
+        std::cout << "Imported " << meshPath << ": " << submeshes.size() << " meshes in "
+                  << (getTime() - importStart) * 1000.0 << " ms" << std::endl;
+
+        // Imported meshes keep the units of their file, which the compact
+        // positions may not be able to hold. Clamping would squash them, so
+        // they get float positions instead
+        float extent = 0.0f;
+        for (const MeshImporter::Submesh &submesh : submeshes)
+            for (const Vertex &vertex : submesh.vertices)
+                for (int c = 0; c < 3; c++)
+                    extent = std::max(extent, std::fabs(vertex.position[c]));
+        if (extent > VertexFormat::PositionLimit(vertexLayout.position)) {
+            std::cerr << "Warning: " << meshPath << " has positions up to " << extent << ", out of range for "
+                      << VertexFormat::Describe(vertexLayout) << ", using float positions" << std::endl;
+            vertexLayout = VertexFormat::MakeLayout(VertexFormat::PositionFloat, vertexLayout.normal, vertexLayout.color);
+        }
+    }
 
-	// Define how vertex attributes are stored in the VBO
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *) offsetof(Vertex, position));
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *) offsetof(Vertex, color));
+    GeometryStore::Create(geometry, vertexLayout);
+    if (importMesh) {
+        // Text meshes go through the same encoding and optimizing as the
+        // built-in ones
+        for (MeshImporter::Submesh &submesh : submeshes)
+            addMesh(submesh.name.c_str(), submesh.vertices.data(), (GLuint) submesh.vertices.size(),
+                    submesh.indices.data(), (GLuint) submesh.indices.size());
+        cubeMesh = 0;
+        if (instanceCount > 0)
+            Instancing::AddMeshes();
+        GeometryStore::Upload(geometry);
+    } else if (meshPath != nullptr) {
+        // Already encoded, the mapped file goes to the GPU as it is and the
+        // first mesh in it stands in for the cube
+        MeshFile::File meshFile;
+        if (!MeshFile::Open(meshFile, meshPath) || meshFile.header->submeshCount == 0) {
+            std::cerr << "Failed to load " << meshPath << std::endl;
+            std::exit(-1);
+        }
+        MeshFile::Upload(meshFile, geometry);
+        const uint8_t *encoded = MeshFile::Vertices(meshFile);
+        for (uint32_t mesh = 0; mesh < geometry.meshes.size(); mesh++) {
+            const GeometryStore::Mesh &range = geometry.meshes[mesh];
+            float radius = 0.0f;
+            for (uint32_t i = 0; i < range.vertexCount; i++) {
+                const uint8_t *vertex = encoded + (size_t) (range.baseVertex + i) * geometry.layout.stride;
+                radius = std::max(radius, glm::length(VertexFormat::DecodePosition(geometry.layout, vertex)));
+            }
+            addMeshRadius(mesh, radius);
+        }
+        MeshFile::Close(meshFile);
+        cubeMesh = 0;
+        if (instanceCount > 0)
+            Instancing::AddMeshes();
+    } else {
+        cubeMesh = addMesh("cube", vertices, 8, indices, 36);
+        if (instanceCount > 0)
+            Instancing::AddMeshes();
+        GeometryStore::Upload(geometry);
+    }
+    GeometryStore::PrintStats(geometry);
 
-	// Enable vertex attribute arrays
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
+    // Per instance model matrices come from a second buffer on the same VAO
+    if (instanceCount > 0)
+        Instancing::CreateInstances(instanceCount);
 
 	// Unbind the VAO
-    glBindVertexArray(0);
+    GlState::BindVertexArray(0);
 
-	// Create and compile a shader program vertex shader and fragment shader.
-    shaderProgram = Shader::CreateShaderProgram(vertexShaderPath, fragmentShaderPath);
-    glUseProgram(shaderProgram);
+	// Wait for the shader program submitted above, first use needs it linked
+    shaderProgram = Shader::FinishShaderProgram(pendingProgram);
+    GlState::UseProgram(shaderProgram);
+    ProgramCache::PrintStats();
 
 	// Get the location of the "Translation" uniform variable in the shader.
     shaderModelMatrixLocation = glGetUniformLocation(shaderProgram, "ModelMatrix");
-    shaderViewMatrixLocation = glGetUniformLocation(shaderProgram, "ViewMatrix");
-    shaderProjectionMatrixLocation = glGetUniformLocation(shaderProgram, "ProjectionMatrix");
 
-    // Check if the ESC key was pressed or the window was closed
-    while (glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_PRESS && !glfwWindowShouldClose(window)) {
+    // View and projection come from the camera uniform block instead
+    CameraUniforms::Create();
+    CameraUniforms::BindProgram(shaderProgram);
+
+    projectionMatrix = CoordinateSystem::PerspectiveProjectionMatrix(90.0f, (float)WINDOW_WIDTH / WINDOW_HEIGHT, 1.0f, farPlane);
+
+    if (profilePath != nullptr)
+        Profiler::Initialize();
+
+    // Nobody edits shaders during a headless benchmark
+    if (!headless)
+        ShaderWatcher::Start({ activeVertexShaderPath, fragmentShaderPath });
+
+    double startTime = getTime();
+    int frameCount = 0;
+
+    // Check if the ESC key was pressed or the window was closed. Headless
+    // runs have no window, so they only stop after the requested frames
+    while (!threaded && (benchmarkFrames == 0 || frameCount < benchmarkFrames)) {
+        if (!headless && (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS || glfwWindowShouldClose(window)))
+            break;
+
+        // Swap in edited shaders between frames, never halfway through one
+        if (!headless)
+            reloadShaders();
+
         renderScene();
+        frameCount++;
+    }
+
+    if (threaded)
+        frameCount = runThreaded();
+
+    if (benchmarkFrames > 0) {
+        // Wait for the last frame so the GPU work is part of the measurement
+        glFinish();
+        double elapsed = getTime() - startTime;
+
+        // A window closed before the first frame leaves nothing to average
+        if (frameCount > 0) {
+            std::cout << "Rendered " << frameCount << " frames in " << elapsed << " s: "
+                      << frameCount / elapsed << " frames/s, "
+                      << elapsed * 1000.0 / frameCount << " ms/frame" << std::endl;
+
+            if (instanceCount > 0 && !gpuCulling)
+                std::cout << "Instance stream: " << (instanceStream.persistent ? "persistent" : "unsynchronized")
+                          << " mapping, " << instanceStream.stalls << " stalls" << std::endl;
+
+            // The GPU keeps its counts to itself unless we ask for them
+            if (!gpuCulling || cullCompare)
+                std::cout << "Culling: " << visibleTotal / frameCount << " visible, "
+                          << culledTotal / frameCount << " culled per frame" << std::endl;
+
+            if (lodEnabled && instanceCount > 0 && !gpuCulling)
+                std::cout << "LOD: " << lodTriangleTotal / frameCount << " triangles per frame, "
+                          << fullTriangleTotal / frameCount << " at full detail" << std::endl;
+
+            if (instanceCount > 0 && !gpuCulling)
+                std::cout << "Scene graph: " << sceneUpdateTotal / frameCount << " of " << instanceCount
+                          << " world matrices rebuilt per frame" << std::endl;
+
+            GlState::PrintStats(frameCount);
+
+            if (threaded)
+                Simulation::PrintStats();
+
+            if (cullCompare)
+                std::cout << "Culling compare: CPU " << cpuCullingTime * 1000.0 / frameCount << " ms/frame, GPU results differed in "
+                          << cullingMismatches << " of " << frameCount << " frames" << std::endl;
+        }
+    }
+
+    if (profilePath != nullptr) {
+        Profiler::PrintSummary();
+        Profiler::WriteChromeTrace(profilePath);
+        Profiler::Shutdown();
     }
 
     // Clean up
+    ShaderWatcher::Stop();
+    WorkerPool::Stop();
+    if (reloadPending)
+        glDeleteProgram(Shader::FinishShaderProgram(reloadProgram));
+
+    if (instanceCount > 0)
+        Instancing::DestroyInstances();
+
+    CameraUniforms::Destroy();
     glDeleteProgram(shaderProgram);
-    glDeleteBuffers(1, &VBO);
-    glDeleteVertexArrays(1, &VAO);
+    GeometryStore::Destroy(geometry);
 
-    glfwTerminate();
+    if (headless)
+        Headless::DestroyContext();
+    else
+        glfwTerminate();
 
     return 0;
 }
 
 void renderScene()
 {
+    Profiler::BeginFrame();
+    GlState::BeginFrame();
+
     // Clear the screen
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    {
+        Profiler::Scope scope("Clear");
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
 
-	float currentFrame = (float)glfwGetTime();
-	deltaTime = currentFrame - lastFrame;
-	lastFrame = currentFrame;
+	float currentFrame;
+	if (threaded) {
+		// The camera belongs to the simulation thread, this frame gets a
+		// copy of it somewhere between its last two steps
+		Profiler::Scope scope("Interpolate", false);
+		Simulation::State state = Simulation::Interpolate(getTime());
+		currentFrame = (float) state.time;
+		cameraPos = state.cameraPos;
+		cameraFront = state.cameraFront;
+		if (state.pick)
+			pickObject(state.pickX, state.pickY);
+	} else {
+		currentFrame = (float)getTime();
+		deltaTime = currentFrame - lastFrame;
+		lastFrame = currentFrame;
+
+		if (!headless) {
+			Profiler::Scope scope("Input", false);
+			processInput(window);
+		}
+	}
+
+    GlState::BindVertexArray(geometry.vertexArray);
 
-	processInput(window);
+    glm::mat4 modelMatrix(1.0f);
+    {
+        Profiler::Scope scope("Matrices", false);
+        modelMatrix = CoordinateSystem::ModelMatrix(glm::vec3(0.0f, 0.f, 2.0f), currentFrame * 60.0f, glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(1.0f));
+    }
 
-    glBindVertexArray(VAO);
+    {
+        Profiler::Scope scope("Uniforms");
+        if (instanceCount == 0)
+            glUniformMatrix4fv(shaderModelMatrixLocation, 1, GL_FALSE, glm::value_ptr(modelMatrix));
 
-    glm::mat4 modelMatrix(1.0f);
-    modelMatrix = CoordinateSystem::ModelMatrix(glm::vec3(0.0f, 0.f, 2.0f), (float)glfwGetTime() * 60.0f, glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(1.0f));
+        // viewMatrix = Transformation::Translation(viewMatrix, glm::vec3(0.0f, 0.0f, -2.0f));
+        // viewMatrix = CameraMatrix(cameraPos, cameraPos + cameraFront, cameraFront);
+        CameraUniforms::Update(cameraPos, cameraFront, cameraUp, projectionMatrix);
+    }
 
-    // glm::mat4 viewMatrix(1.0f);
-    // viewMatrix = Transformation::Translation(viewMatrix, glm::vec3(0.0f, 0.0f, -2.0f));
+    // Cull against the same view projection the shaders get
+    uint32_t visibleCount;
+    GLintptr instanceOffset = 0;
+    if (gpuCulling) {
+        // The count stays on the GPU, the indirect draw reads it from there
+        Culling::Frustum frustum = Culling::ExtractFrustum(CameraUniforms::ViewProjectionMatrix());
+        {
+            Profiler::Scope scope("GPU culling");
+            GpuCulling::Cull(gpuCuller, frustum, currentFrame);
+        }
+        if (cullCompare)
+            compareCulling(frustum);
+
+        // Nobody on the CPU knows how many are visible, the draw is issued
+        // regardless and may well draw nothing
+        GlState::UseProgram(shaderProgram);
+        visibleCount = instanceCount;
+    } else {
+        Profiler::Scope scope("Culling", false);
+        Culling::Frustum frustum = Culling::ExtractFrustum(CameraUniforms::ViewProjectionMatrix());
+
+        if (instanceCount > 0) {
+            visibleCount = Instancing::CullInstances(frustum);
+        } else {
+            // Bounds of whichever mesh stands in for the cube, where it is drawn
+            float centerX = 0.0f, centerY = 0.0f, centerZ = 2.0f, radius = meshRadius[cubeMesh];
+            uint32_t index;
+            visibleCount = Culling::CullScalar(frustum, { &centerX, &centerY, &centerZ, &radius }, 0, 1, &index);
+        }
+
+        uint32_t objectCount = instanceCount > 0 ? instanceCount : 1;
+        visibleTotal += visibleCount;
+        culledTotal += objectCount - visibleCount;
+        Profiler::Counter("Visible", visibleCount);
+        Profiler::Counter("Culled", objectCount - visibleCount);
+    }
 
-    glm::mat4 viewMatrix(1.0f);
-    // viewMatrix = CameraMatrix(cameraPos, cameraPos + cameraFront, cameraFront);
-	viewMatrix = glm::lookAt(cameraPos, cameraFront, cameraUp);
+    if (instanceCount > 0 && visibleCount > 0 && !gpuCulling) {
+        Profiler::Scope scope("Instances", false);
 
-    glm::mat4 projectionMatrix(1.0f);
-    projectionMatrix = CoordinateSystem::PerspectiveProjectionMatrix(90.0f, (float)WINDOW_WIDTH / WINDOW_HEIGHT, 1.0f, 10.f);
+        if (lodEnabled) {
+            Profiler::Scope lodScope("LOD");
+            Instancing::SelectLods(visibleCount);
+        }
 
-    glUniformMatrix4fv(shaderModelMatrixLocation, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-    glUniformMatrix4fv(shaderViewMatrixLocation, 1, GL_FALSE, glm::value_ptr(viewMatrix));
-    glUniformMatrix4fv(shaderProjectionMatrixLocation, 1, GL_FALSE, glm::value_ptr(projectionMatrix));
+        glm::mat4 *matrices = (glm::mat4 *) StreamBuffer::Map(instanceStream, &instanceOffset);
+        Instancing::UpdateMatrices(currentFrame, visibleCount, matrices);
+        StreamBuffer::Unmap(instanceStream);
+        Instancing::BindMatrices(instanceOffset);
+        Instancing::AddDraws(instanceBatch);
+    }
 
-    // glDrawArrays(GL_TRIANGLES, 0, 3);
-	glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
+    if (visibleCount > 0) {
+        Profiler::Scope scope("Draw");
+        // glDrawArrays(GL_TRIANGLES, 0, 3);
+        if (gpuCulling) {
+            GpuCulling::Draw(gpuCuller);
+        } else if (instanceCount > 0) {
+            // One draw for all meshes. Without multi draw indirect the
+            // matrices are rebound for every mesh instead
+            GeometryStore::Submit(instanceBatch, geometry, [instanceOffset](GLuint baseInstance) {
+                Instancing::BindMatrices(instanceOffset + baseInstance * sizeof(glm::mat4));
+            });
+            StreamBuffer::Fence(instanceStream);
+        } else {
+            GeometryStore::DrawMesh(geometry, cubeMesh);
+        }
+    }
 
     // swapping double buffers. This is used when drawing objects or images
     // and can prevent flickering or an uneven appearance
-    glfwSwapBuffers(window);
+    {
+        Profiler::Scope scope("Swap");
+        if (headless)
+            Headless::Present();
+        else
+            glfwSwapBuffers(window);
+    }
+
+    const GlState::Counters &stateChanges = GlState::FrameCounters();
+    Profiler::Counter("GL state issued", stateChanges.issued);
+    Profiler::Counter("GL state elided", stateChanges.elided);
+    Profiler::EndFrame();
 
     // examine and process all events that occur in the GLFW window.
     // This includes user input such as keyboard keys pressed, mouse movement
-    // and other events
-    glfwPollEvents();
+    // and other events. Threaded runs leave that to the main thread, the
+    // only one GLFW allows to
+    if (!headless && !threaded)
+        glfwPollEvents();
 }
 
-GLuint Shader::CreateShaderProgram(const std::string &vertexPath, const std::string &fragmentPath)
+int runThreaded()
 {
-    std::string vertexSource    = Shader::ReadShaderFile(vertexPath);
-    std::string fragmentSource  = Shader::ReadShaderFile(fragmentPath);
+    // A context is current on one thread at a time, from here until the
+    // render thread is done GL belongs to it
+    setContextCurrent(false);
+    Simulation::Start();
+
+    std::atomic<bool> stopRendering(false), renderingDone(false);
+    int frameCount = 0;
+    std::thread renderThread([&]() {
+        setContextCurrent(true);
+        while (!stopRendering.load() && (benchmarkFrames == 0 || frameCount < benchmarkFrames)) {
+            if (!headless)
+                reloadShaders();
+
+            renderScene();
+            frameCount++;
+        }
+        setContextCurrent(false);
+        renderingDone.store(true);
+    });
+
+    // A swap waiting for vsync over there no longer holds up the events.
+    // Keys are sampled at least once per simulation step, even if nothing
+    // happened in between
+    while (!headless && !renderingDone.load()) {
+        glfwWaitEventsTimeout(Simulation::step);
+        if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS || glfwWindowShouldClose(window)) {
+            stopRendering.store(true);
+            break;
+        }
+
+        pendingInput.moveKeys = 0;
+        if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
+            pendingInput.moveKeys |= Simulation::MoveForward;
+        if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
+            pendingInput.moveKeys |= Simulation::MoveBackward;
+        if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
+            pendingInput.moveKeys |= Simulation::MoveLeft;
+        if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
+            pendingInput.moveKeys |= Simulation::MoveRight;
+        pendingInput.yaw = yaw;
+        pendingInput.pitch = pitch;
+
+        bool pickButton = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+        if (pickButton && !pickButtonDown) {
+            pendingInput.pick = true;
+            pendingInput.cursorX = lastX;
+            pendingInput.cursorY = lastY;
+        }
+        pickButtonDown = pickButton;
+
+        if (Simulation::PushInput(pendingInput))
+            pendingInput.pick = false;
+    }
 
-    GLuint vertexShader     = Shader::CompileShader(GL_VERTEX_SHADER, vertexSource);
-    GLuint fragmentShader   = Shader::CompileShader(GL_FRAGMENT_SHADER, fragmentSource);
+    renderThread.join();
+    Simulation::Stop();
+    setContextCurrent(true);
+    return frameCount;
+}
 
-    GLuint programShader = Shader::LinkShaders(vertexShader, fragmentShader);
+void setContextCurrent(bool current)
+{
+    if (headless)
+        Headless::MakeCurrent(current);
+    else
+        glfwMakeContextCurrent(current ? window : nullptr);
+}
 
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
+void parseArguments(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            benchmarkFrames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profilePath = argv[++i];
+        } else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            instanceCount = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bvh") == 0) {
+            bvhCulling = true;
+        } else if (strcmp(argv[i], "--gpu-cull") == 0) {
+            gpuCulling = true;
+        } else if (strcmp(argv[i], "--cull-compare") == 0) {
+            gpuCulling = true;
+            cullCompare = true;
+        } else if (strcmp(argv[i], "--optimize-meshes") == 0) {
+            optimizeMeshes = true;
+        } else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+            meshPath = argv[++i];
+        } else if (strcmp(argv[i], "--lod") == 0) {
+            lodEnabled = true;
+        } else if (strcmp(argv[i], "--lod-error") == 0 && i + 1 < argc) {
+            lodEnabled = true;
+            lodPixelError = (float) atof(argv[++i]);
+        } else if (strcmp(argv[i], "--threaded") == 0) {
+            threaded = true;
+        } else if (strcmp(argv[i], "--sort-draws") == 0) {
+            sortDraws = true;
+        } else if (strcmp(argv[i], "--static") == 0) {
+            staticInstances = true;
+        } else if (strcmp(argv[i], "--vertex-format") == 0 && i + 1 < argc && VertexFormat::ParseLayout(argv[i + 1], vertexLayout)) {
+            i++;
+        } else if (strcmp(argv[i], "--shader-cache") == 0 && i + 1 < argc) {
+            // An empty directory turns the program cache off
+            ProgramCache::SetDirectory(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--headless] [--frames N] [--profile trace.json] [--instances N] [--bvh] [--gpu-cull] [--cull-compare] [--vertex-format float|half|snorm16] [--optimize-meshes] [--mesh file.obj|ply|glmesh] [--lod] [--lod-error pixels] [--threaded] [--sort-draws] [--static] [--shader-cache dir]" << std::endl;
+            std::exit(-1);
+        }
+    }
 
-    return programShader;
+    // There is nothing to cull on the GPU without instances
+    if (instanceCount == 0) {
+        gpuCulling = false;
+        cullCompare = false;
+    }
+
+    // Without a window there is nothing to close, so pick a frame count
+    if (headless && benchmarkFrames <= 0)
+        benchmarkFrames = 1000;
 }
 
-GLuint Shader::LinkShaders(GLuint vertexShader, GLuint fragmentShader)
+void reloadShaders()
 {
-    GLuint programID = glCreateProgram();
-    glAttachShader(programID, vertexShader);
-    glAttachShader(programID, fragmentShader);
-    glLinkProgram(programID);
+    ShaderWatcher::Change change;
+    bool changed = false;
+    while (ShaderWatcher::Poll(change)) {
+        if (change.path == fragmentShaderPath)
+            fragmentShaderSource = change.source;
+        else
+            vertexShaderSource = change.source;
+        changed = true;
+    }
+
+    // A newer save supersedes a program that is still compiling
+    if (changed) {
+        if (reloadPending)
+            Shader::DiscardShaderProgram(reloadProgram);
 
-    int success;
-    glGetProgramiv(programID, GL_LINK_STATUS, &success);
-    if (!success) {
-        char infoLog[512];
-        glGetProgramInfoLog(programID, 512, nullptr, infoLog);
-        std::cerr << "Shader program linking error: " << infoLog << std::endl;
+        reloadProgram = Shader::SubmitShaderSources(vertexShaderSource, fragmentShaderSource, "",
+                                                    activeVertexShaderPath, fragmentShaderPath);
+        reloadPending = true;
     }
-    return programID;
+
+    // Keep drawing with the old program until the driver is done, so a
+    // slow compile never stalls a frame
+    if (!reloadPending || !Shader::IsShaderProgramReady(reloadProgram))
+        return;
+
+    reloadPending = false;
+    GLuint program = Shader::FinishShaderProgram(reloadProgram);
+    if (!reloadProgram.linked) {
+        std::cerr << "Shader reload failed, keeping the previous program" << std::endl;
+        glDeleteProgram(program);
+        return;
+    }
+
+    glDeleteProgram(shaderProgram);
+    shaderProgram = program;
+    GlState::UseProgram(shaderProgram);
+    shaderModelMatrixLocation = glGetUniformLocation(shaderProgram, "ModelMatrix");
+    CameraUniforms::BindProgram(shaderProgram);
+    std::cout << "Reloaded shaders" << std::endl;
 }
 
-GLuint Shader::CompileShader(GLenum shaderType, const std::string &shaderCode)
+VertexFormat::Source meshSource(const Vertex *vertices)
 {
-    GLuint shaderID = glCreateShader(shaderType);
-    const char *shaderCodeStr = shaderCode.c_str();
+    return { &vertices[0].position, nullptr, &vertices[0].color, sizeof(Vertex) };
+}
 
-    glShaderSource(shaderID, 1, &shaderCodeStr, nullptr);
-    glCompileShader(shaderID);
+uint32_t addMesh(const char *name, Vertex *vertices, GLuint vertexCount, GLuint *indices, GLuint indexCount)
+{
+    if (optimizeMeshes) {
+        MeshOptimizer::Positions positions = { &vertices[0].position.x, sizeof(Vertex) };
+        MeshOptimizer::VertexCacheStats cacheBefore = MeshOptimizer::AnalyzeVertexCache(indices, indexCount, vertexCount);
+        MeshOptimizer::OverdrawStats overdrawBefore = MeshOptimizer::AnalyzeOverdraw(indices, indexCount, positions);
+
+        vertexCount = MeshOptimizer::Optimize(indices, indexCount, vertices, vertexCount, sizeof(Vertex), offsetof(Vertex, position));
+
+        MeshOptimizer::VertexCacheStats cacheAfter = MeshOptimizer::AnalyzeVertexCache(indices, indexCount, vertexCount);
+        MeshOptimizer::OverdrawStats overdrawAfter = MeshOptimizer::AnalyzeOverdraw(indices, indexCount, positions);
+        std::cout << "Optimized " << name << ": ACMR " << cacheBefore.acmr << " -> " << cacheAfter.acmr
+                  << ", ATVR " << cacheBefore.atvr << " -> " << cacheAfter.atvr
+                  << ", overdraw " << overdrawBefore.overdraw << " -> " << overdrawAfter.overdraw << std::endl;
+    }
 
-    int success;
-    glGetShaderiv(shaderID, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        char infoLog[512];
-        glGetShaderInfoLog(shaderID, 512, nullptr, infoLog);
-        std::cerr << "Shader program linking error: " << infoLog << std::endl;
+    uint32_t mesh = GeometryStore::AddMesh(geometry, meshSource(vertices), vertexCount, indices, indexCount);
+    float radius = 0.0f;
+    for (GLuint i = 0; i < vertexCount; i++)
+        radius = std::max(radius, glm::length(vertices[i].position));
+    addMeshRadius(mesh, radius);
+    if (!lodEnabled)
+        return mesh;
+
+    // Levels only drop vertices, so they go into the store as extra index
+    // ranges over the vertices just added
+    MeshOptimizer::Positions positions = { &vertices[0].position.x, sizeof(Vertex) };
+    double lodStart = getTime();
+    std::vector<MeshSimplifier::Level> levels = MeshSimplifier::BuildLevels(indices, indexCount, positions, vertexCount);
+
+    lodChains.resize(geometry.meshes.size());
+    lodChains[mesh].meshes.push_back(mesh);
+    lodChains[mesh].errors.push_back(0.0f);
+    std::cout << "LOD " << name << ": " << indexCount / 3;
+    for (size_t level = 1; level < levels.size(); level++) {
+        std::vector<uint32_t> &levelIndices = levels[level].indices;
+        if (optimizeMeshes)
+            MeshOptimizer::OptimizeVertexCache(levelIndices.data(), levelIndices.size(), positions);
+
+        uint32_t lod = GeometryStore::AddLod(geometry, mesh, levelIndices.data(), (GLuint) levelIndices.size());
+        addMeshRadius(lod, radius);
+        lodChains[mesh].meshes.push_back(lod);
+        lodChains[mesh].errors.push_back(levels[level].error);
+        std::cout << " -> " << levelIndices.size() / 3;
     }
+    std::cout << " triangles in " << (getTime() - lodStart) * 1000.0 << " ms" << std::endl;
+
+    lodChains.resize(geometry.meshes.size());
+    return mesh;
+}
+
+void addMeshRadius(uint32_t mesh, float radius)
+{
+    // Levels of detail are meshes of their own and share their source's
+    meshRadius.resize(std::max((size_t) mesh + 1, meshRadius.size()));
+    meshRadius[mesh] = radius;
+}
+
+double getTime()
+{
+    if (!headless)
+        return glfwGetTime();
+
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Instancing::AddMeshes()
+{
+    // A mesh file brings its own, instances cycle through all of them but
+    // not through their levels of detail
+    if (meshPath != nullptr) {
+        for (uint32_t mesh = 0; mesh < geometry.meshes.size(); mesh++)
+            if (lodChains.empty() || !lodChains[mesh].meshes.empty())
+                instances.meshes.push_back(mesh);
+        return;
+    }
+
+    // A square pyramid and an octahedron to go with the cube, both fit in
+    // the cube's bounding sphere
+    Vertex pyramidVertices[] = {
+            { { -0.5f, -0.5f,  0.5f }, { 1.0f, 1.0f, 0.0f } },
+            { {  0.5f, -0.5f,  0.5f }, { 1.0f, 0.5f, 0.0f } },
+            { {  0.5f, -0.5f, -0.5f }, { 1.0f, 1.0f, 0.0f } },
+            { { -0.5f, -0.5f, -0.5f }, { 1.0f, 0.5f, 0.0f } },
+            { {  0.0f,  0.5f,  0.0f }, { 1.0f, 0.0f, 1.0f } }
+    };
+    GLuint pyramidIndices[] = {
+            0, 1, 2,  2, 3, 0,
+            0, 1, 4,  1, 2, 4,  2, 3, 4,  3, 0, 4
+    };
 
-    return shaderID;
+    Vertex octahedronVertices[] = {
+            { {  0.5f,  0.0f,  0.0f }, { 0.0f, 1.0f, 0.5f } },
+            { { -0.5f,  0.0f,  0.0f }, { 0.0f, 1.0f, 0.5f } },
+            { {  0.0f,  0.5f,  0.0f }, { 1.0f, 1.0f, 1.0f } },
+            { {  0.0f, -0.5f,  0.0f }, { 0.0f, 0.0f, 1.0f } },
+            { {  0.0f,  0.0f,  0.5f }, { 0.0f, 0.5f, 1.0f } },
+            { {  0.0f,  0.0f, -0.5f }, { 0.0f, 0.5f, 1.0f } }
+    };
+    GLuint octahedronIndices[] = {
+            0, 2, 4,  4, 2, 1,  1, 2, 5,  5, 2, 0,
+            0, 3, 4,  4, 3, 1,  1, 3, 5,  5, 3, 0
+    };
+
+    instances.meshes = {
+            cubeMesh,
+            addMesh("pyramid", pyramidVertices, 5, pyramidIndices, 18),
+            addMesh("octahedron", octahedronVertices, 6, octahedronIndices, 24)
+    };
 }
 
-std::string Shader::ReadShaderFile(const std::string &shaderFilePath)
+void Instancing::CreateInstances(int count)
 {
-    std::ifstream shaderFile(shaderFilePath);
-    if (!shaderFile.is_open()) {
-        std::cerr << "Failed to open shader file: " << shaderFilePath << std::endl;
-        return "";
+    instances.positionX.resize(count);
+    instances.positionY.resize(count);
+    instances.positionZ.resize(count);
+    instances.angularSpeed.resize(count);
+    instances.axisX.resize(count);
+    instances.axisY.resize(count);
+    instances.axisZ.resize(count);
+    instances.scaleX.resize(count);
+    instances.scaleY.resize(count);
+    instances.scaleZ.resize(count);
+    instances.radius.resize(count);
+    instances.mesh.resize(count);
+    instances.lod.assign(count, 0);
+    instances.visible.resize(count);
+
+    // Every mesh gets the same number of draw slots, one per level of the
+    // longest chain. Meshes without levels are their own only level
+    instances.lodLevels = 1;
+    for (uint32_t mesh : instances.meshes)
+        if (mesh < lodChains.size())
+            instances.lodLevels = std::max(instances.lodLevels, (uint32_t) lodChains[mesh].meshes.size());
+
+    for (uint32_t mesh : instances.meshes) {
+        LodChain chain = mesh < lodChains.size() && !lodChains[mesh].meshes.empty() ? lodChains[mesh] : LodChain{ { mesh }, { 0.0f } };
+        for (uint32_t level = 0; level < instances.lodLevels; level++) {
+            uint32_t last = std::min(level, (uint32_t) chain.meshes.size() - 1);
+            instances.lodMeshes.push_back(chain.meshes[last]);
+            instances.lodErrors.push_back(level == last ? chain.errors[last] : INFINITY);
+        }
+    }
+    instances.meshVisible.resize(instances.lodMeshes.size());
+    instances.meshOffset.resize(instances.lodMeshes.size());
+
+    // Draw slots are the material of a render queue key
+    if (sortDraws && instances.lodMeshes.size() > RenderQueue::maxMaterials) {
+        std::cerr << "Too many meshes to sort draws by key, sorting by mesh only" << std::endl;
+        sortDraws = false;
+    }
+    if (sortDraws)
+        drawQueue.items.reserve(count);
+
+    // Lay the cubes out on a cube shaped grid in front of the camera, each
+    // spinning around its own axis at its own speed unless --static. The
+    // cubes' two units apart for their radius of 0.866 is scaled to the
+    // largest mesh, whatever units it came in
+    float largestRadius = 0.0f;
+    for (uint32_t mesh : instances.meshes)
+        largestRadius = std::max(largestRadius, meshRadius[mesh]);
+    const float spacing = largestRadius > 0.0f ? 2.0f * largestRadius / 0.866f : 2.0f;
+    int side = (int) ceilf(cbrtf((float) count));
+    float offset = (side - 1) * spacing / 2.0f;
+
+    for (int i = 0; i < count; i++) {
+        int x = i % side;
+        int y = (i / side) % side;
+        int z = i / (side * side);
+
+        instances.positionX[i] = x * spacing - offset;
+        instances.positionY[i] = y * spacing - offset;
+        instances.positionZ[i] = -z * spacing;
+        instances.angularSpeed[i] = staticInstances ? 0.0f : 30.0f + (i % 7) * 15.0f;
+        instances.axisX[i] = (float) (i % 3);
+        instances.axisY[i] = 1.0f;
+        instances.axisZ[i] = (float) (i % 5) * 0.25f;
+        instances.scaleX[i] = instances.scaleY[i] = instances.scaleZ[i] = 1.0f;
+        instances.mesh[i] = i % instances.meshes.size();
+        instances.radius[i] = meshRadius[instances.meshes[instances.mesh[i]]] * instances.scaleX[i];
+    }
+
+    SceneGraph::Create(instances.scene, count);
+    for (int i = 0; i < count; i++) {
+        SceneGraph::AddNode(instances.scene, SceneGraph::noParent,
+                            glm::vec3(instances.positionX[i], instances.positionY[i], instances.positionZ[i]), 0.0f,
+                            glm::vec3(instances.axisX[i], instances.axisY[i], instances.axisZ[i]),
+                            glm::vec3(instances.scaleX[i], instances.scaleY[i], instances.scaleZ[i]));
+        if (instances.angularSpeed[i] != 0.0f)
+            instances.spinning.push_back(i);
+    }
+
+    Culling::Spheres spheres = {
+            instances.positionX.data(), instances.positionY.data(), instances.positionZ.data(),
+            instances.radius.data()
+    };
+    Bvh::Build(instanceTree, spheres, count);
+
+    // Keep the whole grid inside the far plane
+    farPlane = 10.0f + side * spacing;
+
+    if (gpuCulling) {
+        std::vector<GpuCulling::Instance> gpuInstances(count);
+        for (int i = 0; i < count; i++) {
+            gpuInstances[i].positionRadius = glm::vec4(instances.positionX[i], instances.positionY[i], instances.positionZ[i], instances.radius[i]);
+            gpuInstances[i].axisSpeed = glm::vec4(instances.axisX[i], instances.axisY[i], instances.axisZ[i], instances.angularSpeed[i]);
+            gpuInstances[i].scale = glm::vec4(instances.scaleX[i], instances.scaleY[i], instances.scaleZ[i], (float) instances.mesh[i]);
+        }
+
+        // Every mesh gets room in the matrix buffer for all of its instances
+        std::vector<GpuCulling::DrawElementsIndirectCommand> commands;
+        GLuint baseInstance = 0;
+        for (size_t mesh = 0; mesh < instances.meshes.size(); mesh++) {
+            commands.push_back(GeometryStore::Command(geometry, instances.meshes[mesh], 0, baseInstance));
+            baseInstance += std::count(instances.mesh.begin(), instances.mesh.end(), mesh);
+        }
+
+        if (!GpuCulling::Create(gpuCuller, cullingComputeShaderPath, gpuInstances, commands, geometry.indexType)) {
+            std::cerr << "Failed to create the culling compute shader, culling on the CPU instead" << std::endl;
+            gpuCulling = false;
+            cullCompare = false;
+        }
     }
 
-    std::stringstream shaderStream;
-    shaderStream << shaderFile.rdbuf();
-    shaderFile.close();
+    // A mat4 attribute takes four consecutive locations, one per column,
+    // and advances once per instance instead of once per vertex. The GPU
+    // culler writes its matrices to the same place every frame, so its
+    // buffer only has to be bound once
+    if (gpuCulling) {
+        GlState::BindBuffer(GL_ARRAY_BUFFER, gpuCuller.matrixBuffer);
+        for (int column = 0; column < 4; column++)
+            glVertexAttribPointer(2 + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void *) (column * sizeof(glm::vec4)));
+    } else {
+        StreamBuffer::Create(instanceStream, GL_ARRAY_BUFFER, count * sizeof(glm::mat4));
+        BindMatrices(0);
+        GeometryStore::CreateBatch(instanceBatch, (int) instances.lodMeshes.size());
+    }
 
-    return shaderStream.str();
+    for (int column = 0; column < 4; column++) {
+        glVertexAttribDivisor(2 + column, 1);
+        glEnableVertexAttribArray(2 + column);
+    }
 }
 
-glm::mat4 Transformation::Translation(const glm::mat4 &matrix, const glm::vec3 &position)
+void Instancing::BindMatrices(GLintptr offset)
 {
-    glm::mat4 translationMatrix(1.0f);
+    // Every frame writes a different region of the ring, so the attributes
+    // are pointed at it again
+    GlState::BindBuffer(GL_ARRAY_BUFFER, instanceStream.buffer);
+    for (int column = 0; column < 4; column++)
+        glVertexAttribPointer(2 + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void *) (offset + column * sizeof(glm::vec4)));
+}
 
-    translationMatrix[3] =  matrix[0] * position[0] +
-                            matrix[1] * position[1] +
-                            matrix[2] * position[2] +
-                            matrix[3];
+uint32_t Instancing::CullInstances(const Culling::Frustum &frustum)
+{
+    Culling::Spheres spheres = {
+            instances.positionX.data(), instances.positionY.data(), instances.positionZ.data(),
+            instances.radius.data()
+    };
+    if (bvhCulling)
+        return Bvh::QueryFrustum(instanceTree, spheres, frustum, instances.visible.data());
+    return Culling::Cull(frustum, spheres, instanceCount, instances.visible.data());
+}
 
-    return translationMatrix;
+bool Instancing::PickInstance(const glm::vec3 &origin, const glm::vec3 &direction, uint32_t *index, float *distance)
+{
+    Culling::Spheres spheres = {
+            instances.positionX.data(), instances.positionY.data(), instances.positionZ.data(),
+            instances.radius.data()
+    };
+    return Bvh::Raycast(instanceTree, spheres, origin, direction, index, distance);
 }
 
-glm::mat4 Transformation::Rotation(glm::mat4 const &matrix, float angleDegrees, glm::vec3 const &axis)
+void Instancing::SelectLods(uint32_t visibleCount)
 {
-    float angleRadians = glm::radians(angleDegrees);
-    float cosA = cosf(angleRadians);
-    float sinA = sinf(angleRadians);
-    glm::vec3 normalizedAxis = glm::normalize(axis);
+    // An error of one unit at distance one covers this many pixels, taken
+    // from the projection so it follows the field of view
+    float pixelsPerUnit = projectionMatrix[1][1] * WINDOW_HEIGHT * 0.5f;
+    float limit = lodPixelError / pixelsPerUnit;
+    uint32_t levels = instances.lodLevels;
+
+    for (uint32_t i = 0; i < visibleCount; i++) {
+        uint32_t index = instances.visible[i];
+        const float *errors = &instances.lodErrors[instances.mesh[index] * levels];
+
+        // Errors shrink with distance to the nearest point of the bounds,
+        // anything closer than the near plane counts as on it. The padding
+        // past the end of a chain has an infinite error and is never picked
+        glm::vec3 center(instances.positionX[index], instances.positionY[index], instances.positionZ[index]);
+        float distance = std::max(glm::length(center - cameraPos) - instances.radius[index], 1.0f);
+        float scale = std::max(std::max(instances.scaleX[index], instances.scaleY[index]), instances.scaleZ[index]);
+        float allowed = limit * distance / scale;
+
+        // Finer as soon as the current level is too coarse, coarser only
+        // once the next level is well within the limit
+        uint32_t lod = instances.lod[index];
+        while (lod > 0 && errors[lod] > allowed)
+            lod--;
+        while (lod + 1 < levels && errors[lod + 1] <= allowed * lodHysteresis)
+            lod++;
+        instances.lod[index] = (uint8_t) lod;
+    }
+}
 
-    float x = normalizedAxis.x;
-    float y = normalizedAxis.y;
-    float z = normalizedAxis.z;
+void Instancing::UpdateMatrices(float time, uint32_t visibleCount, glm::mat4 *matrices)
+{
+    // Only spinning instances are rebuilt, after the first frame a static
+    // grid costs no matrix math at all
+    for (uint32_t index : instances.spinning)
+        SceneGraph::SetRotation(instances.scene, index, time * instances.angularSpeed[index]);
+    sceneUpdateTotal += SceneGraph::Update(instances.scene);
+
+    uint32_t levels = instances.lodLevels;
+    std::fill(instances.meshVisible.begin(), instances.meshVisible.end(), 0);
+    if (sortDraws) {
+        // One program and one vertex array, so the key comes down to the
+        // draw and the distance along the view direction. Each draw's
+        // matrices end up together, nearest first
+        RenderQueue::Clear(drawQueue);
+        for (uint32_t i = 0; i < visibleCount; i++) {
+            uint32_t index = instances.visible[i];
+            glm::vec3 center(instances.positionX[index], instances.positionY[index], instances.positionZ[index]);
+            uint32_t slot = instances.mesh[index] * levels + instances.lod[index];
+            RenderQueue::Push(drawQueue, RenderQueue::MakeKey(RenderQueue::Opaque, 0, slot, glm::dot(center - cameraPos, cameraFront)), index);
+        }
+        RenderQueue::Sort(drawQueue);
+
+        for (uint32_t i = 0; i < visibleCount; i++) {
+            const RenderQueue::Item &item = drawQueue.items[i];
+            instances.meshVisible[RenderQueue::Material(item.key)]++;
+            matrices[i] = SceneGraph::World(instances.scene, item.value);
+        }
+        return;
+    }
 
-    float oneMinusCosA = 1.0f - cosA;
+    // Counting sort by mesh and level, so the matrices of each draw end
+    // up next to each other and in the order they were culled
+    for (uint32_t i = 0; i < visibleCount; i++) {
+        uint32_t index = instances.visible[i];
+        instances.meshVisible[instances.mesh[index] * levels + instances.lod[index]]++;
+    }
 
-    glm::mat4 rotate(1.0f);
-    rotate[0][0] = cosA + x * x * oneMinusCosA;
-    rotate[0][1] = x * y * oneMinusCosA - z * sinA;
-    rotate[0][2] = x * z * oneMinusCosA + y * sinA;
+    uint32_t offset = 0;
+    for (size_t slot = 0; slot < instances.lodMeshes.size(); slot++) {
+        instances.meshOffset[slot] = offset;
+        offset += instances.meshVisible[slot];
+    }
 
-    rotate[1][0] = y * x * oneMinusCosA + z * sinA;
-    rotate[1][1] = cosA + y * y * oneMinusCosA;
-    rotate[1][2] = y * z * oneMinusCosA - x * sinA;
+    for (uint32_t i = 0; i < visibleCount; i++) {
+        uint32_t index = instances.visible[i];
+        matrices[instances.meshOffset[instances.mesh[index] * levels + instances.lod[index]]++] = SceneGraph::World(instances.scene, index);
+    }
+}
 
-    rotate[2][0] = z * x * oneMinusCosA - y * sinA;
-    rotate[2][1] = z * y * oneMinusCosA + x * sinA;
-    rotate[2][2] = cosA + z * z * oneMinusCosA;
+void Instancing::AddDraws(GeometryStore::Batch &batch)
+{
+    GLuint baseInstance = 0;
+    for (size_t slot = 0; slot < instances.lodMeshes.size(); slot++) {
+        uint32_t visible = instances.meshVisible[slot];
+        GeometryStore::AddDraw(batch, geometry, instances.lodMeshes[slot], visible, baseInstance);
+        baseInstance += visible;
+
+        uint32_t fullMesh = instances.lodMeshes[slot - slot % instances.lodLevels];
+        lodTriangleTotal += (uint64_t) visible * geometry.meshes[instances.lodMeshes[slot]].indexCount / 3;
+        fullTriangleTotal += (uint64_t) visible * geometry.meshes[fullMesh].indexCount / 3;
+    }
+}
 
-    glm::mat4 rotationMatrix(1.0f);
-    rotationMatrix[0] = matrix[0] * rotate[0][0] + matrix[1] * rotate[0][1] + matrix[2] * rotate[0][2];
-    rotationMatrix[1] = matrix[0] * rotate[1][0] + matrix[1] * rotate[1][1] + matrix[2] * rotate[1][2];
-    rotationMatrix[2] = matrix[0] * rotate[2][0] + matrix[1] * rotate[2][1] + matrix[2] * rotate[2][2];
-    rotationMatrix[3] = matrix[3];
+void Instancing::DestroyInstances()
+{
+    if (gpuCulling) {
+        GpuCulling::Destroy(gpuCuller);
+    } else {
+        GeometryStore::DestroyBatch(instanceBatch);
+        StreamBuffer::Destroy(instanceStream);
+    }
+    instances = Instances();
+    instanceTree = Bvh::Tree();
+}
 
-    return rotationMatrix;
+namespace CameraUniforms {
+    static GLuint buffer;
+    static Block block;
+
+    // Inputs of the last upload, to skip frames where nothing moved
+    static glm::vec3 lastPosition;
+    static glm::vec3 lastTarget;
+    static glm::vec3 lastUp;
+    static bool valid = false;
 }
 
-glm::mat4 Transformation::Scaling(glm::mat4 const &matrix, glm::vec3 const &scale)
+void CameraUniforms::Create()
 {
-    glm::mat4 scalingMatrix(1.0f);
+    glGenBuffers(1, &buffer);
+    GlState::BindBuffer(GL_UNIFORM_BUFFER, buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(Block), nullptr, GL_DYNAMIC_DRAW);
+    GlState::BindBufferBase(GL_UNIFORM_BUFFER, bindingPoint, buffer);
+    valid = false;
+}
 
-    scalingMatrix[0] = matrix[0] * scale[0];
-    scalingMatrix[1] = matrix[1] * scale[1];
-    scalingMatrix[2] = matrix[2] * scale[2];
-    scalingMatrix[3];
+void CameraUniforms::BindProgram(GLuint program)
+{
+    // GLSL 3.30 has no layout(binding = N), so the block is pointed at the
+    // shared binding point from here
+    GLuint blockIndex = glGetUniformBlockIndex(program, "Camera");
+    if (blockIndex != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, blockIndex, bindingPoint);
+}
 
-    return scalingMatrix;
+const glm::mat4 &CameraUniforms::ViewProjectionMatrix()
+{
+    return block.viewProjectionMatrix;
 }
 
-glm::mat4 CoordinateSystem::ModelMatrix(glm::vec3 position, float angle, glm::vec3 rotationAxis, glm::vec3 const &scaling)
+bool CameraUniforms::Update(glm::vec3 const &position, glm::vec3 const &target, glm::vec3 const &up, glm::mat4 const &projection)
 {
-    glm::mat4 modelMatrix(1.0f);
+    if (valid && position == lastPosition && target == lastTarget && up == lastUp && projection == block.projectionMatrix)
+        return false;
+
+    block.viewMatrix = glm::lookAt(position, target, up);
+    block.projectionMatrix = projection;
+    block.viewProjectionMatrix = projection * block.viewMatrix;
+
+    GlState::BindBuffer(GL_UNIFORM_BUFFER, buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Block), &block);
+
+    lastPosition = position;
+    lastTarget = target;
+    lastUp = up;
+    valid = true;
+    return true;
+}
+
+void CameraUniforms::Destroy()
+{
+    GlState::DeleteBuffers(1, &buffer);
+}
+
+namespace Headless {
+    // Number of frames that may be queued before Present() waits, the same
+    // latency a double buffered swap chain gives us
+    static const int framesInFlight = 2;
+
+    static EGLDisplay display = EGL_NO_DISPLAY;
+    static EGLContext context = EGL_NO_CONTEXT;
 
-    modelMatrix = Transformation::Translation(modelMatrix, position);
-    modelMatrix = Transformation::Rotation(modelMatrix, angle, rotationAxis);
-    modelMatrix = Transformation::Scaling(modelMatrix, scaling);
+    static GLuint framebuffer;
+    static GLuint colorBuffer;
+    static GLuint depthBuffer;
+    static GLuint resolveFramebuffer;
+    static GLuint resolveColorBuffer;
+    static GLsizei framebufferWidth;
+    static GLsizei framebufferHeight;
 
-    return modelMatrix;
+    static GLsync frameFences[framesInFlight];
+    static int frameIndex;
 }
 
-glm::mat4 CoordinateSystem::ViewMatrix(glm::vec3 cameraPosition, glm::vec3 cameraTarget, glm::vec3 cameraUp)
+bool Headless::CreateContext()
 {
-    glm::vec3 forward = glm::normalize(cameraTarget - cameraPosition);
-    glm::vec3 right = glm::normalize(glm::cross(cameraUp, forward));
-    glm::vec3 up = glm::cross(forward, right);
+    // Surfaceless platform needs no X or DRM device, Mesa will fall back to
+    // llvmpipe when there is no GPU at all
+    auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay != nullptr)
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+        return false;
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+        return false;
+
+    const EGLint configAttributes[] = {
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+            EGL_NONE
+    };
 
-    return {
-            { right.x, up.x, -forward.x, 0.0f },
-            { right.y, up.y, -forward.y, 0.0f },
-            { right.z, up.z, -forward.z, 0.0f },
-            { -glm::dot(right, cameraPosition), -glm::dot(up, cameraPosition), glm::dot(forward, cameraPosition), 1.0f }
+    EGLConfig config;
+    EGLint configCount;
+    if (!eglChooseConfig(display, configAttributes, &config, 1, &configCount) || configCount == 0)
+        return false;
+
+    // Same OpenGL 3.3 (or 4.3) core profile the window gets
+    const EGLint contextAttributes[] = {
+            EGL_CONTEXT_MAJOR_VERSION, gpuCulling ? 4 : 3,
+            EGL_CONTEXT_MINOR_VERSION, 3,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+            EGL_NONE
     };
+
+    context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+    if (context == EGL_NO_CONTEXT)
+        return false;
+
+    // No surface at all, everything is drawn into our own framebuffer
+    return eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
 }
 
-glm::mat4 CoordinateSystem::PerspectiveProjectionMatrix(float FoVY, float aspectRatio, float nearZ, float farZ)
+void Headless::CreateFramebuffer(int width, int height, int samples)
 {
-    float tanHalfFoVy = tanf(glm::radians(FoVY / 2.0f));
-    float rangeZ = nearZ - farZ;
+    framebufferWidth = width;
+    framebufferHeight = height;
 
-    float d = 1 / tanHalfFoVy;
-    float A = (-farZ - nearZ) / rangeZ;
-    float B = 2.0f * farZ * nearZ / rangeZ;
+    glGenRenderbuffers(1, &colorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
 
-    glm::mat4 projectionMatrix = {
-            { d / aspectRatio, 0.0f, 0.0f, 0.0f },
-            { 0.0f, d, 0.0f, 0.0f },
-            { 0.0f, 0.0f, A, B },
-            { 0.0f, 0.0f, 1.0f, 0.0f }
-    };
+    glGenRenderbuffers(1, &depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH24_STENCIL8, width, height);
+
+    glGenFramebuffers(1, &framebuffer);
+    GlState::BindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cerr << "Headless framebuffer is incomplete" << std::endl;
+
+    // Single sampled target the multisampled image gets resolved into, like
+    // the window system does on swap
+    glGenRenderbuffers(1, &resolveColorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, resolveColorBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
 
-    return projectionMatrix;
+    glGenFramebuffers(1, &resolveFramebuffer);
+    GlState::BindFramebuffer(GL_FRAMEBUFFER, resolveFramebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, resolveColorBuffer);
+
+    GlState::BindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glViewport(0, 0, width, height);
 }
 
-glm::mat4 CoordinateSystem::OrthographicProjectionMatrix(float left, float right, float bottom, float top, float near, float far)
+void Headless::Present()
 {
-    const float A = 2.0f / (right - left);
-    const float B = 2.0f / (top - bottom);
-    const float C = -2.0f / (far - near);
-    const float tx = -(right + left) / (right - left);
-    const float ty = -(top + bottom) / (top - bottom);
-    const float tz = -(far + near) / (far - near);
+    GlState::BindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    GlState::BindFramebuffer(GL_DRAW_FRAMEBUFFER, resolveFramebuffer);
+    glBlitFramebuffer(0, 0, framebufferWidth, framebufferHeight,
+                      0, 0, framebufferWidth, framebufferHeight,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    GlState::BindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+    // Throttle the CPU like a blocking swap would, otherwise we only measure
+    // how fast commands can be queued
+    GLsync &fence = frameFences[frameIndex];
+    if (fence != nullptr) {
+        glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(fence);
+    }
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    frameIndex = (frameIndex + 1) % framesInFlight;
+}
 
-    return {
-            {A, 0.0f, 0.0f, tx},
-            {0.0f, B, 0.0f, ty},
-            {0.0f, 0.0f, C, tz},
-            {0.0f, 0.0f, 0.0f, 1.0f}
-    };
+void Headless::MakeCurrent(bool current)
+{
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, current ? context : EGL_NO_CONTEXT);
 }
 
-glm::mat4 CameraMatrix(glm::vec3 const &position, glm::vec3 const &target, glm::vec3 const &up)
+void Headless::DestroyContext()
 {
-    glm::vec3 cameraFront = glm::normalize(target - position);
-    glm::vec3 cameraRight = glm::normalize(glm::cross(cameraFront, up));
-    glm::vec3 cameraUpNew = glm::cross(cameraRight, cameraFront);
+    for (GLsync &fence : frameFences) {
+        if (fence != nullptr)
+            glDeleteSync(fence);
+        fence = nullptr;
+    }
 
-    glm::mat4 viewMatrix(1.0f);
-    viewMatrix[0][0] = cameraRight.x;
-    viewMatrix[1][0] = cameraRight.y;
-    viewMatrix[2][0] = cameraRight.z;
+    GlState::DeleteFramebuffers(1, &resolveFramebuffer);
+    GlState::DeleteFramebuffers(1, &framebuffer);
+    glDeleteRenderbuffers(1, &resolveColorBuffer);
+    glDeleteRenderbuffers(1, &depthBuffer);
+    glDeleteRenderbuffers(1, &colorBuffer);
 
-    viewMatrix[0][1] = cameraUpNew.x;
-    viewMatrix[1][1] = cameraUpNew.y;
-    viewMatrix[2][1] = cameraUpNew.z;
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+    eglTerminate(display);
+}
+
+namespace Simulation {
+    // Input flows from the main thread to the simulation, states from the
+    // simulation to the render thread. Sixteen states are a bit over a
+    // tenth of a second, the simulation waits once the renderer is that
+    // far behind
+    static SpscQueue<Input, 64> inputs;
+    static SpscQueue<State, 16> states;
 
-    viewMatrix[0][2] = -cameraFront.x;
-    viewMatrix[1][2] = -cameraFront.y;
-    viewMatrix[2][2] = -cameraFront.z;
+    static std::thread thread;
+    static std::atomic<bool> running(false);
 
-    viewMatrix[3][0] = -glm::dot(cameraRight, position);
-    viewMatrix[3][1] = -glm::dot(cameraUpNew, position);
-    viewMatrix[3][2] = glm::dot(cameraFront, position);
+    // The two newest states the render thread has seen
+    static State previous;
+    static State current;
 
-    return viewMatrix;
+    // Read once the thread is gone, for the summary
+    static uint64_t stepCount = 0;
+    static uint64_t queueFullCount = 0;
+
+    static void Run(State state, Input input);
+    static void Advance(State &state, const Input &input);
+}
+
+void Simulation::Start()
+{
+    // Picks up where the camera is now, looking the way the mouse left it
+    State state = {};
+    state.stamp = getTime();
+    state.time = state.stamp;
+    state.cameraPos = cameraPos;
+    state.cameraFront = cameraFront;
+    previous = current = state;
+
+    Input input = {};
+    input.yaw = yaw;
+    input.pitch = pitch;
+
+    running.store(true);
+    thread = std::thread(Run, state, input);
+}
+
+bool Simulation::PushInput(const Input &input)
+{
+    Input copy = input;
+    return inputs.TryPush(std::move(copy));
+}
+
+Simulation::State Simulation::Interpolate(double now)
+{
+    // Every state that arrived since the last frame, a click in any of
+    // them has to survive
+    State state;
+    bool pick = false;
+    float pickX = 0.0f, pickY = 0.0f;
+    while (states.TryPop(state)) {
+        if (state.pick) {
+            pick = true;
+            pickX = state.pickX;
+            pickY = state.pickY;
+        }
+        previous = current;
+        current = state;
+    }
+
+    // Drawn one step behind the clock, so the newest state is normally
+    // already there and the frame lands between it and the one before
+    double span = current.stamp - previous.stamp;
+    float alpha = span > 0.0 ? (float) glm::clamp((now - step - previous.stamp) / span, 0.0, 1.0) : 1.0f;
+
+    State result = current;
+    result.time = previous.time + (current.time - previous.time) * alpha;
+    result.cameraPos = glm::mix(previous.cameraPos, current.cameraPos, alpha);
+    result.cameraFront = glm::normalize(glm::mix(previous.cameraFront, current.cameraFront, alpha));
+    result.pick = pick;
+    result.pickX = pickX;
+    result.pickY = pickY;
+    return result;
+}
+
+void Simulation::Stop()
+{
+    running.store(false);
+    if (thread.joinable())
+        thread.join();
+}
+
+void Simulation::PrintStats()
+{
+    std::cout << "Simulation: " << stepCount << " steps of " << step * 1000.0 << " ms, waited on the render thread "
+              << queueFullCount << " times" << std::endl;
+}
+
+void Simulation::Run(State state, Input input)
+{
+    Profiler::SetThreadName("Simulation");
+    double next = state.stamp + step;
+    bool pick = false;
+    float pickX = 0.0f, pickY = 0.0f;
+
+    while (running.load()) {
+        // Whatever arrived since the last step applies to the next one
+        Input event;
+        while (inputs.TryPop(event)) {
+            if (event.pick) {
+                pick = true;
+                pickX = event.cursorX;
+                pickY = event.cursorY;
+            }
+            input = event;
+        }
+
+        double now = getTime();
+        if (now < next) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(std::min(next - now, 0.001)));
+            continue;
+        }
+
+        // After a long stall the clock slips instead of catching up with
+        // a burst of steps nobody would see
+        if (now - next > 0.25)
+            next = now;
+
+        {
+            Profiler::Scope scope("Simulation", false);
+            Advance(state, input);
+        }
+        state.stamp = next;
+        state.time += step;
+        state.pick = pick;
+        state.pickX = pickX;
+        state.pickY = pickY;
+        next += step;
+        stepCount++;
+
+        State copy = state;
+        if (!states.TryPush(std::move(copy))) {
+            queueFullCount++;
+            do {
+                if (!running.load())
+                    return;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            } while (!states.TryPush(std::move(copy)));
+        }
+        pick = false;
+    }
+}
+
+void Simulation::Advance(State &state, const Input &input)
+{
+    // What processInput() and mouseCallback() do, at a fixed rate
+    state.cameraFront = lookDirection(input.yaw, input.pitch);
+
+    float cameraSpeed = (float) (2.5 * step);
+    glm::vec3 right = glm::normalize(glm::cross(state.cameraFront, cameraUp));
+    if (input.moveKeys & MoveForward)
+        state.cameraPos += cameraSpeed * state.cameraFront;
+    if (input.moveKeys & MoveBackward)
+        state.cameraPos -= cameraSpeed * state.cameraFront;
+    if (input.moveKeys & MoveLeft)
+        state.cameraPos -= right * cameraSpeed;
+    if (input.moveKeys & MoveRight)
+        state.cameraPos += right * cameraSpeed;
 }
 
 void processInput(GLFWwindow *window)
@@ -476,9 +1702,61 @@ void processInput(GLFWwindow *window)
         cameraPos -= glm::normalize(glm::cross(cameraFront, cameraUp)) * cameraSpeed;
     if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
         cameraPos += glm::normalize(glm::cross(cameraFront, cameraUp)) * cameraSpeed;
+
+    // Pick once per click, not every frame the button is held
+    bool pickButton = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+    if (pickButton && !pickButtonDown)
+        pickObject(lastX, lastY);
+    pickButtonDown = pickButton;
+}
+
+void pickObject(float cursorX, float cursorY)
+{
+    if (instanceCount == 0)
+        return;
+
+    // Unproject the cursor position onto the near and far planes, the ray
+    // runs between the two points
+    glm::mat4 inverseViewProjection = glm::inverse(CameraUniforms::ViewProjectionMatrix());
+    float x = 2.0f * cursorX / WINDOW_WIDTH - 1.0f;
+    float y = 1.0f - 2.0f * cursorY / WINDOW_HEIGHT;
+    glm::vec4 nearPoint = inverseViewProjection * glm::vec4(x, y, -1.0f, 1.0f);
+    glm::vec4 farPoint = inverseViewProjection * glm::vec4(x, y, 1.0f, 1.0f);
+    glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+    glm::vec3 direction = glm::vec3(farPoint) / farPoint.w - origin;
+
+    uint32_t index;
+    float distance;
+    if (Instancing::PickInstance(origin, direction, &index, &distance))
+        std::cout << "Picked cube " << index << " at distance " << distance << std::endl;
+    else
+        std::cout << "Picked nothing" << std::endl;
+}
+
+void compareCulling(const Culling::Frustum &frustum)
+{
+    double start = getTime();
+    uint32_t cpuVisibleCount;
+    {
+        Profiler::Scope scope("Culling", false);
+        cpuVisibleCount = Instancing::CullInstances(frustum);
+    }
+    cpuCullingTime += getTime() - start;
+
+    // Stalls until the GPU has caught up with the dispatch, which is why
+    // this is a separate mode
+    uint32_t gpuVisibleCount = GpuCulling::ReadVisibleCount(gpuCuller);
+    if (gpuVisibleCount != cpuVisibleCount)
+        cullingMismatches++;
+
+    visibleTotal += gpuVisibleCount;
+    culledTotal += instanceCount - gpuVisibleCount;
+    Profiler::Counter("Visible", gpuVisibleCount);
+    Profiler::Counter("Culled", instanceCount - gpuVisibleCount);
+    Profiler::Counter("CPU visible", cpuVisibleCount);
 }
 
-static void mouseCallback(GLFWwindow *window, double xPos, double yPos)
+static void mouseCallback(GLFWwindow *, double xPos, double yPos)
 {
     if (firstMouse) {
         lastX = xPos;
@@ -501,9 +1779,16 @@ static void mouseCallback(GLFWwindow *window, double xPos, double yPos)
     if (pitch > 89.0f) pitch = 89.0f;
     if (pitch < -89.0f) pitch = -89.0f;
 
+    // The simulation turns the camera itself when it runs on its own thread
+    if (!threaded)
+        cameraFront = lookDirection(yaw, pitch);
+}
+
+glm::vec3 lookDirection(float yaw, float pitch)
+{
     glm::vec3 direction;
     direction.x = cosf(glm::radians(yaw)) * cosf(glm::radians(pitch));
     direction.y = sinf(glm::radians(pitch));
     direction.z = sinf(glm::radians(yaw)) * cosf(glm::radians(pitch));
-    cameraFront = glm::normalize(direction);
+    return glm::normalize(direction);
 }
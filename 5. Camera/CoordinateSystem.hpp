@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "Transformation.hpp"
+
+namespace CoordinateSystem {
+    static glm::mat4 ModelMatrix(glm::vec3 position, float angle, glm::vec3 rotationAxis, glm::vec3 const &scaling);
+    static glm::mat4 ViewMatrix(glm::vec3 cameraPosition, glm::vec3 cameraTarget, glm::vec3 cameraUp);
+    static glm::mat4 PerspectiveProjectionMatrix(float FoVY, float aspectRatio, float nearZ, float farZ);
+    static glm::mat4 OrthographicProjectionMatrix(float left, float right, float bottom, float top, float near, float far);
+}
+
+static glm::mat4 CameraMatrix(glm::vec3 const &position, glm::vec3 const &target, glm::vec3 const &up);
+
+glm::mat4 CoordinateSystem::ModelMatrix(glm::vec3 position, float angle, glm::vec3 rotationAxis, glm::vec3 const &scaling)
+{
+    glm::mat4 modelMatrix(1.0f);
+
+    modelMatrix = Transformation::Translation(modelMatrix, position);
+    modelMatrix = Transformation::Rotation(modelMatrix, angle, rotationAxis);
+    modelMatrix = Transformation::Scaling(modelMatrix, scaling);
+
+    return modelMatrix;
+}
+
+glm::mat4 CoordinateSystem::ViewMatrix(glm::vec3 cameraPosition, glm::vec3 cameraTarget, glm::vec3 cameraUp)
+{
+    glm::vec3 forward = glm::normalize(cameraTarget - cameraPosition);
+    glm::vec3 right = glm::normalize(glm::cross(cameraUp, forward));
+    glm::vec3 up = glm::cross(forward, right);
+
+    return {
+            { right.x, up.x, -forward.x, 0.0f },
+            { right.y, up.y, -forward.y, 0.0f },
+            { right.z, up.z, -forward.z, 0.0f },
+            { -glm::dot(right, cameraPosition), -glm::dot(up, cameraPosition), glm::dot(forward, cameraPosition), 1.0f }
+    };
+}
+
+glm::mat4 CoordinateSystem::PerspectiveProjectionMatrix(float FoVY, float aspectRatio, float nearZ, float farZ)
+{
+    float tanHalfFoVy = tanf(glm::radians(FoVY / 2.0f));
+    float rangeZ = nearZ - farZ;
+
+    float d = 1 / tanHalfFoVy;
+    float A = (-farZ - nearZ) / rangeZ;
+    float B = 2.0f * farZ * nearZ / rangeZ;
+
+    glm::mat4 projectionMatrix = {
+            { d / aspectRatio, 0.0f, 0.0f, 0.0f },
+            { 0.0f, d, 0.0f, 0.0f },
+            { 0.0f, 0.0f, A, B },
+            { 0.0f, 0.0f, 1.0f, 0.0f }
+    };
+
+    return projectionMatrix;
+}
+
+glm::mat4 CoordinateSystem::OrthographicProjectionMatrix(float left, float right, float bottom, float top, float near, float far)
+{
+    const float A = 2.0f / (right - left);
+    const float B = 2.0f / (top - bottom);
+    const float C = -2.0f / (far - near);
+    const float tx = -(right + left) / (right - left);
+    const float ty = -(top + bottom) / (top - bottom);
+    const float tz = -(far + near) / (far - near);
+
+    return {
+            {A, 0.0f, 0.0f, tx},
+            {0.0f, B, 0.0f, ty},
+            {0.0f, 0.0f, C, tz},
+            {0.0f, 0.0f, 0.0f, 1.0f}
+    };
+}
+
+glm::mat4 CameraMatrix(glm::vec3 const &position, glm::vec3 const &target, glm::vec3 const &up)
+{
+    glm::vec3 cameraFront = glm::normalize(target - position);
+    glm::vec3 cameraRight = glm::normalize(glm::cross(cameraFront, up));
+    glm::vec3 cameraUpNew = glm::cross(cameraRight, cameraFront);
+
+    glm::mat4 viewMatrix(1.0f);
+    viewMatrix[0][0] = cameraRight.x;
+    viewMatrix[1][0] = cameraRight.y;
+    viewMatrix[2][0] = cameraRight.z;
+
+    viewMatrix[0][1] = cameraUpNew.x;
+    viewMatrix[1][1] = cameraUpNew.y;
+    viewMatrix[2][1] = cameraUpNew.z;
+
+    viewMatrix[0][2] = -cameraFront.x;
+    viewMatrix[1][2] = -cameraFront.y;
+    viewMatrix[2][2] = -cameraFront.z;
+
+    viewMatrix[3][0] = -glm::dot(cameraRight, position);
+    viewMatrix[3][1] = -glm::dot(cameraUpNew, position);
+    viewMatrix[3][2] = glm::dot(cameraFront, position);
+
+    return viewMatrix;
+}
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "WorkerPool.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CULLING_X86 1
+#endif
+
+// Frustum culling of bounding spheres. The six planes are pulled out of the
+// view projection matrix, and the spheres are tested 4 (SSE) or 8 (AVX2) at
+// a time from structure of arrays input. Large batches are split into
+// chunks spread over the WorkerPool; every chunk writes its visible indices
+// in place and they are packed into one compact list afterwards, in index
+// order.
+namespace Culling {
+    // Planes as structure of arrays, a point p is inside plane i when
+    // normalX[i] * p.x + normalY[i] * p.y + normalZ[i] * p.z + distance[i] >= 0
+    struct Frustum {
+        float normalX[6];
+        float normalY[6];
+        float normalZ[6];
+        float distance[6];
+    };
+
+    struct Spheres {
+        const float *centerX;
+        const float *centerY;
+        const float *centerZ;
+        const float *radius;
+    };
+
+    // Writes the indices of visible spheres in [begin, end) to visible and
+    // returns how many there were
+    typedef uint32_t (*Kernel)(const Frustum &frustum, const Spheres &spheres, uint32_t begin, uint32_t end, uint32_t *visible);
+
+    static Frustum ExtractFrustum(const glm::mat4 &viewProjection);
+    static uint32_t Cull(const Frustum &frustum, const Spheres &spheres, uint32_t count, uint32_t *visible);
+    static uint32_t CullScalar(const Frustum &frustum, const Spheres &spheres, uint32_t begin, uint32_t end, uint32_t *visible);
+#ifdef CULLING_X86
+    static uint32_t CullSSE(const Frustum &frustum, const Spheres &spheres, uint32_t begin, uint32_t end, uint32_t *visible);
+    static uint32_t CullAVX2(const Frustum &frustum, const Spheres &spheres, uint32_t begin, uint32_t end, uint32_t *visible);
+#endif
+    static Kernel SelectKernel(const char **name = nullptr);
+}
+
+namespace Culling {
+    // Large enough that grabbing a chunk costs nothing next to testing it,
+    // small enough that threads finishing early can steal the rest
+    static const uint32_t chunkSize = 16384;
+
+    static std::vector<uint32_t> chunkVisible;
+
+#ifdef CULLING_X86
+    // Left packing tables: entry m lists the set bit positions of m first,
+    // so a shuffle by it moves the visible lanes to the front without a
+    // branch per sphere
+    struct PackTables {
+        alignas(16) int32_t lanes4[16][4];
+        alignas(8) uint8_t lanes8[256][8];
+
+        PackTables()
+        {
+            for (int mask = 0; mask < 16; mask++) {
+                int count = 0;
+                for (int lane = 0; lane < 4; lane++)
+                    if (mask & (1 << lane))
+                        lanes4[mask][count++] = lane;
+                while (count < 4)
+                    lanes4[mask][count++] = 0;
+            }
+            for (int mask = 0; mask < 256; mask++) {
+                int count = 0;
+                for (int lane = 0; lane < 8; lane++)
+                    if (mask & (1 << lane))
+                        lanes8[mask][count++] = lane;
+                while (count < 8)
+                    lanes8[mask][count++] = 0;
+            }
+        }
+    };
+
+    static const PackTables packTables;
+#endif
+}
+
+Culling::Frustum Culling::ExtractFrustum(const glm::mat4 &viewProjection)
+{
+    // Gribb/Hartmann: every clip plane is the last row of the matrix plus
+    // or minus one of the other rows. glm is column major, so row r is
+    // (m[0][r], m[1][r], m[2][r], m[3][r])
+    auto row = [&viewProjection](int r) {
+        return glm::vec4(viewProjection[0][r], viewProjection[1][r], viewProjection[2][r], viewProjection[3][r]);
+    };
+
+    glm::vec4 planes[6] = {
+        row(3) + row(0),    // Left
+        row(3) - row(0),    // Right
+        row(3) + row(1),    // Bottom
+        row(3) - row(1),    // Top
+        row(3) + row(2),    // Near
+        row(3) - row(2),    // Far
+    };
+
+    // Normalized planes give real distances, so a sphere test is a single
+    // compare against its radius
+    Frustum frustum;
+    for (int i = 0; i < 6; i++) {
+        float inverseLength = 1.0f / glm::length(glm::vec3(planes[i].x, planes[i].y, planes[i].z));
+        frustum.normalX[i] = planes[i].x * inverseLength;
+        frustum.normalY[i] = planes[i].y * inverseLength;
+        frustum.normalZ[i] = planes[i].z * inverseLength;
+        frustum.distance[i] = planes[i].w * inverseLength;
+    }
+    return frustum;
+}
+
+Culling::Kernel Culling::SelectKernel(const char **name)
+{
+#ifdef CULLING_X86
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        if (name != nullptr)
+            *name = "avx2";
+        return CullAVX2;
+    }
+
+    if (name != nullptr)
+        *name = "sse";
+    return CullSSE;
+#else
+    if (name != nullptr)
+        *name = "scalar";
+    return CullScalar;
+#endif
+}
+
+uint32_t Culling::Cull(const Frustum &frustum, const Spheres &spheres, uint32_t count, uint32_t *visible)
+{
+    static const Kernel kernel = SelectKernel();
+
+    // Not worth waking anyone up for
+    if (WorkerPool::ThreadCount() == 1 || count <= chunkSize)
+        return kernel(frustum, spheres, 0, count, visible);
+
+    uint32_t chunkCount = (count + chunkSize - 1) / chunkSize;
+    chunkVisible.resize(chunkCount);
+    WorkerPool::ParallelFor(chunkCount, [&](uint32_t chunk) {
+        uint32_t begin = chunk * chunkSize;
+        uint32_t end = std::min(begin + chunkSize, count);
+        chunkVisible[chunk] = kernel(frustum, spheres, begin, end, visible + begin);
+    });
+
+    // Every chunk left its indices at the start of its own range, slide
+    // them down next to each other
+    uint32_t visibleCount = chunkVisible[0];
+    for (uint32_t chunk = 1; chunk < chunkCount; chunk++) {
+        memmove(visible + visibleCount, visible + chunk * chunkSize, chunkVisible[chunk] * sizeof(uint32_t));
+        visibleCount += chunkVisible[chunk];
+    }
+    return visibleCount;
+}
+
+uint32_t Culling::CullScalar(const Frustum &frustum, const Spheres &spheres, uint32_t begin, uint32_t end, uint32_t *visible)
+{
+    uint32_t visibleCount = 0;
+    for (uint32_t i = begin; i < end; i++) {
+        bool inside = true;
+        for (int plane = 0; plane < 6; plane++) {
+            float distance = frustum.normalX[plane] * spheres.centerX[i] +
+                             frustum.normalY[plane] * spheres.centerY[i] +
+                             frustum.normalZ[plane] * spheres.centerZ[i] +
+                             frustum.distance[plane];
+            inside &= distance >= -spheres.radius[i];
+        }
+
+        // Branchless append, the index is always written and only kept
+        // when the sphere is visible
+        visible[visibleCount] = i;
+        visibleCount += inside;
+    }
+    return visibleCount;
+}
+
+#ifdef CULLING_X86
+uint32_t Culling::CullSSE(const Frustum &frustum, const Spheres &spheres, uint32_t begin, uint32_t end, uint32_t *visible)
+{
+    uint32_t visibleCount = 0;
+    uint32_t i = begin;
+
+    for (; i + 4 <= end; i += 4) {
+        __m128 x = _mm_loadu_ps(spheres.centerX + i);
+        __m128 y = _mm_loadu_ps(spheres.centerY + i);
+        __m128 z = _mm_loadu_ps(spheres.centerZ + i);
+        __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(spheres.radius + i));
+
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int plane = 0; plane < 6; plane++) {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(frustum.normalX[plane])),
+                                                    _mm_mul_ps(y, _mm_set1_ps(frustum.normalY[plane]))),
+                                         _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(frustum.normalZ[plane])),
+                                                    _mm_set1_ps(frustum.distance[plane])));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+        }
+
+        // Always store four indices, only the visible ones are counted.
+        // visibleCount never passes i - begin, so this stays inside the range
+        int mask = _mm_movemask_ps(inside);
+        __m128i lanes = _mm_load_si128((const __m128i *) packTables.lanes4[mask]);
+        _mm_storeu_si128((__m128i *) (visible + visibleCount), _mm_add_epi32(lanes, _mm_set1_epi32(i)));
+        visibleCount += __builtin_popcount(mask);
+    }
+
+    return visibleCount + CullScalar(frustum, spheres, i, end, visible + visibleCount);
+}
+
+__attribute__((target("avx2,fma")))
+uint32_t Culling::CullAVX2(const Frustum &frustum, const Spheres &spheres, uint32_t begin, uint32_t end, uint32_t *visible)
+{
+    uint32_t visibleCount = 0;
+    uint32_t i = begin;
+
+    __m256 planeX[6], planeY[6], planeZ[6], planeDistance[6];
+    for (int plane = 0; plane < 6; plane++) {
+        planeX[plane] = _mm256_set1_ps(frustum.normalX[plane]);
+        planeY[plane] = _mm256_set1_ps(frustum.normalY[plane]);
+        planeZ[plane] = _mm256_set1_ps(frustum.normalZ[plane]);
+        planeDistance[plane] = _mm256_set1_ps(frustum.distance[plane]);
+    }
+
+    for (; i + 8 <= end; i += 8) {
+        __m256 x = _mm256_loadu_ps(spheres.centerX + i);
+        __m256 y = _mm256_loadu_ps(spheres.centerY + i);
+        __m256 z = _mm256_loadu_ps(spheres.centerZ + i);
+        __m256 negativeRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(spheres.radius + i));
+
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int plane = 0; plane < 6; plane++) {
+            __m256 distance = _mm256_fmadd_ps(x, planeX[plane],
+                              _mm256_fmadd_ps(y, planeY[plane],
+                              _mm256_fmadd_ps(z, planeZ[plane], planeDistance[plane])));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negativeRadius, _CMP_GE_OQ));
+        }
+
+        int mask = _mm256_movemask_ps(inside);
+        __m256i lanes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) packTables.lanes8[mask]));
+        _mm256_storeu_si256((__m256i *) (visible + visibleCount), _mm256_add_epi32(lanes, _mm256_set1_epi32(i)));
+        visibleCount += __builtin_popcount(mask);
+    }
+
+    return visibleCount + CullScalar(frustum, spheres, i, end, visible + visibleCount);
+}
+#endif
@@ -0,0 +1,404 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "JobSystem.hpp"
+
+// Entities grouped by which components they have. Every distinct set of
+// components is an archetype, and an archetype keeps its entities in 16 KB
+// chunks. Inside a chunk every field of every component is its own column,
+// a float field is a plain float array, so a chunk can be handed to the
+// structure of arrays kernels of TransformBatch and Culling as it is.
+//
+// Chunks stay packed: a destroyed entity's row is filled with the last
+// entity of the archetype's last chunk, so every chunk but that one is
+// full. Systems walk the chunks of every archetype that has the
+// components they need, ParallelForEachChunk() hands one chunk per job to
+// the JobSystem.
+//
+// An entity handle carries a generation next to its index, a handle whose
+// entity was destroyed is no longer Alive() even once the index is reused.
+// Nothing here gives up on the process: running out of components or
+// entity indices, or components too large for a chunk, comes back as
+// noComponent, noEntity or false for the caller to handle.
+namespace EntityStore {
+    typedef uint32_t Entity;
+    typedef uint64_t Signature;
+
+    static const Entity noEntity = 0xffffffff;
+    static const uint32_t noComponent = 0xffffffff;
+    static const uint32_t chunkBytes = 16 * 1024;
+    static const uint32_t maxComponents = 64;
+
+    // A component is fieldCount columns of fieldSize bytes each
+    struct Component {
+        uint32_t fieldSize;
+        uint32_t fieldCount;
+    };
+
+    struct Block {
+        alignas(64) uint8_t bytes[chunkBytes];
+    };
+
+    struct Chunk {
+        std::unique_ptr<Block> block;
+        uint32_t count;
+    };
+
+    struct Archetype {
+        Signature signature;
+        uint32_t capacity;
+        uint32_t columnOffsets[maxComponents];
+        uint32_t fieldStrides[maxComponents];
+        std::vector<Chunk> chunks;
+    };
+
+    struct Location {
+        uint32_t archetype;
+        uint32_t chunk;
+        uint32_t row;
+        uint8_t generation;
+    };
+
+    struct World {
+        std::vector<Component> components;
+        std::vector<Archetype> archetypes;
+        std::vector<Location> locations;
+        std::vector<uint32_t> freeIndices;
+        uint32_t entityCount;
+    };
+
+    static void Create(World &world);
+    static uint32_t RegisterComponent(World &world, uint32_t fieldSize, uint32_t fieldCount = 1);
+    static Signature Bit(uint32_t component);
+    static Entity CreateEntity(World &world, Signature signature);
+    static uint32_t CreateEntities(World &world, Signature signature, uint32_t count, Entity *entities = nullptr);
+    static void DestroyEntity(World &world, Entity entity);
+    static bool Alive(const World &world, Entity entity);
+    static bool AddComponent(World &world, Entity entity, uint32_t component);
+    static bool RemoveComponent(World &world, Entity entity, uint32_t component);
+    static bool HasComponent(const World &world, Entity entity, uint32_t component);
+    template <typename T>
+    static T *Field(World &world, Entity entity, uint32_t component, uint32_t field = 0);
+    template <typename T>
+    static T *Column(const Archetype &archetype, const Chunk &chunk, uint32_t component, uint32_t field = 0);
+    static const Entity *Entities(const Chunk &chunk);
+    template <typename Function>
+    static void ForEachChunk(World &world, Signature required, const Function &function);
+    template <typename Function>
+    static void ParallelForEachChunk(World &world, Signature required, const Function &function);
+    static uint32_t EntityCount(const World &world);
+}
+
+namespace EntityStore {
+    static const uint32_t indexBits = 24;
+    static const uint32_t indexMask = (1u << indexBits) - 1;
+    static const uint32_t columnAlignment = 64;
+
+    // Where a destroyed entity is, and what FindArchetype() returns for
+    // components that don't fit in a chunk together
+    static const uint32_t noArchetype = 0xffffffff;
+
+    static uint32_t IndexOf(Entity entity)
+    {
+        return entity & indexMask;
+    }
+
+    static uint32_t AlignColumn(uint32_t offset)
+    {
+        return (offset + columnAlignment - 1) & ~(columnAlignment - 1);
+    }
+
+    // The entity handles come first, then every field of every component,
+    // each column starting on its own cache line
+    static uint32_t LayOut(const World &world, Archetype &archetype, uint32_t capacity)
+    {
+        uint32_t offset = AlignColumn(capacity * sizeof(Entity));
+        for (uint32_t component = 0; component < world.components.size(); component++) {
+            if (!(archetype.signature & Bit(component)))
+                continue;
+            const Component &info = world.components[component];
+            archetype.columnOffsets[component] = offset;
+            archetype.fieldStrides[component] = AlignColumn(capacity * info.fieldSize);
+            offset += info.fieldCount * archetype.fieldStrides[component];
+        }
+        return offset;
+    }
+
+    static uint32_t FindArchetype(World &world, Signature signature)
+    {
+        // A scene has a handful of archetypes, looking through them is
+        // cheaper than hashing
+        for (uint32_t i = 0; i < world.archetypes.size(); i++)
+            if (world.archetypes[i].signature == signature)
+                return i;
+
+        Archetype archetype;
+        archetype.signature = signature;
+        memset(archetype.columnOffsets, 0, sizeof(archetype.columnOffsets));
+        memset(archetype.fieldStrides, 0, sizeof(archetype.fieldStrides));
+
+        uint32_t bytesPerEntity = sizeof(Entity);
+        for (uint32_t component = 0; component < world.components.size(); component++)
+            if (signature & Bit(component))
+                bytesPerEntity += world.components[component].fieldSize * world.components[component].fieldCount;
+
+        // As many as fit once every column is padded to a cache line
+        uint32_t capacity = chunkBytes / bytesPerEntity;
+        while (capacity > 0 && LayOut(world, archetype, capacity) > chunkBytes)
+            capacity--;
+        if (capacity == 0)
+            return noArchetype;
+        archetype.capacity = capacity;
+        LayOut(world, archetype, capacity);
+
+        world.archetypes.push_back(std::move(archetype));
+        return (uint32_t) world.archetypes.size() - 1;
+    }
+
+    static uint8_t *FieldAddress(const World &world, const Archetype &archetype, const Chunk &chunk,
+                                 uint32_t component, uint32_t field, uint32_t row)
+    {
+        return chunk.block->bytes + archetype.columnOffsets[component] + field * archetype.fieldStrides[component] +
+               row * world.components[component].fieldSize;
+    }
+
+    // Appends a zeroed row to the archetype for the entity and returns where
+    static Location AppendRow(World &world, uint32_t archetypeIndex, Entity entity)
+    {
+        Archetype &archetype = world.archetypes[archetypeIndex];
+        if (archetype.chunks.empty() || archetype.chunks.back().count == archetype.capacity)
+            archetype.chunks.push_back({ std::unique_ptr<Block>(new Block), 0 });
+
+        uint32_t chunkIndex = (uint32_t) archetype.chunks.size() - 1;
+        Chunk &chunk = archetype.chunks[chunkIndex];
+        uint32_t row = chunk.count++;
+        ((Entity *) chunk.block->bytes)[row] = entity;
+        for (uint32_t component = 0; component < world.components.size(); component++) {
+            if (!(archetype.signature & Bit(component)))
+                continue;
+            for (uint32_t field = 0; field < world.components[component].fieldCount; field++)
+                memset(FieldAddress(world, archetype, chunk, component, field, row), 0, world.components[component].fieldSize);
+        }
+        return { archetypeIndex, chunkIndex, row, (uint8_t) (entity >> indexBits) };
+    }
+
+    // Fills the row with the archetype's last entity, so chunks stay packed
+    static void RemoveRow(World &world, const Location &location)
+    {
+        Archetype &archetype = world.archetypes[location.archetype];
+        Chunk &last = archetype.chunks.back();
+        uint32_t lastRow = last.count - 1;
+        Chunk &chunk = archetype.chunks[location.chunk];
+
+        if (&chunk != &last || location.row != lastRow) {
+            Entity moved = ((Entity *) last.block->bytes)[lastRow];
+            ((Entity *) chunk.block->bytes)[location.row] = moved;
+            for (uint32_t component = 0; component < world.components.size(); component++) {
+                if (!(archetype.signature & Bit(component)))
+                    continue;
+                uint32_t size = world.components[component].fieldSize;
+                for (uint32_t field = 0; field < world.components[component].fieldCount; field++)
+                    memcpy(FieldAddress(world, archetype, chunk, component, field, location.row),
+                           FieldAddress(world, archetype, last, component, field, lastRow), size);
+            }
+            Location &movedLocation = world.locations[IndexOf(moved)];
+            movedLocation.chunk = location.chunk;
+            movedLocation.row = location.row;
+        }
+
+        if (--last.count == 0)
+            archetype.chunks.pop_back();
+    }
+
+    static bool MoveEntity(World &world, Entity entity, Signature signature)
+    {
+        Location from = world.locations[IndexOf(entity)];
+        if (world.archetypes[from.archetype].signature == signature)
+            return true;
+
+        // Finding the archetype may add one and move the others around, so
+        // no references into them are taken before it
+        uint32_t archetypeIndex = FindArchetype(world, signature);
+        if (archetypeIndex == noArchetype)
+            return false;
+        Location to = AppendRow(world, archetypeIndex, entity);
+        const Archetype &source = world.archetypes[from.archetype];
+        const Archetype &destination = world.archetypes[to.archetype];
+        Signature shared = source.signature & destination.signature;
+        for (uint32_t component = 0; component < world.components.size(); component++) {
+            if (!(shared & Bit(component)))
+                continue;
+            for (uint32_t field = 0; field < world.components[component].fieldCount; field++)
+                memcpy(FieldAddress(world, destination, destination.chunks[to.chunk], component, field, to.row),
+                       FieldAddress(world, source, source.chunks[from.chunk], component, field, from.row),
+                       world.components[component].fieldSize);
+        }
+
+        RemoveRow(world, from);
+        world.locations[IndexOf(entity)] = to;
+        return true;
+    }
+
+    static Entity NewHandle(World &world)
+    {
+        // Reused indices come back with the next generation
+        uint32_t index;
+        uint8_t generation = 0;
+        if (!world.freeIndices.empty()) {
+            index = world.freeIndices.back();
+            world.freeIndices.pop_back();
+            generation = world.locations[index].generation + 1;
+        } else {
+            // The last index is never handed out, with generation 255 it
+            // would spell noEntity
+            index = (uint32_t) world.locations.size();
+            if (index >= indexMask)
+                return noEntity;
+            world.locations.push_back({});
+        }
+        world.entityCount++;
+        return index | (Entity) generation << indexBits;
+    }
+}
+
+void EntityStore::Create(World &world)
+{
+    world = World();
+    world.entityCount = 0;
+}
+
+uint32_t EntityStore::RegisterComponent(World &world, uint32_t fieldSize, uint32_t fieldCount)
+{
+    if (world.components.size() == maxComponents)
+        return noComponent;
+    world.components.push_back({ fieldSize, fieldCount });
+    return (uint32_t) world.components.size() - 1;
+}
+
+EntityStore::Signature EntityStore::Bit(uint32_t component)
+{
+    // noComponent has no bit, signatures with it are those without it
+    return component < maxComponents ? (Signature) 1 << component : 0;
+}
+
+EntityStore::Entity EntityStore::CreateEntity(World &world, Signature signature)
+{
+    Entity entity = noEntity;
+    CreateEntities(world, signature, 1, &entity);
+    return entity;
+}
+
+uint32_t EntityStore::CreateEntities(World &world, Signature signature, uint32_t count, Entity *entities)
+{
+    // How many were created, short of count only once there are no entity
+    // indices left, zero if the components don't fit in a chunk together
+    uint32_t archetype = FindArchetype(world, signature);
+    if (archetype == noArchetype)
+        return 0;
+
+    world.archetypes[archetype].chunks.reserve(world.archetypes[archetype].chunks.size() +
+                                               count / world.archetypes[archetype].capacity + 1);
+    world.locations.reserve(world.locations.size() + count);
+    for (uint32_t i = 0; i < count; i++) {
+        Entity entity = NewHandle(world);
+        if (entity == noEntity)
+            return i;
+        world.locations[IndexOf(entity)] = AppendRow(world, archetype, entity);
+        if (entities != nullptr)
+            entities[i] = entity;
+    }
+    return count;
+}
+
+void EntityStore::DestroyEntity(World &world, Entity entity)
+{
+    if (!Alive(world, entity))
+        return;
+    Location &location = world.locations[IndexOf(entity)];
+    RemoveRow(world, location);
+
+    // The generation stays behind so the next handle for this index differs
+    location.archetype = noArchetype;
+    world.freeIndices.push_back(IndexOf(entity));
+    world.entityCount--;
+}
+
+bool EntityStore::Alive(const World &world, Entity entity)
+{
+    uint32_t index = IndexOf(entity);
+    return index < world.locations.size() && world.locations[index].archetype != noArchetype &&
+           world.locations[index].generation == (uint8_t) (entity >> indexBits);
+}
+
+bool EntityStore::AddComponent(World &world, Entity entity, uint32_t component)
+{
+    return Alive(world, entity) && component < world.components.size() &&
+           MoveEntity(world, entity, world.archetypes[world.locations[IndexOf(entity)].archetype].signature | Bit(component));
+}
+
+bool EntityStore::RemoveComponent(World &world, Entity entity, uint32_t component)
+{
+    return Alive(world, entity) &&
+           MoveEntity(world, entity, world.archetypes[world.locations[IndexOf(entity)].archetype].signature & ~Bit(component));
+}
+
+bool EntityStore::HasComponent(const World &world, Entity entity, uint32_t component)
+{
+    return Alive(world, entity) && (world.archetypes[world.locations[IndexOf(entity)].archetype].signature & Bit(component));
+}
+
+template <typename T>
+T *EntityStore::Field(World &world, Entity entity, uint32_t component, uint32_t field)
+{
+    // One entity at a time, for setting things up. Systems go through Column()
+    if (!HasComponent(world, entity, component))
+        return nullptr;
+    const Location &location = world.locations[IndexOf(entity)];
+    const Archetype &archetype = world.archetypes[location.archetype];
+    return (T *) FieldAddress(world, archetype, archetype.chunks[location.chunk], component, field, location.row);
+}
+
+template <typename T>
+T *EntityStore::Column(const Archetype &archetype, const Chunk &chunk, uint32_t component, uint32_t field)
+{
+    return (T *) (chunk.block->bytes + archetype.columnOffsets[component] + field * archetype.fieldStrides[component]);
+}
+
+const EntityStore::Entity *EntityStore::Entities(const Chunk &chunk)
+{
+    return (const Entity *) chunk.block->bytes;
+}
+
+template <typename Function>
+void EntityStore::ForEachChunk(World &world, Signature required, const Function &function)
+{
+    for (Archetype &archetype : world.archetypes)
+        if ((archetype.signature & required) == required)
+            for (Chunk &chunk : archetype.chunks)
+                function(archetype, chunk);
+}
+
+template <typename Function>
+void EntityStore::ParallelForEachChunk(World &world, Signature required, const Function &function)
+{
+    // Chunks of every matching archetype in one list, so a job can take a
+    // chunk of any of them
+    std::vector<std::pair<Archetype *, Chunk *>> chunks;
+    ForEachChunk(world, required, [&chunks](Archetype &archetype, Chunk &chunk) {
+        chunks.push_back({ &archetype, &chunk });
+    });
+
+    JobSystem::ParallelFor(0, (uint32_t) chunks.size(), 1, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++)
+            function(*chunks[i].first, *chunks[i].second);
+    });
+}
+
+uint32_t EntityStore::EntityCount(const World &world)
+{
+    return world.entityCount;
+}
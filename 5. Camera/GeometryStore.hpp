@@ -0,0 +1,283 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include <GL/glew.h>
+
+#include "GlState.hpp"
+#include "StreamBuffer.hpp"
+#include "VertexFormat.hpp"
+
+// Many meshes packed into one vertex buffer and one index buffer behind a
+// single VAO. A mesh is only a range of indices plus the vertex its indices
+// count from, so drawing any of them needs no binds at all, and a whole
+// list of them goes out with one glMultiDrawElementsIndirect().
+//
+// Per draw data comes in through the base instance of each command: the
+// per instance attributes of draw N start at its baseInstance, so the
+// shader needs neither gl_DrawID nor anything newer than GLSL 3.30.
+//
+// Vertices are encoded into the store's VertexFormat::Layout as they are
+// added. Indices stay relative to their mesh, so they are uploaded as
+// 16-bit whenever no single mesh has more than 65536 vertices, however
+// large the store as a whole gets. Data that is already encoded, such as a
+// MeshFile, goes straight to UploadEncoded() instead.
+namespace GeometryStore {
+    // Layout glDrawElementsIndirect() and glMultiDrawElementsIndirect() expect
+    struct DrawElementsIndirectCommand {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    struct Mesh {
+        GLuint firstIndex;
+        GLuint indexCount;
+        GLint baseVertex;
+        GLuint vertexCount;
+    };
+
+    struct Store {
+        GLuint vertexArray;
+        GLuint vertexBuffer;
+        GLuint indexBuffer;
+        VertexFormat::Layout layout;
+        GLenum indexType;
+        GLsizei indexSize;
+        GLuint vertexCount;
+        GLuint indexCount;
+        std::vector<uint8_t> vertices;
+        std::vector<GLuint> indices;
+        std::vector<Mesh> meshes;
+    };
+
+    // The draws of one material, rebuilt every frame and streamed to the
+    // GPU through a ring of command buffers
+    struct Batch {
+        std::vector<DrawElementsIndirectCommand> commands;
+        StreamBuffer::Buffer commandStream;
+    };
+
+    static void Create(Store &store, const VertexFormat::Layout &layout);
+    static uint32_t AddMesh(Store &store, const VertexFormat::Source &vertices, GLuint vertexCount, const GLuint *indices, GLuint indexCount);
+    static uint32_t AddLod(Store &store, uint32_t mesh, const GLuint *indices, GLuint indexCount);
+    static void Upload(Store &store);
+    static GLenum ChooseIndexType(const Store &store);
+    static void UploadEncoded(Store &store, const void *vertices, const void *indices);
+    static void PrintStats(const Store &store);
+    static DrawElementsIndirectCommand Command(const Store &store, uint32_t mesh, GLuint instanceCount, GLuint baseInstance);
+    static void DrawMesh(const Store &store, uint32_t mesh);
+    static void Destroy(Store &store);
+
+    static bool MultiDrawSupported();
+    static void CreateBatch(Batch &batch, int maxCommands);
+    static void AddDraw(Batch &batch, const Store &store, uint32_t mesh, GLuint instanceCount, GLuint baseInstance);
+    static void Submit(Batch &batch, const Store &store, const std::function<void(GLuint baseInstance)> &setBaseInstance = nullptr);
+    static void DestroyBatch(Batch &batch);
+}
+
+namespace GeometryStore {
+    // Large uploads go out in slices of this size, so a source that is a
+    // mapped file only needs one slice of it paged in at a time
+    static const size_t uploadSliceSize = 64 << 20;
+
+    static void BufferData(GLenum target, size_t size, const void *data)
+    {
+        if (size <= uploadSliceSize) {
+            glBufferData(target, size, data, GL_STATIC_DRAW);
+            return;
+        }
+
+        glBufferData(target, size, nullptr, GL_STATIC_DRAW);
+        for (size_t offset = 0; offset < size; offset += uploadSliceSize)
+            glBufferSubData(target, offset, std::min(uploadSliceSize, size - offset), (const uint8_t *) data + offset);
+    }
+}
+
+void GeometryStore::Create(Store &store, const VertexFormat::Layout &layout)
+{
+    store.vertexArray = 0;
+    store.vertexBuffer = 0;
+    store.indexBuffer = 0;
+    store.layout = layout;
+    store.indexType = GL_UNSIGNED_INT;
+    store.indexSize = sizeof(GLuint);
+    store.vertexCount = 0;
+    store.indexCount = 0;
+    store.vertices.clear();
+    store.indices.clear();
+    store.meshes.clear();
+}
+
+uint32_t GeometryStore::AddMesh(Store &store, const VertexFormat::Source &vertices, GLuint vertexCount, const GLuint *indices, GLuint indexCount)
+{
+    // Indices stay relative to the mesh, baseVertex moves them to where
+    // its vertices ended up
+    Mesh mesh;
+    mesh.firstIndex = store.indexCount;
+    mesh.indexCount = indexCount;
+    mesh.baseVertex = (GLint) store.vertexCount;
+    mesh.vertexCount = vertexCount;
+
+    store.vertices.resize(store.vertices.size() + (size_t) vertexCount * store.layout.stride);
+    VertexFormat::Encode(store.layout, vertices, vertexCount, store.vertices.data() + (size_t) store.vertexCount * store.layout.stride);
+    store.indices.insert(store.indices.end(), indices, indices + indexCount);
+    store.vertexCount += vertexCount;
+    store.indexCount += indexCount;
+
+    store.meshes.push_back(mesh);
+    return (uint32_t) store.meshes.size() - 1;
+}
+
+uint32_t GeometryStore::AddLod(Store &store, uint32_t mesh, const GLuint *indices, GLuint indexCount)
+{
+    // A simplified version of a mesh that only drops vertices: it gets its
+    // own indices but shares the vertices of the mesh it was made from
+    Mesh lod = store.meshes[mesh];
+    lod.firstIndex = store.indexCount;
+    lod.indexCount = indexCount;
+
+    store.indices.insert(store.indices.end(), indices, indices + indexCount);
+    store.indexCount += indexCount;
+
+    store.meshes.push_back(lod);
+    return (uint32_t) store.meshes.size() - 1;
+}
+
+void GeometryStore::Upload(Store &store)
+{
+    store.indexType = ChooseIndexType(store);
+    store.indexSize = store.indexType == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(GLuint);
+    if (store.indexType == GL_UNSIGNED_SHORT) {
+        std::vector<uint16_t> shortIndices(store.indices.begin(), store.indices.end());
+        UploadEncoded(store, store.vertices.data(), shortIndices.data());
+    } else {
+        UploadEncoded(store, store.vertices.data(), store.indices.data());
+    }
+
+    // The GPU has its own copy now
+    store.vertices = std::vector<uint8_t>();
+    store.indices = std::vector<GLuint>();
+}
+
+GLenum GeometryStore::ChooseIndexType(const Store &store)
+{
+    GLuint largestMesh = 0;
+    for (const Mesh &mesh : store.meshes)
+        largestMesh = std::max(largestMesh, mesh.vertexCount);
+    return largestMesh <= 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
+void GeometryStore::UploadEncoded(Store &store, const void *vertices, const void *indices)
+{
+    // Vertices already in store.layout and indices already in
+    // store.indexType, for data that was encoded ahead of time. Meshes and
+    // counts have to be filled in
+    glGenVertexArrays(1, &store.vertexArray);
+    GlState::BindVertexArray(store.vertexArray);
+
+    glGenBuffers(1, &store.vertexBuffer);
+    GlState::BindBuffer(GL_ARRAY_BUFFER, store.vertexBuffer);
+    BufferData(GL_ARRAY_BUFFER, (size_t) store.vertexCount * store.layout.stride, vertices);
+
+    VertexFormat::SetAttributes(store.layout);
+
+    glGenBuffers(1, &store.indexBuffer);
+    GlState::BindBuffer(GL_ELEMENT_ARRAY_BUFFER, store.indexBuffer);
+    BufferData(GL_ELEMENT_ARRAY_BUFFER, (size_t) store.indexCount * store.indexSize, indices);
+
+    // The VAO stays bound for the caller to add its own attributes
+}
+
+void GeometryStore::PrintStats(const Store &store)
+{
+    GLsizei floatStride = VertexFormat::FloatStride(store.layout);
+    std::cout << "Geometry: " << store.vertexCount << " vertices in " << VertexFormat::Describe(store.layout) << ", "
+              << store.layout.stride << " bytes per vertex (" << floatStride << " as floats), "
+              << store.indexCount << " " << store.indexSize * 8 << "-bit indices, "
+              << store.vertexCount * store.layout.stride + store.indexCount * store.indexSize << " bytes ("
+              << store.vertexCount * floatStride + store.indexCount * sizeof(GLuint) << " before packing)" << std::endl;
+}
+
+GeometryStore::DrawElementsIndirectCommand GeometryStore::Command(const Store &store, uint32_t mesh, GLuint instanceCount, GLuint baseInstance)
+{
+    const Mesh &range = store.meshes[mesh];
+    return { range.indexCount, instanceCount, range.firstIndex, range.baseVertex, baseInstance };
+}
+
+void GeometryStore::DrawMesh(const Store &store, uint32_t mesh)
+{
+    const Mesh &range = store.meshes[mesh];
+    glDrawElementsBaseVertex(GL_TRIANGLES, range.indexCount, store.indexType,
+                             (void *) (uintptr_t) (range.firstIndex * store.indexSize), range.baseVertex);
+}
+
+void GeometryStore::Destroy(Store &store)
+{
+    GlState::DeleteBuffers(1, &store.indexBuffer);
+    GlState::DeleteBuffers(1, &store.vertexBuffer);
+    GlState::DeleteVertexArrays(1, &store.vertexArray);
+}
+
+bool GeometryStore::MultiDrawSupported()
+{
+    // The commands carry a base instance, a field that is reserved and has
+    // to be zero without base instance support
+    return (GLEW_VERSION_4_3 || GLEW_ARB_multi_draw_indirect) && (GLEW_VERSION_4_2 || GLEW_ARB_base_instance);
+}
+
+void GeometryStore::CreateBatch(Batch &batch, int maxCommands)
+{
+    batch.commands.reserve(maxCommands);
+    if (MultiDrawSupported())
+        StreamBuffer::Create(batch.commandStream, GL_DRAW_INDIRECT_BUFFER, maxCommands * sizeof(DrawElementsIndirectCommand));
+}
+
+void GeometryStore::AddDraw(Batch &batch, const Store &store, uint32_t mesh, GLuint instanceCount, GLuint baseInstance)
+{
+    if (instanceCount > 0)
+        batch.commands.push_back(Command(store, mesh, instanceCount, baseInstance));
+}
+
+void GeometryStore::Submit(Batch &batch, const Store &store, const std::function<void(GLuint baseInstance)> &setBaseInstance)
+{
+    if (batch.commands.empty())
+        return;
+
+    if (MultiDrawSupported()) {
+        GLintptr offset;
+        void *commands = StreamBuffer::Map(batch.commandStream, &offset);
+        memcpy(commands, batch.commands.data(), batch.commands.size() * sizeof(DrawElementsIndirectCommand));
+        StreamBuffer::Unmap(batch.commandStream);
+
+        GlState::BindBuffer(GL_DRAW_INDIRECT_BUFFER, batch.commandStream.buffer);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, store.indexType, (void *) offset, (GLsizei) batch.commands.size(), 0);
+        StreamBuffer::Fence(batch.commandStream);
+    } else {
+        // Before base instances the caller has to move the per instance
+        // attributes itself, one draw at a time
+        for (const DrawElementsIndirectCommand &command : batch.commands) {
+            if (setBaseInstance)
+                setBaseInstance(command.baseInstance);
+            glDrawElementsInstancedBaseVertex(GL_TRIANGLES, command.count, store.indexType,
+                                              (void *) (uintptr_t) (command.firstIndex * store.indexSize),
+                                              command.instanceCount, command.baseVertex);
+        }
+    }
+
+    batch.commands.clear();
+}
+
+void GeometryStore::DestroyBatch(Batch &batch)
+{
+    if (MultiDrawSupported())
+        StreamBuffer::Destroy(batch.commandStream);
+    batch.commands = std::vector<DrawElementsIndirectCommand>();
+}
@@ -0,0 +1,307 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+
+#include <GL/glew.h>
+
+// Shadow copy of the GL bindings and capabilities the samples change. Every
+// call compares against what was set last and only reaches the driver when
+// something actually changes, so code can bind what it needs without
+// knowing what ran before it. Counters tell how many calls went through
+// and how many were dropped.
+//
+// There is one copy for the one context, it is only touched by whichever
+// thread has the context current. Objects have to be deleted through here
+// as well: GL unbinds a deleted buffer, and a name it later hands out again
+// must not look bound already. Anything that changes state behind the
+// cache's back has to call Reset() afterwards.
+namespace GlState {
+    struct Counters {
+        uint64_t issued;
+        uint64_t elided;
+    };
+
+    static void UseProgram(GLuint program);
+    static void BindVertexArray(GLuint vertexArray);
+    static void BindBuffer(GLenum target, GLuint buffer);
+    static void BindBufferBase(GLenum target, GLuint index, GLuint buffer);
+    static void BindFramebuffer(GLenum target, GLuint framebuffer);
+    static void Enable(GLenum capability);
+    static void Disable(GLenum capability);
+
+    static void DeleteBuffers(GLsizei count, const GLuint *buffers);
+    static void DeleteVertexArrays(GLsizei count, const GLuint *vertexArrays);
+    static void DeleteFramebuffers(GLsizei count, const GLuint *framebuffers);
+
+    static void Reset();
+    static void BeginFrame();
+    static const Counters &FrameCounters();
+    static void PrintStats(uint64_t frameCount);
+}
+
+namespace GlState {
+    // Nothing is known about a binding until it has been set once
+    static const GLuint unknown = 0xffffffff;
+
+    // Generic buffer binding points with a slot here, others go straight
+    // to GL every time
+    enum BufferSlot {
+        ArrayBufferSlot,
+        ElementArrayBufferSlot,
+        UniformBufferSlot,
+        ShaderStorageBufferSlot,
+        DrawIndirectBufferSlot,
+        CopyReadBufferSlot,
+        CopyWriteBufferSlot,
+        BufferSlotCount
+    };
+
+    // Indexed binding points, for uniform blocks and shader storage
+    static const GLuint indexedBindings = 16;
+
+    enum CapabilitySlot {
+        DepthTestSlot,
+        CullFaceSlot,
+        BlendSlot,
+        ScissorTestSlot,
+        StencilTestSlot,
+        CapabilitySlotCount
+    };
+
+    static GLuint program = unknown;
+    static GLuint vertexArray = unknown;
+    static GLuint buffers[BufferSlotCount];
+    static GLuint uniformBuffers[indexedBindings];
+    static GLuint storageBuffers[indexedBindings];
+    static GLuint drawFramebuffer = unknown;
+    static GLuint readFramebuffer = unknown;
+
+    // 0 disabled, 1 enabled, -1 not known
+    static int8_t capabilities[CapabilitySlotCount];
+
+    static bool initialized = false;
+    static Counters frame = {};
+    static Counters total = {};
+
+    static int BufferSlotOf(GLenum target)
+    {
+        switch (target) {
+            case GL_ARRAY_BUFFER: return ArrayBufferSlot;
+            case GL_ELEMENT_ARRAY_BUFFER: return ElementArrayBufferSlot;
+            case GL_UNIFORM_BUFFER: return UniformBufferSlot;
+            case GL_SHADER_STORAGE_BUFFER: return ShaderStorageBufferSlot;
+            case GL_DRAW_INDIRECT_BUFFER: return DrawIndirectBufferSlot;
+            case GL_COPY_READ_BUFFER: return CopyReadBufferSlot;
+            case GL_COPY_WRITE_BUFFER: return CopyWriteBufferSlot;
+            default: return -1;
+        }
+    }
+
+    static int CapabilitySlotOf(GLenum capability)
+    {
+        switch (capability) {
+            case GL_DEPTH_TEST: return DepthTestSlot;
+            case GL_CULL_FACE: return CullFaceSlot;
+            case GL_BLEND: return BlendSlot;
+            case GL_SCISSOR_TEST: return ScissorTestSlot;
+            case GL_STENCIL_TEST: return StencilTestSlot;
+            default: return -1;
+        }
+    }
+
+    static GLuint *IndexedBindingsOf(GLenum target)
+    {
+        if (target == GL_UNIFORM_BUFFER)
+            return uniformBuffers;
+        if (target == GL_SHADER_STORAGE_BUFFER)
+            return storageBuffers;
+        return nullptr;
+    }
+
+    // Counts the call and tells whether it has to go to GL
+    static bool Change(GLuint &cached, GLuint value)
+    {
+        if (!initialized)
+            Reset();
+        if (cached == value) {
+            frame.elided++;
+            total.elided++;
+            return false;
+        }
+        cached = value;
+        frame.issued++;
+        total.issued++;
+        return true;
+    }
+
+    static void Issue()
+    {
+        if (!initialized)
+            Reset();
+        frame.issued++;
+        total.issued++;
+    }
+
+    static void SetCapability(GLenum capability, bool enabled)
+    {
+        int slot = CapabilitySlotOf(capability);
+        if (!initialized)
+            Reset();
+        if (slot >= 0 && capabilities[slot] == (enabled ? 1 : 0)) {
+            frame.elided++;
+            total.elided++;
+            return;
+        }
+        if (slot >= 0)
+            capabilities[slot] = enabled ? 1 : 0;
+        Issue();
+        if (enabled)
+            glEnable(capability);
+        else
+            glDisable(capability);
+    }
+
+    static void Forget(GLuint &cached, GLuint object)
+    {
+        if (cached == object)
+            cached = 0;
+    }
+}
+
+void GlState::UseProgram(GLuint program)
+{
+    if (Change(GlState::program, program))
+        glUseProgram(program);
+}
+
+void GlState::BindVertexArray(GLuint vertexArray)
+{
+    // The element array binding is part of the vertex array, whatever the
+    // new one has bound is not known here
+    if (Change(GlState::vertexArray, vertexArray)) {
+        glBindVertexArray(vertexArray);
+        buffers[ElementArrayBufferSlot] = unknown;
+    }
+}
+
+void GlState::BindBuffer(GLenum target, GLuint buffer)
+{
+    int slot = BufferSlotOf(target);
+    if (slot < 0) {
+        Issue();
+        glBindBuffer(target, buffer);
+    } else if (Change(buffers[slot], buffer)) {
+        glBindBuffer(target, buffer);
+    }
+}
+
+void GlState::BindBufferBase(GLenum target, GLuint index, GLuint buffer)
+{
+    // Binds the generic binding point as well
+    GLuint *indexed = IndexedBindingsOf(target);
+    int slot = BufferSlotOf(target);
+    if (indexed == nullptr || index >= indexedBindings) {
+        Issue();
+        glBindBufferBase(target, index, buffer);
+        if (slot >= 0)
+            buffers[slot] = buffer;
+    } else if (Change(indexed[index], buffer)) {
+        glBindBufferBase(target, index, buffer);
+        buffers[slot] = buffer;
+    }
+}
+
+void GlState::BindFramebuffer(GLenum target, GLuint framebuffer)
+{
+    if (target == GL_FRAMEBUFFER) {
+        if (!initialized)
+            Reset();
+        if (drawFramebuffer == framebuffer && readFramebuffer == framebuffer) {
+            frame.elided++;
+            total.elided++;
+            return;
+        }
+        drawFramebuffer = readFramebuffer = framebuffer;
+        Issue();
+        glBindFramebuffer(target, framebuffer);
+    } else if (Change(target == GL_READ_FRAMEBUFFER ? readFramebuffer : drawFramebuffer, framebuffer)) {
+        glBindFramebuffer(target, framebuffer);
+    }
+}
+
+void GlState::Enable(GLenum capability)
+{
+    SetCapability(capability, true);
+}
+
+void GlState::Disable(GLenum capability)
+{
+    SetCapability(capability, false);
+}
+
+void GlState::DeleteBuffers(GLsizei count, const GLuint *buffers)
+{
+    for (GLsizei i = 0; i < count; i++) {
+        for (GLuint &cached : GlState::buffers)
+            Forget(cached, buffers[i]);
+        for (GLuint index = 0; index < indexedBindings; index++) {
+            Forget(uniformBuffers[index], buffers[i]);
+            Forget(storageBuffers[index], buffers[i]);
+        }
+    }
+    glDeleteBuffers(count, buffers);
+}
+
+void GlState::DeleteVertexArrays(GLsizei count, const GLuint *vertexArrays)
+{
+    for (GLsizei i = 0; i < count; i++)
+        if (vertexArray == vertexArrays[i]) {
+            vertexArray = 0;
+            buffers[ElementArrayBufferSlot] = 0;
+        }
+    glDeleteVertexArrays(count, vertexArrays);
+}
+
+void GlState::DeleteFramebuffers(GLsizei count, const GLuint *framebuffers)
+{
+    for (GLsizei i = 0; i < count; i++) {
+        Forget(drawFramebuffer, framebuffers[i]);
+        Forget(readFramebuffer, framebuffers[i]);
+    }
+    glDeleteFramebuffers(count, framebuffers);
+}
+
+void GlState::Reset()
+{
+    // The next change of everything goes to GL, whatever was set before
+    program = unknown;
+    vertexArray = unknown;
+    for (GLuint &buffer : buffers)
+        buffer = unknown;
+    for (GLuint index = 0; index < indexedBindings; index++)
+        uniformBuffers[index] = storageBuffers[index] = unknown;
+    drawFramebuffer = readFramebuffer = unknown;
+    for (int8_t &capability : capabilities)
+        capability = -1;
+    initialized = true;
+}
+
+void GlState::BeginFrame()
+{
+    frame = {};
+}
+
+const GlState::Counters &GlState::FrameCounters()
+{
+    return frame;
+}
+
+void GlState::PrintStats(uint64_t frameCount)
+{
+    if (frameCount == 0)
+        return;
+    uint64_t calls = total.issued + total.elided;
+    std::cout << "GL state: " << total.issued / frameCount << " changes issued, " << total.elided / frameCount
+              << " elided per frame (" << (calls > 0 ? 100.0 * total.elided / calls : 0.0) << "% redundant)" << std::endl;
+}
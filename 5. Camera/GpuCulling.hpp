@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "Culling.hpp"
+#include "GeometryStore.hpp"
+#include "GlState.hpp"
+#include "Shader.hpp"
+
+// Frustum culling on the GPU for OpenGL 4.3 and up. The instance inputs
+// are uploaded once; every frame a compute shader tests all bounding
+// spheres, builds the model matrices of the visible ones into a compact
+// buffer and counts them straight into the DrawElementsIndirectCommand of
+// their mesh. Each mesh owns the range of the matrix buffer that starts at
+// its command's baseInstance. The draw then reads its instance counts from
+// that buffer with glMultiDrawElementsIndirect(), so nothing goes back to
+// the CPU and nothing per instance comes from it.
+namespace GpuCulling {
+    typedef GeometryStore::DrawElementsIndirectCommand DrawElementsIndirectCommand;
+
+    // One instance in the input buffer, laid out with std430 rules. The
+    // index of its command rides along in scale.w
+    struct Instance {
+        glm::vec4 positionRadius;
+        glm::vec4 axisSpeed;
+        glm::vec4 scale;
+    };
+
+    struct Culler {
+        GLuint program;
+        GLuint instanceBuffer;
+        GLuint matrixBuffer;
+        GLuint commandBuffer;
+        GLuint resetBuffer;
+        GLsizei commandCount;
+        GLenum indexType;
+        GLint frustumPlanesLocation;
+        GLint totalCountLocation;
+        GLint timeLocation;
+        uint32_t instanceCount;
+    };
+
+    static bool Supported();
+    static bool Create(Culler &culler, const std::string &computePath, const std::vector<Instance> &instances,
+                       const std::vector<DrawElementsIndirectCommand> &commands, GLenum indexType);
+    static void Cull(const Culler &culler, const Culling::Frustum &frustum, float time);
+    static void Draw(const Culler &culler);
+    static uint32_t ReadVisibleCount(const Culler &culler);
+    static void Destroy(Culler &culler);
+}
+
+namespace GpuCulling {
+    // Has to match local_size_x in the compute shader
+    static const GLuint groupSize = 64;
+}
+
+bool GpuCulling::Supported()
+{
+    return GLEW_VERSION_4_3;
+}
+
+bool GpuCulling::Create(Culler &culler, const std::string &computePath, const std::vector<Instance> &instances,
+                        const std::vector<DrawElementsIndirectCommand> &commands, GLenum indexType)
+{
+    culler.program = Shader::CreateComputeProgram(computePath);
+    if (culler.program == 0)
+        return false;
+
+    culler.frustumPlanesLocation = glGetUniformLocation(culler.program, "FrustumPlanes");
+    culler.totalCountLocation = glGetUniformLocation(culler.program, "TotalCount");
+    culler.timeLocation = glGetUniformLocation(culler.program, "Time");
+    culler.instanceCount = (uint32_t) instances.size();
+    culler.indexType = indexType;
+
+    glGenBuffers(1, &culler.instanceBuffer);
+    GlState::BindBuffer(GL_SHADER_STORAGE_BUFFER, culler.instanceBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, instances.size() * sizeof(Instance), instances.data(), GL_STATIC_DRAW);
+
+    // Room for every instance, the shader decides how much of it is used.
+    // It is also the vertex attribute source of the draw
+    glGenBuffers(1, &culler.matrixBuffer);
+    GlState::BindBuffer(GL_SHADER_STORAGE_BUFFER, culler.matrixBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, instances.size() * sizeof(glm::mat4), nullptr, GL_DYNAMIC_COPY);
+
+    // The commands come with zero instances. A pristine copy stays on the
+    // GPU to reset them from every frame
+    culler.commandCount = (GLsizei) commands.size();
+    GLsizeiptr commandsSize = commands.size() * sizeof(DrawElementsIndirectCommand);
+
+    glGenBuffers(1, &culler.resetBuffer);
+    GlState::BindBuffer(GL_COPY_READ_BUFFER, culler.resetBuffer);
+    glBufferData(GL_COPY_READ_BUFFER, commandsSize, commands.data(), GL_STATIC_COPY);
+
+    glGenBuffers(1, &culler.commandBuffer);
+    GlState::BindBuffer(GL_DRAW_INDIRECT_BUFFER, culler.commandBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, commandsSize, commands.data(), GL_DYNAMIC_COPY);
+
+    return true;
+}
+
+void GpuCulling::Cull(const Culler &culler, const Culling::Frustum &frustum, float time)
+{
+    glm::vec4 planes[6];
+    for (int i = 0; i < 6; i++)
+        planes[i] = glm::vec4(frustum.normalX[i], frustum.normalY[i], frustum.normalZ[i], frustum.distance[i]);
+
+    // Zero the instance counts without a trip through the CPU
+    GlState::BindBuffer(GL_COPY_READ_BUFFER, culler.resetBuffer);
+    GlState::BindBuffer(GL_COPY_WRITE_BUFFER, culler.commandBuffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                        culler.commandCount * sizeof(DrawElementsIndirectCommand));
+
+    GlState::UseProgram(culler.program);
+    glUniform4fv(culler.frustumPlanesLocation, 6, &planes[0].x);
+    glUniform1ui(culler.totalCountLocation, culler.instanceCount);
+    glUniform1f(culler.timeLocation, time);
+
+    GlState::BindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, culler.instanceBuffer);
+    GlState::BindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, culler.matrixBuffer);
+    GlState::BindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, culler.commandBuffer);
+    glDispatchCompute((culler.instanceCount + groupSize - 1) / groupSize, 1, 1);
+
+    // Shader writes are only visible to the draw's command and vertex
+    // fetches after a barrier
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+}
+
+void GpuCulling::Draw(const Culler &culler)
+{
+    GlState::BindBuffer(GL_DRAW_INDIRECT_BUFFER, culler.commandBuffer);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, culler.indexType, nullptr, culler.commandCount, 0);
+}
+
+uint32_t GpuCulling::ReadVisibleCount(const Culler &culler)
+{
+    // Waits for the dispatch to finish, only meant for checking results
+    std::vector<DrawElementsIndirectCommand> commands(culler.commandCount);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    GlState::BindBuffer(GL_DRAW_INDIRECT_BUFFER, culler.commandBuffer);
+    glGetBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data());
+
+    uint32_t visibleCount = 0;
+    for (const DrawElementsIndirectCommand &command : commands)
+        visibleCount += command.instanceCount;
+    return visibleCount;
+}
+
+void GpuCulling::Destroy(Culler &culler)
+{
+    GlState::DeleteBuffers(1, &culler.resetBuffer);
+    GlState::DeleteBuffers(1, &culler.commandBuffer);
+    GlState::DeleteBuffers(1, &culler.matrixBuffer);
+    GlState::DeleteBuffers(1, &culler.instanceBuffer);
+    glDeleteProgram(culler.program);
+}
@@ -0,0 +1,402 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing job scheduler. Every thread owns a Chase-Lev deque: it pushes
+// and pops its own jobs at the bottom without taking a lock, while a thread
+// that runs dry steals the oldest job from the top of someone else's. A job
+// is a function pointer over a range of indices and lives in a slot its
+// deque owns, so starting one never allocates.
+//
+// A Counter tracks jobs in flight. Wait() keeps running jobs, any jobs,
+// until the counter drops to zero, and a job started with an `after`
+// counter is held back until that one has, which is how dependencies are
+// expressed. Ranges larger than their grain are halved on demand: the
+// thread running one puts the upper half in its deque for anyone idle to
+// steal and goes on with the lower half.
+//
+// Pool threads have a deque each. Any other thread borrows one shared deque
+// for as long as it is inside a call; a second outside thread that finds it
+// taken still steals, but runs the jobs it starts itself on the spot.
+namespace JobSystem {
+    typedef void (*JobFunction)(void *data, uint32_t begin, uint32_t end);
+
+    struct Counter;
+
+    struct Task {
+        JobFunction function;
+        void *data;
+        uint32_t begin;
+        uint32_t end;
+        uint32_t grain;
+        Counter *counter;
+    };
+
+    struct Counter {
+        std::atomic<uint32_t> pending{0};
+        std::mutex mutex;
+        std::vector<Task> continuations;
+    };
+
+    static void Start(int workerCount);
+    static void Stop();
+    static int ThreadCount();
+    static void Run(JobFunction function, void *data, uint32_t begin, uint32_t end, uint32_t grain, Counter &counter,
+                    Counter *after = nullptr);
+    static void Wait(Counter &counter);
+    template <typename Function>
+    static void ParallelFor(uint32_t begin, uint32_t end, uint32_t grain, const Function &function);
+}
+
+namespace JobSystem {
+    // Per deque, a power of two. A thread with this many jobs queued runs
+    // the next one it starts itself
+    static const int64_t dequeCapacity = 1024;
+
+    // Rounds of looking for work before an idle worker goes to sleep
+    static const int idleRounds = 64;
+
+    struct Job {
+        Task task;
+        std::atomic<bool> busy;
+    };
+
+    struct Deque {
+        alignas(64) std::atomic<int64_t> top;
+        alignas(64) std::atomic<int64_t> bottom;
+        uint32_t nextJob;
+        std::atomic<Job *> slots[dequeCapacity];
+        Job jobs[dequeCapacity];
+    };
+
+    // Deque 0 is the one outside threads share, workers have the rest
+    static std::vector<std::unique_ptr<Deque>> deques;
+    static std::vector<std::thread> workers;
+    static std::atomic<bool> sharedDequeTaken{false};
+    static thread_local int threadIndex = -1;
+    static thread_local int sharedDequeDepth = 0;
+
+    static std::mutex sleepMutex;
+    static std::condition_variable wake;
+    static std::atomic<int> sleepingWorkers{0};
+    static uint64_t wakeups = 0;
+    static std::atomic<bool> stopping{false};
+
+    static int Enter();
+    static void Leave(int index);
+    static bool Push(Deque &deque, const Task &task);
+    static Job *Pop(Deque &deque);
+    static Job *Steal(Deque &deque);
+    static bool FindWork(int index, Task &task);
+    static bool AnyWork();
+    static void WakeWorker();
+    static void Submit(const Task &task);
+    static void Execute(int index, Task task);
+    static void Finish(Counter &counter);
+    static void WorkerLoop(int index);
+
+    template <typename Function>
+    static void CallRange(void *data, uint32_t begin, uint32_t end)
+    {
+        (*(const Function *) data)(begin, end);
+    }
+}
+
+void JobSystem::Start(int workerCount)
+{
+    stopping = false;
+    for (int i = 0; i <= workerCount; i++)
+        deques.emplace_back(new Deque());
+    for (int i = 1; i <= workerCount; i++)
+        workers.emplace_back(WorkerLoop, i);
+}
+
+void JobSystem::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+        wakeups++;
+    }
+    wake.notify_all();
+
+    for (std::thread &worker : workers)
+        worker.join();
+    workers.clear();
+    deques.clear();
+}
+
+int JobSystem::ThreadCount()
+{
+    return (int) workers.size() + 1;
+}
+
+void JobSystem::Run(JobFunction function, void *data, uint32_t begin, uint32_t end, uint32_t grain, Counter &counter,
+                    Counter *after)
+{
+    Task task = { function, data, begin, end, std::max(grain, 1u), &counter };
+    counter.pending.fetch_add(1, std::memory_order_relaxed);
+
+    // Parked on the other counter, the job that takes it to zero starts
+    // this one. Counters only ever reach zero under their lock
+    if (after != nullptr) {
+        std::lock_guard<std::mutex> lock(after->mutex);
+        if (after->pending.load(std::memory_order_acquire) > 0) {
+            after->continuations.push_back(task);
+            return;
+        }
+    }
+    Submit(task);
+}
+
+void JobSystem::Wait(Counter &counter)
+{
+    int index = Enter();
+    while (counter.pending.load(std::memory_order_acquire) > 0) {
+        Task task;
+        if (FindWork(index, task))
+            Execute(index, task);
+        else
+            std::this_thread::yield();
+    }
+    Leave(index);
+
+    // The last job can still be on its way out of Finish(), the counter may
+    // only go away once that has let go of the lock
+    std::lock_guard<std::mutex> lock(counter.mutex);
+}
+
+template <typename Function>
+void JobSystem::ParallelFor(uint32_t begin, uint32_t end, uint32_t grain, const Function &function)
+{
+    // Nobody to share with, or not enough to share
+    if (ThreadCount() == 1 || end - begin <= grain) {
+        if (begin < end)
+            function(begin, end);
+        return;
+    }
+
+    // The calling thread starts on the range right away instead of queueing
+    // it, and splits off halves for the others as it goes
+    Counter counter;
+    counter.pending = 1;
+    int index = Enter();
+    Execute(index, { CallRange<Function>, (void *) &function, begin, end, std::max(grain, 1u), &counter });
+    Wait(counter);
+    Leave(index);
+}
+
+int JobSystem::Enter()
+{
+    if (threadIndex >= 0)
+        return threadIndex;
+    if (deques.empty())
+        return -1;
+    if (sharedDequeDepth > 0) {
+        sharedDequeDepth++;
+        return 0;
+    }
+
+    bool expected = false;
+    if (!sharedDequeTaken.compare_exchange_strong(expected, true, std::memory_order_acquire))
+        return -1;
+    sharedDequeDepth = 1;
+    return 0;
+}
+
+void JobSystem::Leave(int index)
+{
+    // Jobs left in the shared deque stay there for the next thread that
+    // borrows it, or for a thief
+    if (index == 0 && threadIndex < 0 && --sharedDequeDepth == 0)
+        sharedDequeTaken.store(false, std::memory_order_release);
+}
+
+bool JobSystem::Push(Deque &deque, const Task &task)
+{
+    // Slots are handed out in turn, one still waiting to be taken means
+    // the deque is as good as full
+    Job *job = &deque.jobs[deque.nextJob & (dequeCapacity - 1)];
+    if (job->busy.load(std::memory_order_acquire))
+        return false;
+
+    int64_t bottom = deque.bottom.load(std::memory_order_relaxed);
+    int64_t top = deque.top.load(std::memory_order_acquire);
+    if (bottom - top >= dequeCapacity)
+        return false;
+
+    deque.nextJob++;
+    job->task = task;
+    job->busy.store(true, std::memory_order_relaxed);
+    deque.slots[bottom & (dequeCapacity - 1)].store(job, std::memory_order_relaxed);
+    deque.bottom.store(bottom + 1, std::memory_order_release);
+    return true;
+}
+
+JobSystem::Job *JobSystem::Pop(Deque &deque)
+{
+    // Claims the bottom slot first; only when a thief may be after the
+    // same last job does the top counter decide who gets it
+    int64_t bottom = deque.bottom.load(std::memory_order_relaxed) - 1;
+    deque.bottom.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = deque.top.load(std::memory_order_relaxed);
+
+    if (top > bottom) {
+        deque.bottom.store(bottom + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    Job *job = deque.slots[bottom & (dequeCapacity - 1)].load(std::memory_order_relaxed);
+    if (top == bottom) {
+        if (!deque.top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            job = nullptr;
+        deque.bottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return job;
+}
+
+JobSystem::Job *JobSystem::Steal(Deque &deque)
+{
+    int64_t top = deque.top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t bottom = deque.bottom.load(std::memory_order_acquire);
+    if (top >= bottom)
+        return nullptr;
+
+    // Losing the race to the owner or another thief is not worth a retry,
+    // there may be more work elsewhere
+    Job *job = deque.slots[top & (dequeCapacity - 1)].load(std::memory_order_relaxed);
+    if (!deque.top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return nullptr;
+    return job;
+}
+
+bool JobSystem::FindWork(int index, Task &task)
+{
+    // Own jobs newest first, they are the ones still in cache, then the
+    // oldest job of everyone else starting with the next thread over
+    Job *job = index >= 0 ? Pop(*deques[index]) : nullptr;
+    int dequeCount = (int) deques.size();
+    for (int i = 1; job == nullptr && i <= dequeCount; i++) {
+        int victim = (index + i + dequeCount) % dequeCount;
+        if (victim != index)
+            job = Steal(*deques[victim]);
+    }
+    if (job == nullptr)
+        return false;
+
+    task = job->task;
+    job->busy.store(false, std::memory_order_release);
+    return true;
+}
+
+bool JobSystem::AnyWork()
+{
+    for (const std::unique_ptr<Deque> &deque : deques)
+        if (deque->top.load(std::memory_order_acquire) < deque->bottom.load(std::memory_order_acquire))
+            return true;
+    return false;
+}
+
+void JobSystem::WakeWorker()
+{
+    // Pairs with the fence a worker puts between saying it sleeps and its
+    // last look at the deques; one side or the other sees the new job
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepingWorkers.load(std::memory_order_relaxed) == 0)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        wakeups++;
+    }
+    wake.notify_one();
+}
+
+void JobSystem::Submit(const Task &task)
+{
+    int index = Enter();
+    if (index >= 0 && Push(*deques[index], task))
+        WakeWorker();
+    else
+        Execute(index, task);
+    Leave(index);
+}
+
+void JobSystem::Execute(int index, Task task)
+{
+    // Keeps the lower half and queues the upper one until the range is
+    // down to its grain; halves that nobody steals come back through Pop()
+    while (index >= 0 && task.end - task.begin > task.grain) {
+        uint32_t middle = task.begin + (task.end - task.begin) / 2;
+        Task upper = task;
+        upper.begin = middle;
+        task.counter->pending.fetch_add(1, std::memory_order_relaxed);
+        if (!Push(*deques[index], upper)) {
+            task.counter->pending.fetch_sub(1, std::memory_order_relaxed);
+            break;
+        }
+        WakeWorker();
+        task.end = middle;
+    }
+
+    task.function(task.data, task.begin, task.end);
+    Finish(*task.counter);
+}
+
+void JobSystem::Finish(Counter &counter)
+{
+    // Everyone but the last job just counts down. The last one does it under
+    // the lock, so a job being parked on the counter either sees it at zero
+    // or gets started here
+    uint32_t pending = counter.pending.load(std::memory_order_relaxed);
+    while (pending > 1)
+        if (counter.pending.compare_exchange_weak(pending, pending - 1, std::memory_order_release, std::memory_order_relaxed))
+            return;
+
+    std::vector<Task> ready;
+    {
+        std::lock_guard<std::mutex> lock(counter.mutex);
+        if (counter.pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            ready.swap(counter.continuations);
+    }
+    for (const Task &task : ready)
+        Submit(task);
+}
+
+void JobSystem::WorkerLoop(int index)
+{
+    threadIndex = index;
+    int idle = 0;
+
+    while (!stopping.load(std::memory_order_relaxed)) {
+        Task task;
+        if (FindWork(index, task)) {
+            Execute(index, task);
+            idle = 0;
+            continue;
+        }
+        if (++idle < idleRounds) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        // Counted as sleeping before the last look, so whoever queues a
+        // job after it either is seen here or wakes us up
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        uint64_t seenWakeups = wakeups;
+        sleepingWorkers.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!AnyWork())
+            wake.wait(lock, [&seenWakeups] { return stopping.load(std::memory_order_relaxed) || wakeups != seenWakeups; });
+        sleepingWorkers.fetch_sub(1, std::memory_order_relaxed);
+        idle = 0;
+    }
+}
@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "GeometryStore.hpp"
+#include "MeshFile.hpp"
+#include "MeshImporter.hpp"
+#include "MeshOptimizer.hpp"
+#include "VertexFormat.hpp"
+#include "WorkerPool.hpp"
+
+// Converts an OBJ or PLY file into a MeshFile that Camera loads with --mesh.
+// MeshImporter reads the input, so every object or group in an OBJ becomes
+// a submesh, faces are split into triangle fans and vertex colors are kept.
+//
+//   ./meshconvert input.obj|ply output.glmesh [--vertex-format float|half|snorm16]
+//                 [--normalize] [--optimize]
+//
+// --normalize centers the model and scales it into the unit cube the
+// built-in meshes use, --optimize runs every submesh through MeshOptimizer.
+namespace MeshConvert {
+    typedef MeshImporter::Vertex Vertex;
+    typedef MeshImporter::Submesh Submesh;
+
+    static void Normalize(std::vector<Submesh> &submeshes);
+    static void Usage(const char *program);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+        MeshConvert::Usage(argv[0]);
+
+    const char *inputPath = argv[1];
+    const char *outputPath = argv[2];
+    VertexFormat::Layout layout = VertexFormat::MakeLayout(VertexFormat::PositionHalf, VertexFormat::NormalNone,
+                                                           VertexFormat::ColorUnorm8);
+    bool normalize = false;
+    bool optimize = false;
+
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--vertex-format") == 0 && i + 1 < argc && VertexFormat::ParseLayout(argv[i + 1], layout))
+            i++;
+        else if (strcmp(argv[i], "--normalize") == 0)
+            normalize = true;
+        else if (strcmp(argv[i], "--optimize") == 0)
+            optimize = true;
+        else
+            MeshConvert::Usage(argv[0]);
+    }
+
+    int workerCount = std::min((int) std::thread::hardware_concurrency() - 1, 7);
+    if (workerCount > 0)
+        WorkerPool::Start(workerCount);
+
+    std::vector<MeshConvert::Submesh> submeshes;
+    if (!MeshImporter::Import(inputPath, submeshes))
+        std::exit(-1);
+    if (normalize)
+        MeshConvert::Normalize(submeshes);
+
+    GeometryStore::Store store;
+    GeometryStore::Create(store, layout);
+    bool outOfRange = false;
+    for (MeshConvert::Submesh &submesh : submeshes) {
+        uint32_t vertexCount = (uint32_t) submesh.vertices.size();
+        if (optimize)
+            vertexCount = MeshOptimizer::Optimize(submesh.indices.data(), submesh.indices.size(), submesh.vertices.data(),
+                                                  vertexCount, sizeof(MeshConvert::Vertex), offsetof(MeshConvert::Vertex, position));
+
+        for (uint32_t i = 0; i < vertexCount; i++)
+            for (int c = 0; c < 3; c++)
+                outOfRange |= std::fabs(submesh.vertices[i].position[c]) > 1.0f;
+
+        VertexFormat::Source source = { &submesh.vertices[0].position, nullptr, &submesh.vertices[0].color, sizeof(MeshConvert::Vertex) };
+        GeometryStore::AddMesh(store, source, vertexCount, submesh.indices.data(), (GLuint) submesh.indices.size());
+    }
+
+    if (workerCount > 0)
+        WorkerPool::Stop();
+
+    if (outOfRange && layout.position == VertexFormat::PositionSnorm16)
+        std::cerr << "Warning: positions outside [-1, 1] are clamped by snorm16, try --normalize" << std::endl;
+
+    if (!MeshFile::Write(outputPath, store))
+        std::exit(-1);
+
+    std::cout << "Wrote " << outputPath << ": " << store.meshes.size() << " meshes, " << store.vertexCount
+              << " vertices in " << VertexFormat::Describe(layout) << ", " << store.indexCount << " "
+              << (GeometryStore::ChooseIndexType(store) == GL_UNSIGNED_SHORT ? 16 : 32) << "-bit indices" << std::endl;
+    return 0;
+}
+
+void MeshConvert::Normalize(std::vector<Submesh> &submeshes)
+{
+    // Centered on the bounding box, longest side one unit like the cube
+    glm::vec3 minimum(INFINITY), maximum(-INFINITY);
+    for (const Submesh &submesh : submeshes)
+        for (const Vertex &vertex : submesh.vertices) {
+            minimum = glm::min(minimum, vertex.position);
+            maximum = glm::max(maximum, vertex.position);
+        }
+
+    glm::vec3 center = (minimum + maximum) * 0.5f;
+    glm::vec3 extent = maximum - minimum;
+    float scale = 1.0f / std::max(std::max(extent.x, extent.y), std::max(extent.z, 1e-6f));
+    for (Submesh &submesh : submeshes)
+        for (Vertex &vertex : submesh.vertices)
+            vertex.position = (vertex.position - center) * scale;
+}
+
+void MeshConvert::Usage(const char *program)
+{
+    std::cerr << "Usage: " << program << " input.obj|ply output.glmesh [--vertex-format float|half|snorm16] [--normalize] [--optimize]" << std::endl;
+    std::exit(-1);
+}
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <GL/glew.h>
+
+#include "GeometryStore.hpp"
+#include "VertexFormat.hpp"
+
+// Binary container for a GeometryStore, already encoded the way the GPU
+// reads it. Loading is an mmap() and a few checks on the header; the
+// mapped vertex and index streams are handed to glBufferData() as they
+// are, so a large file costs page faults rather than parsing.
+//
+//   Header       128 bytes, version and vertex layout descriptor
+//   Vertices     vertexCount * stride bytes in the header's layout
+//   Indices      indexCount 16 or 32-bit indices, relative to their mesh
+//   Submeshes    submeshCount entries, one GeometryStore::Mesh each
+//
+// Every section starts on a 4096 byte boundary so each of them is its own
+// run of pages. Files are little endian, like every platform this runs on.
+namespace MeshFile {
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t headerSize;
+        uint8_t positionEncoding;
+        uint8_t normalEncoding;
+        uint8_t colorEncoding;
+        uint8_t indexSize;
+        uint32_t stride;
+        uint32_t positionOffset;
+        uint32_t normalOffset;
+        uint32_t colorOffset;
+        uint32_t vertexCount;
+        uint32_t indexCount;
+        uint32_t submeshCount;
+        uint64_t vertexDataOffset;
+        uint64_t indexDataOffset;
+        uint64_t submeshOffset;
+        uint64_t fileSize;
+        uint32_t reserved[12];
+    };
+
+    struct Submesh {
+        uint32_t firstIndex;
+        uint32_t indexCount;
+        int32_t baseVertex;
+        uint32_t vertexCount;
+    };
+
+    static_assert(sizeof(Header) == 128, "MeshFile::Header has to stay 128 bytes");
+    static_assert(sizeof(Submesh) == 16, "MeshFile::Submesh has to stay 16 bytes");
+
+    struct File {
+        const uint8_t *data;
+        size_t size;
+        const Header *header;
+    };
+
+    static bool Write(const std::string &path, const GeometryStore::Store &store);
+    static bool IsMeshFile(const std::string &path);
+    static bool Open(File &file, const std::string &path);
+    static const uint8_t *Vertices(const File &file);
+    static const void *Indices(const File &file);
+    static const Submesh *Submeshes(const File &file);
+    static void Upload(const File &file, GeometryStore::Store &store);
+    static void Close(File &file);
+}
+
+namespace MeshFile {
+    static const uint32_t formatVersion = 1;
+    static const uint64_t sectionAlignment = 4096;
+
+    static uint64_t AlignSection(uint64_t offset)
+    {
+        return (offset + sectionAlignment - 1) & ~(sectionAlignment - 1);
+    }
+
+    static bool WriteSection(FILE *stream, uint64_t offset, const void *data, size_t size)
+    {
+        return fseeko(stream, (off_t) offset, SEEK_SET) == 0 && (size == 0 || fwrite(data, size, 1, stream) == 1);
+    }
+
+    static bool Fail(File &file, const std::string &path, const char *reason)
+    {
+        std::cerr << "Failed to open mesh file: " << path << ", " << reason << std::endl;
+        Close(file);
+        return false;
+    }
+}
+
+bool MeshFile::Write(const std::string &path, const GeometryStore::Store &store)
+{
+    // Expects a store that has meshes added but was not uploaded yet, its
+    // indices are written in the type Upload() would have picked
+    GLenum indexType = GeometryStore::ChooseIndexType(store);
+    std::vector<uint16_t> shortIndices;
+    const void *indices = store.indices.data();
+    size_t indexSize = sizeof(GLuint);
+    if (indexType == GL_UNSIGNED_SHORT) {
+        shortIndices.assign(store.indices.begin(), store.indices.end());
+        indices = shortIndices.data();
+        indexSize = sizeof(uint16_t);
+    }
+
+    std::vector<Submesh> submeshes;
+    for (const GeometryStore::Mesh &mesh : store.meshes)
+        submeshes.push_back({ mesh.firstIndex, mesh.indexCount, mesh.baseVertex, mesh.vertexCount });
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "GLOWMESH", sizeof(header.magic));
+    header.version = formatVersion;
+    header.headerSize = sizeof(Header);
+    header.positionEncoding = (uint8_t) store.layout.position;
+    header.normalEncoding = (uint8_t) store.layout.normal;
+    header.colorEncoding = (uint8_t) store.layout.color;
+    header.indexSize = (uint8_t) indexSize;
+    header.stride = store.layout.stride;
+    header.positionOffset = store.layout.positionOffset;
+    header.normalOffset = store.layout.normalOffset;
+    header.colorOffset = store.layout.colorOffset;
+    header.vertexCount = store.vertexCount;
+    header.indexCount = store.indexCount;
+    header.submeshCount = (uint32_t) submeshes.size();
+    header.vertexDataOffset = AlignSection(sizeof(Header));
+    header.indexDataOffset = AlignSection(header.vertexDataOffset + store.vertices.size());
+    header.submeshOffset = AlignSection(header.indexDataOffset + (uint64_t) store.indexCount * indexSize);
+    header.fileSize = header.submeshOffset + submeshes.size() * sizeof(Submesh);
+
+    FILE *stream = fopen(path.c_str(), "wb");
+    if (stream == nullptr) {
+        std::cerr << "Failed to write mesh file: " << path << ", " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // Seeking over the padding leaves it as zeros
+    bool written = WriteSection(stream, 0, &header, sizeof(header))
+                && WriteSection(stream, header.vertexDataOffset, store.vertices.data(), store.vertices.size())
+                && WriteSection(stream, header.indexDataOffset, indices, (size_t) store.indexCount * indexSize)
+                && WriteSection(stream, header.submeshOffset, submeshes.data(), submeshes.size() * sizeof(Submesh));
+    written = fclose(stream) == 0 && written;
+
+    if (!written)
+        std::cerr << "Failed to write mesh file: " << path << std::endl;
+    return written;
+}
+
+bool MeshFile::IsMeshFile(const std::string &path)
+{
+    // Only looks at the magic, Open() checks everything else
+    char magic[8];
+    FILE *stream = fopen(path.c_str(), "rb");
+    bool isMeshFile = stream != nullptr && fread(magic, sizeof(magic), 1, stream) == 1 &&
+                      memcmp(magic, "GLOWMESH", sizeof(magic)) == 0;
+    if (stream != nullptr)
+        fclose(stream);
+    return isMeshFile;
+}
+
+bool MeshFile::Open(File &file, const std::string &path)
+{
+    file.data = nullptr;
+    file.size = 0;
+    file.header = nullptr;
+
+    int descriptor = open(path.c_str(), O_RDONLY);
+    if (descriptor < 0)
+        return Fail(file, path, strerror(errno));
+
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || (size_t) status.st_size < sizeof(Header)) {
+        close(descriptor);
+        return Fail(file, path, "too short for a header");
+    }
+
+    // The mapping keeps the file alive, the descriptor is not needed past
+    // this point
+    void *data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    int mapError = errno;
+    close(descriptor);
+    if (data == MAP_FAILED)
+        return Fail(file, path, strerror(mapError));
+
+    file.data = (const uint8_t *) data;
+    file.size = status.st_size;
+    file.header = (const Header *) data;
+
+    // Everything is read front to back exactly once by Upload()
+    madvise(data, file.size, MADV_SEQUENTIAL);
+
+    const Header &header = *file.header;
+    if (memcmp(header.magic, "GLOWMESH", sizeof(header.magic)) != 0)
+        return Fail(file, path, "not a mesh file");
+    if (header.version != formatVersion || header.headerSize != sizeof(Header))
+        return Fail(file, path, "unsupported version");
+
+    // The layout has to be one MakeLayout() would build, that is what
+    // SetAttributes() can describe to GL
+    if (header.positionEncoding > VertexFormat::PositionSnorm16 || header.normalEncoding > VertexFormat::NormalPacked ||
+        header.colorEncoding > VertexFormat::ColorUnorm8)
+        return Fail(file, path, "unknown vertex layout");
+    VertexFormat::Layout layout = VertexFormat::MakeLayout((VertexFormat::PositionEncoding) header.positionEncoding,
+                                                           (VertexFormat::NormalEncoding) header.normalEncoding,
+                                                           (VertexFormat::ColorEncoding) header.colorEncoding);
+    if (header.stride != (uint32_t) layout.stride || header.positionOffset != layout.positionOffset ||
+        header.normalOffset != layout.normalOffset || header.colorOffset != layout.colorOffset)
+        return Fail(file, path, "unknown vertex layout");
+    if (header.indexSize != sizeof(uint16_t) && header.indexSize != sizeof(uint32_t))
+        return Fail(file, path, "unknown index size");
+
+    // Sections in order, aligned and inside the file
+    uint64_t vertexEnd = header.vertexDataOffset + (uint64_t) header.vertexCount * header.stride;
+    uint64_t indexEnd = header.indexDataOffset + (uint64_t) header.indexCount * header.indexSize;
+    uint64_t submeshEnd = header.submeshOffset + (uint64_t) header.submeshCount * sizeof(Submesh);
+    if (header.fileSize != file.size || header.vertexDataOffset < sizeof(Header) ||
+        header.vertexDataOffset % sectionAlignment != 0 || header.indexDataOffset % sectionAlignment != 0 ||
+        header.submeshOffset % sectionAlignment != 0 || vertexEnd > header.indexDataOffset ||
+        indexEnd > header.submeshOffset || submeshEnd > file.size)
+        return Fail(file, path, "sections out of bounds");
+
+    // Index values are not checked, that would mean reading all of them.
+    // The ranges they are used in are
+    const Submesh *submeshes = Submeshes(file);
+    for (uint32_t i = 0; i < header.submeshCount; i++) {
+        const Submesh &submesh = submeshes[i];
+        if ((uint64_t) submesh.firstIndex + submesh.indexCount > header.indexCount || submesh.baseVertex < 0 ||
+            (uint64_t) submesh.baseVertex + submesh.vertexCount > header.vertexCount ||
+            (header.indexSize == sizeof(uint16_t) && submesh.vertexCount > 65536))
+            return Fail(file, path, "submesh out of bounds");
+    }
+
+    return true;
+}
+
+const uint8_t *MeshFile::Vertices(const File &file)
+{
+    return file.data + file.header->vertexDataOffset;
+}
+
+const void *MeshFile::Indices(const File &file)
+{
+    return file.data + file.header->indexDataOffset;
+}
+
+const MeshFile::Submesh *MeshFile::Submeshes(const File &file)
+{
+    return (const Submesh *) (file.data + file.header->submeshOffset);
+}
+
+void MeshFile::Upload(const File &file, GeometryStore::Store &store)
+{
+    // The store takes the file's layout whatever it was created with
+    const Header &header = *file.header;
+    store.layout = VertexFormat::MakeLayout((VertexFormat::PositionEncoding) header.positionEncoding,
+                                            (VertexFormat::NormalEncoding) header.normalEncoding,
+                                            (VertexFormat::ColorEncoding) header.colorEncoding);
+    store.indexType = header.indexSize == sizeof(uint16_t) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    store.indexSize = header.indexSize;
+    store.vertexCount = header.vertexCount;
+    store.indexCount = header.indexCount;
+
+    const Submesh *submeshes = Submeshes(file);
+    store.meshes.clear();
+    for (uint32_t i = 0; i < header.submeshCount; i++)
+        store.meshes.push_back({ submeshes[i].firstIndex, submeshes[i].indexCount, submeshes[i].baseVertex, submeshes[i].vertexCount });
+
+    GeometryStore::UploadEncoded(store, Vertices(file), Indices(file));
+}
+
+void MeshFile::Close(File &file)
+{
+    // GL has copied whatever it was given, the mapping can go right after
+    // Upload()
+    if (file.data != nullptr)
+        munmap((void *) file.data, file.size);
+    file.data = nullptr;
+    file.size = 0;
+    file.header = nullptr;
+}
@@ -0,0 +1,948 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glm/glm.hpp>
+
+#include "WorkerPool.hpp"
+
+// Imports Wavefront OBJ and PLY (ascii or binary little endian) meshes into
+// the vertex and index arrays the samples draw with, as fast as the cores
+// allow:
+//
+//  - the file is mapped, split into chunks that end on a newline, and the
+//    chunks are parsed in parallel on the WorkerPool with std::from_chars.
+//    A cheap first pass counts the lines (or OBJ positions) of every chunk
+//    so each chunk knows where its vertices go before it parses anything
+//  - identical vertices are merged through a lock-free hash table that
+//    every thread inserts into at once. The lowest index always wins, so
+//    the result does not depend on thread timing
+//  - every OBJ object or group becomes a submesh with its own vertices and
+//    indices relative to them, PLY files are a single submesh
+//
+// Only positions and vertex colors are kept. Vertices without a color are
+// colored by where they sit in the model's bounds.
+namespace MeshImporter {
+    // Same layout as the Vertex the samples draw with
+    struct Vertex {
+        glm::vec3 position;
+        glm::vec3 color;
+    };
+
+    struct Submesh {
+        std::string name;
+        std::vector<Vertex> vertices;
+        std::vector<uint32_t> indices;
+    };
+
+    static bool Import(const std::string &path, std::vector<Submesh> &submeshes);
+    static bool ImportObj(const char *data, size_t size, std::vector<Submesh> &submeshes, std::string &error);
+    static bool ImportPly(const char *data, size_t size, std::vector<Submesh> &submeshes, std::string &error);
+}
+
+namespace MeshImporter {
+    // Text is parsed in chunks of about this size, arrays in ranges of
+    // rangeSize elements
+    static const size_t chunkSize = 1 << 20;
+    static const size_t rangeSize = 1 << 16;
+
+    // Marks a vertex the file gave no color
+    static const float noColor = -1.0f;
+
+    // One newline aligned piece of text and what parsing it produced
+    struct Chunk {
+        const char *begin;
+        const char *end;
+        size_t firstLine;
+        size_t firstVertex;
+        std::vector<uint32_t> corners;
+        std::vector<std::pair<size_t, std::string>> groups;
+        std::string error;
+    };
+
+    // Everything in the file before vertices are merged: triangles index
+    // straight into vertices, and each group starts at a triangle
+    struct Soup {
+        std::vector<Vertex> vertices;
+        std::vector<uint32_t> corners;
+        std::vector<std::pair<size_t, std::string>> groups;
+    };
+
+    static void ParallelRanges(size_t count, const std::function<void(size_t begin, size_t end)> &function)
+    {
+        WorkerPool::ParallelFor((uint32_t) ((count + rangeSize - 1) / rangeSize), [&](uint32_t task) {
+            size_t begin = task * rangeSize;
+            function(begin, std::min(count, begin + rangeSize));
+        });
+    }
+
+    static bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    static const char *SkipSpaces(const char *p, const char *end)
+    {
+        while (p < end && IsSpace(*p))
+            p++;
+        return p;
+    }
+
+    static const char *LineEnd(const char *p, const char *end)
+    {
+        const char *newline = (const char *) memchr(p, '\n', end - p);
+        return newline != nullptr ? newline : end;
+    }
+
+    // from_chars accepts neither leading spaces nor a plus sign
+    static bool ParseFloat(const char *&p, const char *end, float &value)
+    {
+        p = SkipSpaces(p, end);
+        if (p < end && *p == '+')
+            p++;
+        std::from_chars_result result = std::from_chars(p, end, value);
+        if (result.ec != std::errc())
+            return false;
+        p = result.ptr;
+        return true;
+    }
+
+    static bool ParseInt(const char *&p, const char *end, long &value)
+    {
+        p = SkipSpaces(p, end);
+        if (p < end && *p == '+')
+            p++;
+        std::from_chars_result result = std::from_chars(p, end, value);
+        if (result.ec != std::errc())
+            return false;
+        p = result.ptr;
+        return true;
+    }
+
+    static std::vector<Chunk> SplitChunks(const char *begin, const char *end);
+    static bool FirstError(const std::vector<Chunk> &chunks, std::string &error);
+    static void GatherCorners(std::vector<Chunk> &chunks, Soup &soup);
+    static void FillColors(std::vector<Vertex> &vertices);
+    static void MergeVertices(const std::vector<Vertex> &vertices, std::vector<uint32_t> &canonical);
+    static void Compact(const Soup &soup, size_t firstTriangle, size_t endTriangle, Submesh &submesh);
+    static bool Finish(Soup &soup, const std::string &defaultName, std::vector<Submesh> &submeshes, std::string &error);
+    static void ParseObjChunk(Chunk &chunk, size_t vertexCount, Vertex *vertices);
+
+    // PLY property types, in the order of typeNames
+    enum PlyType { PlyInt8, PlyUint8, PlyInt16, PlyUint16, PlyInt32, PlyUint32, PlyFloat32, PlyFloat64, PlyInvalid };
+
+    struct PlyProperty {
+        std::string name;
+        PlyType type;
+        PlyType countType;
+        bool list;
+    };
+
+    struct PlyElement {
+        std::string name;
+        size_t count;
+        std::vector<PlyProperty> properties;
+    };
+
+    static PlyType ParsePlyType(const std::string &name);
+    static size_t PlyTypeSize(PlyType type);
+    static double ReadPlyValue(const uint8_t *p, PlyType type);
+    static float PlyColorScale(PlyType type);
+    static bool ImportPlyAscii(const char *begin, const char *end, const std::vector<PlyElement> &elements, Soup &soup,
+                               std::string &error);
+    static bool ImportPlyBinary(const uint8_t *begin, const uint8_t *end, const std::vector<PlyElement> &elements, Soup &soup,
+                                std::string &error);
+}
+
+bool MeshImporter::Import(const std::string &path, std::vector<Submesh> &submeshes)
+{
+    int descriptor = open(path.c_str(), O_RDONLY);
+    if (descriptor < 0) {
+        std::cerr << "Failed to open mesh file: " << path << ", " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || status.st_size == 0) {
+        close(descriptor);
+        std::cerr << "Failed to open mesh file: " << path << ", the file is empty" << std::endl;
+        return false;
+    }
+
+    void *data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    int mapError = errno;
+    close(descriptor);
+    if (data == MAP_FAILED) {
+        std::cerr << "Failed to open mesh file: " << path << ", " << strerror(mapError) << std::endl;
+        return false;
+    }
+
+    // All chunks are read at once, get the kernel reading ahead of them
+    madvise(data, status.st_size, MADV_WILLNEED);
+
+    const char *text = (const char *) data;
+    size_t size = status.st_size;
+    std::string error;
+    bool imported = size >= 4 && memcmp(text, "ply", 3) == 0 && (text[3] == '\n' || text[3] == '\r')
+                  ? ImportPly(text, size, submeshes, error)
+                  : ImportObj(text, size, submeshes, error);
+    munmap(data, size);
+
+    if (!imported)
+        std::cerr << "Failed to import mesh file: " << path << ", " << error << std::endl;
+    return imported;
+}
+
+bool MeshImporter::ImportObj(const char *data, size_t size, std::vector<Submesh> &submeshes, std::string &error)
+{
+    std::vector<Chunk> chunks = SplitChunks(data, data + size);
+
+    // Count the positions of every chunk first, faces can refer back to
+    // any of them by absolute or relative index
+    WorkerPool::ParallelFor((uint32_t) chunks.size(), [&](uint32_t index) {
+        Chunk &chunk = chunks[index];
+        size_t positions = 0;
+        for (const char *p = chunk.begin; p < chunk.end;) {
+            const char *line = SkipSpaces(p, chunk.end);
+            const char *lineEnd = LineEnd(line, chunk.end);
+            positions += lineEnd - line > 1 && line[0] == 'v' && IsSpace(line[1]);
+            p = lineEnd + 1;
+        }
+        chunk.firstVertex = positions;
+    });
+
+    size_t vertexCount = 0;
+    for (Chunk &chunk : chunks) {
+        size_t positions = chunk.firstVertex;
+        chunk.firstVertex = vertexCount;
+        vertexCount += positions;
+    }
+    if (vertexCount > UINT32_MAX) {
+        error = "more than 2^32 vertices";
+        return false;
+    }
+
+    Soup soup;
+    soup.vertices.resize(vertexCount);
+    WorkerPool::ParallelFor((uint32_t) chunks.size(), [&](uint32_t index) {
+        ParseObjChunk(chunks[index], vertexCount, soup.vertices.data());
+    });
+    if (FirstError(chunks, error))
+        return false;
+
+    GatherCorners(chunks, soup);
+    return Finish(soup, "default", submeshes, error);
+}
+
+bool MeshImporter::ImportPly(const char *data, size_t size, std::vector<Submesh> &submeshes, std::string &error)
+{
+    // The header is a few lines of text, read it on this thread
+    const char *end = data + size;
+    const char *p = data;
+    std::vector<PlyElement> elements;
+    std::string format;
+    bool headerEnded = false;
+
+    while (p < end && !headerEnded) {
+        const char *lineEnd = LineEnd(p, end);
+        std::vector<std::string> words;
+        for (const char *q = p; q < lineEnd;) {
+            q = SkipSpaces(q, lineEnd);
+            const char *wordEnd = q;
+            while (wordEnd < lineEnd && !IsSpace(*wordEnd))
+                wordEnd++;
+            if (wordEnd > q)
+                words.emplace_back(q, wordEnd);
+            q = wordEnd;
+        }
+        p = lineEnd + 1;
+
+        if (words.empty())
+            continue;
+        if (words[0] == "format" && words.size() >= 2) {
+            format = words[1];
+        } else if (words[0] == "element" && words.size() == 3) {
+            elements.push_back({ words[1], (size_t) strtoull(words[2].c_str(), nullptr, 10), {} });
+        } else if (words[0] == "property" && !elements.empty()) {
+            PlyProperty property;
+            if (words.size() == 5 && words[1] == "list")
+                property = { words[4], ParsePlyType(words[3]), ParsePlyType(words[2]), true };
+            else if (words.size() == 3)
+                property = { words[2], ParsePlyType(words[1]), PlyInvalid, false };
+            else
+                property = { "", PlyInvalid, PlyInvalid, false };
+            if (property.type == PlyInvalid || (property.list && property.countType == PlyInvalid)) {
+                error = "unknown type of property " + words.back();
+                return false;
+            }
+            elements.back().properties.push_back(property);
+        } else if (words[0] == "end_header") {
+            headerEnded = true;
+        }
+    }
+
+    if (!headerEnded) {
+        error = "the PLY header has no end_header";
+        return false;
+    }
+
+    Soup soup;
+    bool parsed;
+    if (format == "ascii") {
+        parsed = ImportPlyAscii(std::min(p, end), end, elements, soup, error);
+    } else if (format == "binary_little_endian") {
+        parsed = ImportPlyBinary((const uint8_t *) std::min(p, end), (const uint8_t *) end, elements, soup, error);
+    } else {
+        error = "unsupported PLY format: " + format;
+        return false;
+    }
+
+    return parsed && Finish(soup, "ply", submeshes, error);
+}
+
+std::vector<MeshImporter::Chunk> MeshImporter::SplitChunks(const char *begin, const char *end)
+{
+    // Every chunk but the last runs up to and including a newline
+    std::vector<Chunk> chunks;
+    while (begin < end) {
+        const char *chunkEnd = end;
+        if ((size_t) (end - begin) > chunkSize) {
+            const char *newline = (const char *) memchr(begin + chunkSize, '\n', end - begin - chunkSize);
+            chunkEnd = newline != nullptr ? newline + 1 : end;
+        }
+
+        Chunk chunk;
+        chunk.begin = begin;
+        chunk.end = chunkEnd;
+        chunk.firstLine = 0;
+        chunk.firstVertex = 0;
+        chunks.push_back(std::move(chunk));
+        begin = chunkEnd;
+    }
+    return chunks;
+}
+
+bool MeshImporter::FirstError(const std::vector<Chunk> &chunks, std::string &error)
+{
+    for (const Chunk &chunk : chunks) {
+        if (!chunk.error.empty()) {
+            error = chunk.error;
+            return true;
+        }
+    }
+    return false;
+}
+
+void MeshImporter::GatherCorners(std::vector<Chunk> &chunks, Soup &soup)
+{
+    // Chunk order is file order, group starts move from chunk triangles to
+    // file triangles on the way
+    std::vector<size_t> offsets(chunks.size() + 1, 0);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        for (std::pair<size_t, std::string> &group : chunks[i].groups)
+            soup.groups.emplace_back(offsets[i] / 3 + group.first, std::move(group.second));
+        offsets[i + 1] = offsets[i] + chunks[i].corners.size();
+    }
+
+    soup.corners.resize(offsets.back());
+    WorkerPool::ParallelFor((uint32_t) chunks.size(), [&](uint32_t i) {
+        std::copy(chunks[i].corners.begin(), chunks[i].corners.end(), soup.corners.begin() + offsets[i]);
+        chunks[i].corners = std::vector<uint32_t>();
+    });
+}
+
+void MeshImporter::FillColors(std::vector<Vertex> &vertices)
+{
+    size_t taskCount = (vertices.size() + rangeSize - 1) / rangeSize;
+    std::vector<glm::vec3> minimums(taskCount, glm::vec3(INFINITY));
+    std::vector<glm::vec3> maximums(taskCount, glm::vec3(-INFINITY));
+    ParallelRanges(vertices.size(), [&](size_t begin, size_t end) {
+        glm::vec3 minimum(INFINITY), maximum(-INFINITY);
+        for (size_t i = begin; i < end; i++) {
+            minimum = glm::min(minimum, vertices[i].position);
+            maximum = glm::max(maximum, vertices[i].position);
+        }
+        minimums[begin / rangeSize] = minimum;
+        maximums[begin / rangeSize] = maximum;
+    });
+
+    glm::vec3 minimum(INFINITY), maximum(-INFINITY);
+    for (size_t task = 0; task < taskCount; task++) {
+        minimum = glm::min(minimum, minimums[task]);
+        maximum = glm::max(maximum, maximums[task]);
+    }
+
+    glm::vec3 scale = glm::vec3(1.0f) / glm::max(maximum - minimum, glm::vec3(1e-6f));
+    ParallelRanges(vertices.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            if (vertices[i].color.x == noColor)
+                vertices[i].color = (vertices[i].position - minimum) * scale;
+    });
+}
+
+void MeshImporter::MergeVertices(const std::vector<Vertex> &vertices, std::vector<uint32_t> &canonical)
+{
+    // Open addressing with linear probing. A slot holds the index + 1 of
+    // the lowest vertex with its value, 0 while empty. Slots only ever go
+    // from empty to a vertex, and then to an equal vertex with a lower
+    // index, so equal vertices always meet in the same slot
+    size_t slotCount = 64;
+    while (slotCount < vertices.size() * 2)
+        slotCount *= 2;
+    size_t mask = slotCount - 1;
+    std::vector<std::atomic<uint32_t>> slots(slotCount);
+
+    auto hash = [&vertices](uint32_t vertex) {
+        uint32_t words[6];
+        memcpy(words, &vertices[vertex], sizeof(words));
+        uint64_t hash = 0;
+        for (uint32_t word : words)
+            hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+        return (size_t) (hash ^ hash >> 29);
+    };
+    auto equal = [&vertices](uint32_t a, uint32_t b) {
+        return memcmp(&vertices[a], &vertices[b], sizeof(Vertex)) == 0;
+    };
+
+    ParallelRanges(vertices.size(), [&](size_t begin, size_t end) {
+        for (uint32_t vertex = (uint32_t) begin; vertex < end; vertex++) {
+            size_t slot = hash(vertex) & mask;
+            uint32_t current = slots[slot].load(std::memory_order_acquire);
+            while (true) {
+                if (current == 0) {
+                    if (slots[slot].compare_exchange_weak(current, vertex + 1, std::memory_order_acq_rel))
+                        break;
+                } else if (equal(current - 1, vertex)) {
+                    if (current - 1 <= vertex ||
+                        slots[slot].compare_exchange_weak(current, vertex + 1, std::memory_order_acq_rel))
+                        break;
+                } else {
+                    slot = (slot + 1) & mask;
+                    current = slots[slot].load(std::memory_order_acquire);
+                }
+            }
+        }
+    });
+
+    // Every insert is done, each vertex looks up the winner of its slot
+    canonical.resize(vertices.size());
+    ParallelRanges(vertices.size(), [&](size_t begin, size_t end) {
+        for (uint32_t vertex = (uint32_t) begin; vertex < end; vertex++) {
+            size_t slot = hash(vertex) & mask;
+            uint32_t current;
+            while (!equal((current = slots[slot].load(std::memory_order_relaxed)) - 1, vertex))
+                slot = (slot + 1) & mask;
+            canonical[vertex] = current - 1;
+        }
+    });
+}
+
+void MeshImporter::Compact(const Soup &soup, size_t firstTriangle, size_t endTriangle, Submesh &submesh)
+{
+    // The vertices a submesh uses are nearly always a narrow range of the
+    // file's, so used vertices are marked in an array over just that range
+    const uint32_t *corners = soup.corners.data() + firstTriangle * 3;
+    size_t cornerCount = (endTriangle - firstTriangle) * 3;
+
+    size_t taskCount = (cornerCount + rangeSize - 1) / rangeSize;
+    std::vector<uint32_t> lows(taskCount, UINT32_MAX), highs(taskCount, 0);
+    ParallelRanges(cornerCount, [&](size_t begin, size_t end) {
+        uint32_t low = UINT32_MAX, high = 0;
+        for (size_t i = begin; i < end; i++) {
+            low = std::min(low, corners[i]);
+            high = std::max(high, corners[i]);
+        }
+        lows[begin / rangeSize] = low;
+        highs[begin / rangeSize] = high;
+    });
+    uint32_t low = *std::min_element(lows.begin(), lows.end());
+    uint32_t high = *std::max_element(highs.begin(), highs.end());
+
+    // Marked with 1, then renumbered to the new index + 1
+    std::vector<std::atomic<uint32_t>> remap((size_t) high - low + 1);
+    ParallelRanges(cornerCount, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            remap[corners[i] - low].store(1, std::memory_order_relaxed);
+    });
+
+    uint32_t vertexCount = 0;
+    for (std::atomic<uint32_t> &entry : remap)
+        if (entry.load(std::memory_order_relaxed) != 0)
+            entry.store(++vertexCount, std::memory_order_relaxed);
+
+    submesh.vertices.resize(vertexCount);
+    ParallelRanges(remap.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            uint32_t index = remap[i].load(std::memory_order_relaxed);
+            if (index != 0)
+                submesh.vertices[index - 1] = soup.vertices[low + i];
+        }
+    });
+
+    submesh.indices.resize(cornerCount);
+    ParallelRanges(cornerCount, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            submesh.indices[i] = remap[corners[i] - low].load(std::memory_order_relaxed) - 1;
+    });
+}
+
+bool MeshImporter::Finish(Soup &soup, const std::string &defaultName, std::vector<Submesh> &submeshes, std::string &error)
+{
+    FillColors(soup.vertices);
+
+    // Triangles point at the first of each run of equal vertices, so the
+    // others are never marked as used by Compact()
+    std::vector<uint32_t> canonical;
+    MergeVertices(soup.vertices, canonical);
+    ParallelRanges(soup.corners.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            soup.corners[i] = canonical[soup.corners[i]];
+    });
+
+    size_t triangleCount = soup.corners.size() / 3;
+    if (soup.groups.empty() || soup.groups[0].first > 0)
+        soup.groups.emplace(soup.groups.begin(), 0, defaultName);
+
+    submeshes.clear();
+    for (size_t i = 0; i < soup.groups.size(); i++) {
+        size_t firstTriangle = soup.groups[i].first;
+        size_t endTriangle = i + 1 < soup.groups.size() ? soup.groups[i + 1].first : triangleCount;
+        if (endTriangle == firstTriangle)
+            continue;
+
+        submeshes.emplace_back();
+        submeshes.back().name = soup.groups[i].second;
+        Compact(soup, firstTriangle, endTriangle, submeshes.back());
+    }
+
+    if (submeshes.empty()) {
+        error = "no triangles";
+        return false;
+    }
+    return true;
+}
+
+void MeshImporter::ParseObjChunk(Chunk &chunk, size_t vertexCount, Vertex *vertices)
+{
+    size_t vertex = chunk.firstVertex;
+    std::vector<uint32_t> face;
+
+    for (const char *p = chunk.begin; p < chunk.end && chunk.error.empty();) {
+        const char *line = SkipSpaces(p, chunk.end);
+        const char *lineEnd = LineEnd(line, chunk.end);
+        p = lineEnd + 1;
+        if (lineEnd - line < 2 || !IsSpace(line[1]))
+            continue;
+
+        const char *cursor = line + 1;
+        if (line[0] == 'v') {
+            // "v x y z" with an optional "r g b" after it
+            Vertex &output = vertices[vertex++];
+            if (!ParseFloat(cursor, lineEnd, output.position.x) || !ParseFloat(cursor, lineEnd, output.position.y) ||
+                !ParseFloat(cursor, lineEnd, output.position.z)) {
+                chunk.error = "bad position: " + std::string(line, lineEnd);
+                break;
+            }
+            if (!ParseFloat(cursor, lineEnd, output.color.x) || !ParseFloat(cursor, lineEnd, output.color.y) ||
+                !ParseFloat(cursor, lineEnd, output.color.z))
+                output.color = glm::vec3(noColor);
+        } else if (line[0] == 'f') {
+            // "f 1 2 3", "f 1/1 2/2 3/3", "f 1//1 ..." or "f 1/1/1 ...", only
+            // the position index matters. Negative indices count back from
+            // the last position before the face
+            face.clear();
+            while (SkipSpaces(cursor, lineEnd) < lineEnd) {
+                long index;
+                if (!ParseInt(cursor, lineEnd, index)) {
+                    chunk.error = "bad face: " + std::string(line, lineEnd);
+                    break;
+                }
+                while (cursor < lineEnd && !IsSpace(*cursor))
+                    cursor++;
+
+                long position = index < 0 ? (long) vertex + index : index - 1;
+                if (position < 0 || (size_t) position >= vertexCount) {
+                    chunk.error = "index out of range: " + std::string(line, lineEnd);
+                    break;
+                }
+                face.push_back((uint32_t) position);
+            }
+
+            for (size_t i = 2; i < face.size(); i++)
+                chunk.corners.insert(chunk.corners.end(), { face[0], face[i - 1], face[i] });
+        } else if (line[0] == 'o' || line[0] == 'g') {
+            const char *nameEnd = lineEnd;
+            while (nameEnd > cursor && IsSpace(nameEnd[-1]))
+                nameEnd--;
+            cursor = SkipSpaces(cursor, nameEnd);
+            chunk.groups.emplace_back(chunk.corners.size() / 3, std::string(cursor, nameEnd));
+        }
+    }
+}
+
+MeshImporter::PlyType MeshImporter::ParsePlyType(const std::string &name)
+{
+    static const char *typeNames[][2] = {
+            { "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+            { "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" }
+    };
+    for (int type = 0; type < PlyInvalid; type++)
+        if (name == typeNames[type][0] || name == typeNames[type][1])
+            return (PlyType) type;
+    return PlyInvalid;
+}
+
+size_t MeshImporter::PlyTypeSize(PlyType type)
+{
+    static const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+    return sizes[type];
+}
+
+double MeshImporter::ReadPlyValue(const uint8_t *p, PlyType type)
+{
+    switch (type) {
+    case PlyInt8: { int8_t value; memcpy(&value, p, sizeof(value)); return value; }
+    case PlyUint8: { uint8_t value; memcpy(&value, p, sizeof(value)); return value; }
+    case PlyInt16: { int16_t value; memcpy(&value, p, sizeof(value)); return value; }
+    case PlyUint16: { uint16_t value; memcpy(&value, p, sizeof(value)); return value; }
+    case PlyInt32: { int32_t value; memcpy(&value, p, sizeof(value)); return value; }
+    case PlyUint32: { uint32_t value; memcpy(&value, p, sizeof(value)); return value; }
+    case PlyFloat32: { float value; memcpy(&value, p, sizeof(value)); return value; }
+    case PlyFloat64: { double value; memcpy(&value, p, sizeof(value)); return value; }
+    default: return 0.0;
+    }
+}
+
+float MeshImporter::PlyColorScale(PlyType type)
+{
+    // Integer colors use their whole range, float colors are already [0, 1]
+    switch (type) {
+    case PlyUint8: return 1.0f / 255.0f;
+    case PlyUint16: return 1.0f / 65535.0f;
+    case PlyFloat32: case PlyFloat64: return 1.0f;
+    default: return 1.0f / 255.0f;
+    }
+}
+
+namespace MeshImporter {
+    // Where the vertex element keeps the attributes we use, -1 if it has
+    // none
+    struct PlyVertexLayout {
+        int position[3];
+        int color[3];
+    };
+
+    static bool FindPlyVertexLayout(const PlyElement &element, PlyVertexLayout &layout, std::string &error)
+    {
+        static const char *positionNames[] = { "x", "y", "z" };
+        static const char *colorNames[][2] = { { "red", "r" }, { "green", "g" }, { "blue", "b" } };
+        for (int c = 0; c < 3; c++) {
+            layout.position[c] = -1;
+            layout.color[c] = -1;
+            for (size_t i = 0; i < element.properties.size(); i++) {
+                const std::string &name = element.properties[i].name;
+                if (name == positionNames[c])
+                    layout.position[c] = (int) i;
+                if (name == colorNames[c][0] || name == colorNames[c][1])
+                    layout.color[c] = (int) i;
+            }
+            if (layout.position[c] < 0) {
+                error = std::string("vertices have no ") + positionNames[c] + " property";
+                return false;
+            }
+        }
+        if (layout.color[0] < 0 || layout.color[1] < 0 || layout.color[2] < 0)
+            layout.color[0] = layout.color[1] = layout.color[2] = -1;
+        return true;
+    }
+
+    static bool IsPlyFaces(const PlyElement &element)
+    {
+        return element.name == "face" && !element.properties.empty() && element.properties[0].list &&
+               (element.properties[0].name == "vertex_indices" || element.properties[0].name == "vertex_index");
+    }
+}
+
+bool MeshImporter::ImportPlyAscii(const char *begin, const char *end, const std::vector<PlyElement> &elements, Soup &soup,
+                                  std::string &error)
+{
+    // One line per element. Counting the lines of every chunk first tells
+    // each chunk which element and which vertex or face it starts at
+    std::vector<Chunk> chunks = SplitChunks(begin, end);
+    WorkerPool::ParallelFor((uint32_t) chunks.size(), [&](uint32_t index) {
+        Chunk &chunk = chunks[index];
+        size_t lines = 0;
+        for (const char *p = chunk.begin; p < chunk.end; p = LineEnd(p, chunk.end) + 1)
+            lines++;
+        chunk.firstLine = lines;
+    });
+
+    size_t lineCount = 0;
+    for (Chunk &chunk : chunks) {
+        size_t lines = chunk.firstLine;
+        chunk.firstLine = lineCount;
+        lineCount += lines;
+    }
+
+    // Line ranges of the two elements we read
+    size_t firstLine = 0, vertexLine = SIZE_MAX, faceLine = SIZE_MAX;
+    const PlyElement *vertexElement = nullptr, *faceElement = nullptr;
+    for (const PlyElement &element : elements) {
+        if (element.name == "vertex" && vertexElement == nullptr) {
+            vertexElement = &element;
+            vertexLine = firstLine;
+        } else if (IsPlyFaces(element) && faceElement == nullptr) {
+            faceElement = &element;
+            faceLine = firstLine;
+        }
+        firstLine += element.count;
+    }
+
+    PlyVertexLayout layout;
+    if (vertexElement == nullptr || faceElement == nullptr) {
+        error = "no vertex or face element";
+        return false;
+    }
+    if (!FindPlyVertexLayout(*vertexElement, layout, error))
+        return false;
+    if (lineCount < firstLine) {
+        error = "fewer lines than the header promises";
+        return false;
+    }
+
+    size_t vertexCount = vertexElement->count;
+    soup.vertices.resize(vertexCount);
+    float colorScale[3];
+    for (int c = 0; c < 3; c++)
+        colorScale[c] = layout.color[c] >= 0 ? PlyColorScale(vertexElement->properties[layout.color[c]].type) : 0.0f;
+
+    WorkerPool::ParallelFor((uint32_t) chunks.size(), [&](uint32_t index) {
+        Chunk &chunk = chunks[index];
+        std::vector<float> values;
+        std::vector<uint32_t> face;
+        size_t line = chunk.firstLine;
+
+        for (const char *p = chunk.begin; p < chunk.end && chunk.error.empty(); line++) {
+            const char *lineEnd = LineEnd(p, chunk.end);
+            const char *text = p;
+            const char *cursor = p;
+            p = lineEnd + 1;
+
+            if (line - vertexLine < vertexCount) {
+                // Every scalar property in order, lists are skipped over
+                values.clear();
+                for (const PlyProperty &property : vertexElement->properties) {
+                    float value = 0.0f;
+                    long count = 0;
+                    bool parsed = property.list ? ParseInt(cursor, lineEnd, count) : ParseFloat(cursor, lineEnd, value);
+                    for (long i = 0; i < count && parsed; i++)
+                        parsed = ParseFloat(cursor, lineEnd, value);
+                    if (!parsed) {
+                        chunk.error = "bad vertex: " + std::string(text, lineEnd);
+                        break;
+                    }
+                    values.push_back(value);
+                }
+                if (!chunk.error.empty())
+                    break;
+
+                Vertex &vertex = soup.vertices[line - vertexLine];
+                vertex.position = glm::vec3(values[layout.position[0]], values[layout.position[1]], values[layout.position[2]]);
+                if (layout.color[0] >= 0)
+                    vertex.color = glm::vec3(values[layout.color[0]] * colorScale[0], values[layout.color[1]] * colorScale[1],
+                                             values[layout.color[2]] * colorScale[2]);
+                else
+                    vertex.color = glm::vec3(noColor);
+            } else if (line - faceLine < faceElement->count) {
+                // The index list comes first, anything after it is ignored
+                long count;
+                face.clear();
+                if (!ParseInt(cursor, lineEnd, count))
+                    count = -1;
+                for (long i = 0; i < count; i++) {
+                    long index;
+                    if (!ParseInt(cursor, lineEnd, index) || index < 0 || (size_t) index >= vertexCount) {
+                        count = -1;
+                        break;
+                    }
+                    face.push_back((uint32_t) index);
+                }
+                if (count < 0) {
+                    chunk.error = "bad face: " + std::string(text, lineEnd);
+                    break;
+                }
+
+                for (size_t i = 2; i < face.size(); i++)
+                    chunk.corners.insert(chunk.corners.end(), { face[0], face[i - 1], face[i] });
+            }
+        }
+    });
+    if (FirstError(chunks, error))
+        return false;
+
+    GatherCorners(chunks, soup);
+    return true;
+}
+
+bool MeshImporter::ImportPlyBinary(const uint8_t *begin, const uint8_t *end, const std::vector<PlyElement> &elements, Soup &soup,
+                                   std::string &error)
+{
+    // Elements are back to back. Ones made of scalars have a fixed size,
+    // ones with lists have to be walked record by record
+    const uint8_t *p = begin;
+    auto skipRecord = [&p, end](const PlyElement &element) {
+        for (const PlyProperty &property : element.properties) {
+            size_t count = 1;
+            if (property.list) {
+                if (p + PlyTypeSize(property.countType) > end)
+                    return false;
+                count = (size_t) ReadPlyValue(p, property.countType);
+                p += PlyTypeSize(property.countType);
+            }
+            if ((size_t) (end - p) < count * PlyTypeSize(property.type))
+                return false;
+            p += count * PlyTypeSize(property.type);
+        }
+        return true;
+    };
+
+    bool haveVertices = false, haveFaces = false;
+    for (const PlyElement &element : elements) {
+        if (element.name == "vertex" && !haveVertices) {
+            PlyVertexLayout layout;
+            if (!FindPlyVertexLayout(element, layout, error))
+                return false;
+
+            size_t stride = 0;
+            std::vector<size_t> offsets;
+            for (const PlyProperty &property : element.properties) {
+                if (property.list) {
+                    error = "list property in the vertex element: " + property.name;
+                    return false;
+                }
+                offsets.push_back(stride);
+                stride += PlyTypeSize(property.type);
+            }
+            if ((size_t) (end - p) / stride < element.count) {
+                error = "the file ends inside the vertices";
+                return false;
+            }
+
+            // Fixed size records, every range of vertices can go on its own
+            const std::vector<PlyProperty> &properties = element.properties;
+            const uint8_t *records = p;
+            soup.vertices.resize(element.count);
+            ParallelRanges(element.count, [&](size_t first, size_t last) {
+                for (size_t i = first; i < last; i++) {
+                    const uint8_t *record = records + i * stride;
+                    Vertex &vertex = soup.vertices[i];
+                    for (int c = 0; c < 3; c++) {
+                        int property = layout.position[c];
+                        vertex.position[c] = (float) ReadPlyValue(record + offsets[property], properties[property].type);
+                    }
+                    for (int c = 0; c < 3; c++) {
+                        int property = layout.color[c];
+                        vertex.color[c] = property >= 0 ? (float) ReadPlyValue(record + offsets[property], properties[property].type) *
+                                                          PlyColorScale(properties[property].type)
+                                                        : noColor;
+                    }
+                }
+            });
+            p += element.count * stride;
+            haveVertices = true;
+        } else if (IsPlyFaces(element) && !haveFaces && haveVertices) {
+            const PlyProperty &list = element.properties[0];
+            size_t countSize = PlyTypeSize(list.countType), indexSize = PlyTypeSize(list.type);
+            size_t vertexCount = soup.vertices.size();
+            std::atomic<bool> invalid{false};
+
+            // Meshes of nothing but triangles have fixed size records too.
+            // If every count in the file says 3 at the offsets that implies,
+            // that is what it is, and the faces are read in parallel
+            size_t triangleStride = countSize + 3 * indexSize;
+            bool triangles = element.properties.size() == 1 && (size_t) (end - p) / triangleStride >= element.count;
+            if (triangles) {
+                std::atomic<bool> notTriangles{false};
+                const uint8_t *records = p;
+                soup.corners.resize(element.count * 3);
+                ParallelRanges(element.count, [&](size_t first, size_t last) {
+                    for (size_t i = first; i < last && !notTriangles.load(std::memory_order_relaxed); i++) {
+                        const uint8_t *record = records + i * triangleStride;
+                        if (ReadPlyValue(record, list.countType) != 3.0) {
+                            notTriangles = true;
+                            break;
+                        }
+                        for (int c = 0; c < 3; c++) {
+                            double index = ReadPlyValue(record + countSize + c * indexSize, list.type);
+                            if (index < 0.0 || index >= (double) vertexCount)
+                                invalid = true;
+                            soup.corners[i * 3 + c] = (uint32_t) index;
+                        }
+                    }
+                });
+                triangles = !notTriangles;
+                if (triangles)
+                    p += element.count * triangleStride;
+            }
+
+            if (!triangles) {
+                invalid = false;
+                soup.corners.clear();
+                std::vector<uint32_t> face;
+                for (size_t i = 0; i < element.count && !invalid; i++) {
+                    const uint8_t *record = p;
+                    if (!skipRecord(element)) {
+                        error = "the file ends inside the faces";
+                        return false;
+                    }
+
+                    size_t count = (size_t) ReadPlyValue(record, list.countType);
+                    face.clear();
+                    for (size_t c = 0; c < count; c++) {
+                        double index = ReadPlyValue(record + countSize + c * indexSize, list.type);
+                        if (index < 0.0 || index >= (double) vertexCount)
+                            invalid = true;
+                        face.push_back((uint32_t) index);
+                    }
+                    for (size_t c = 2; c < face.size(); c++)
+                        soup.corners.insert(soup.corners.end(), { face[0], face[c - 1], face[c] });
+                }
+            }
+
+            if (invalid) {
+                error = "face index out of range";
+                return false;
+            }
+            haveFaces = true;
+        } else {
+            for (size_t i = 0; i < element.count; i++) {
+                if (!skipRecord(element)) {
+                    error = "the file ends inside element " + element.name;
+                    return false;
+                }
+            }
+        }
+    }
+
+    if (!haveVertices || !haveFaces) {
+        error = "no vertex or face element";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,519 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "WorkerPool.hpp"
+
+// Reorders indexed triangle meshes for the three things the GPU pays for
+// when drawing them, meant to run once at load time or offline:
+//
+//  - OptimizeVertexCache() reorders triangles with Tipsify (Sander, Nehab
+//    and Barczak 2007) so recently transformed vertices are reused from the
+//    post-transform cache. Large meshes are first sorted along a Morton
+//    curve through the triangle centers and then cut into chunks, so every
+//    chunk is a compact patch of the surface, and the chunks are optimized
+//    in parallel on the WorkerPool
+//  - OptimizeOverdraw() then cuts that order into clusters that keep most
+//    of the cache efficiency and sorts the clusters so the ones facing
+//    away from the mesh center, which tend to occlude the others, go first.
+//    Facing is taken from counter-clockwise winding
+//  - OptimizeVertexFetch() finally renumbers and reorders the vertices in
+//    the order the indices first use them, so vertex fetch walks memory
+//    forward
+//
+// Optimize() runs all three in that order. AnalyzeVertexCache() and
+// AnalyzeOverdraw() measure the result: average
+// cache misses per triangle (ACMR) and per vertex (ATVR, 1.0 is perfect)
+// on a FIFO cache, and how many times each covered pixel gets shaded when
+// the mesh is rasterized from the six axis directions.
+namespace MeshOptimizer {
+    struct VertexCacheStats {
+        float acmr;
+        float atvr;
+    };
+
+    struct OverdrawStats {
+        uint64_t coveredPixels;
+        uint64_t shadedPixels;
+        float overdraw;
+    };
+
+    // Positions are read as three floats every positionStride bytes
+    struct Positions {
+        const float *data;
+        size_t stride;
+    };
+
+    static const uint32_t defaultCacheSize = 16;
+
+    static VertexCacheStats AnalyzeVertexCache(const uint32_t *indices, size_t indexCount, uint32_t vertexCount,
+                                               uint32_t cacheSize = defaultCacheSize);
+    static OverdrawStats AnalyzeOverdraw(const uint32_t *indices, size_t indexCount, const Positions &positions);
+    static void OptimizeVertexCache(uint32_t *indices, size_t indexCount, const Positions &positions,
+                                    std::vector<uint32_t> *clusters = nullptr, uint32_t cacheSize = defaultCacheSize);
+    static void OptimizeOverdraw(uint32_t *indices, size_t indexCount, const Positions &positions, uint32_t vertexCount,
+                                 const std::vector<uint32_t> &clusters, float threshold = 1.05f,
+                                 uint32_t cacheSize = defaultCacheSize);
+    static uint32_t OptimizeVertexFetch(uint32_t *indices, size_t indexCount, void *vertices, uint32_t vertexCount, size_t vertexSize);
+    static uint32_t Optimize(uint32_t *indices, size_t indexCount, void *vertices, uint32_t vertexCount, size_t vertexSize,
+                             size_t positionOffset = 0);
+}
+
+namespace MeshOptimizer {
+    // Tipsify loses a little at every chunk border, at this size that is
+    // well under a percent of ACMR
+    static const size_t chunkTriangles = 1 << 16;
+
+    // Resolution of each of the six views AnalyzeOverdraw() rasterizes
+    static const int overdrawGridSize = 256;
+
+    static glm::vec3 Position(const Positions &positions, uint32_t vertex)
+    {
+        const float *p = (const float *) ((const uint8_t *) positions.data + vertex * positions.stride);
+        return glm::vec3(p[0], p[1], p[2]);
+    }
+
+    // Counts cache misses of triangles [begin, end) on a FIFO cache.
+    // cacheTime is shared between calls, time is where the clock stands
+    static uint32_t SimulateCache(const uint32_t *indices, size_t begin, size_t end, uint32_t cacheSize,
+                                  std::vector<uint32_t> &cacheTime, uint32_t &time)
+    {
+        uint32_t misses = 0;
+        for (size_t i = begin * 3; i < end * 3; i++) {
+            uint32_t vertex = indices[i];
+            if (time - cacheTime[vertex] > cacheSize) {
+                cacheTime[vertex] = time++;
+                misses++;
+            }
+        }
+        return misses;
+    }
+
+    // Spreads the low 10 bits of value out to every third bit
+    static uint32_t SpreadBits(uint32_t value)
+    {
+        value &= 0x3ff;
+        value = (value | value << 16) & 0x030000ff;
+        value = (value | value << 8) & 0x0300f00f;
+        value = (value | value << 4) & 0x030c30c3;
+        value = (value | value << 2) & 0x09249249;
+        return value;
+    }
+
+    static void SortSpatially(uint32_t *indices, size_t indexCount, const Positions &positions);
+    static void Tipsify(const uint32_t *indices, size_t triangleCount, uint32_t vertexCount, uint32_t cacheSize,
+                        uint32_t *output, std::vector<uint32_t> &clusters);
+    static void RasterizeOverdraw(const uint32_t *indices, size_t indexCount, const Positions &positions,
+                                  const glm::vec3 &boundsMin, const glm::vec3 &boundsMax, int view,
+                                  uint64_t *coveredPixels, uint64_t *shadedPixels);
+}
+
+MeshOptimizer::VertexCacheStats MeshOptimizer::AnalyzeVertexCache(const uint32_t *indices, size_t indexCount, uint32_t vertexCount,
+                                                                  uint32_t cacheSize)
+{
+    std::vector<uint32_t> cacheTime(vertexCount, 0);
+    uint32_t time = cacheSize + 1;
+    uint32_t misses = SimulateCache(indices, 0, indexCount / 3, cacheSize, cacheTime, time);
+
+    // Vertices nothing refers to can't be missed, they don't count
+    uint32_t usedVertices = 0;
+    for (uint32_t vertex = 0; vertex < vertexCount; vertex++)
+        usedVertices += cacheTime[vertex] != 0;
+
+    VertexCacheStats stats;
+    stats.acmr = indexCount > 0 ? misses / (indexCount / 3.0f) : 0.0f;
+    stats.atvr = usedVertices > 0 ? misses / (float) usedVertices : 0.0f;
+    return stats;
+}
+
+MeshOptimizer::OverdrawStats MeshOptimizer::AnalyzeOverdraw(const uint32_t *indices, size_t indexCount, const Positions &positions)
+{
+    glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+    for (size_t i = 0; i < indexCount; i++) {
+        glm::vec3 p = Position(positions, indices[i]);
+        boundsMin = glm::min(boundsMin, p);
+        boundsMax = glm::max(boundsMax, p);
+    }
+
+    // One view per task, each with its own depth buffer
+    uint64_t covered[6], shaded[6];
+    WorkerPool::ParallelFor(6, [&](uint32_t view) {
+        RasterizeOverdraw(indices, indexCount, positions, boundsMin, boundsMax, view, &covered[view], &shaded[view]);
+    });
+
+    OverdrawStats stats = { 0, 0, 0.0f };
+    for (int view = 0; view < 6; view++) {
+        stats.coveredPixels += covered[view];
+        stats.shadedPixels += shaded[view];
+    }
+    stats.overdraw = stats.coveredPixels > 0 ? stats.shadedPixels / (float) stats.coveredPixels : 0.0f;
+    return stats;
+}
+
+void MeshOptimizer::OptimizeVertexCache(uint32_t *indices, size_t indexCount, const Positions &positions,
+                                        std::vector<uint32_t> *clusters, uint32_t cacheSize)
+{
+    size_t triangleCount = indexCount / 3;
+    uint32_t chunkCount = (uint32_t) ((triangleCount + chunkTriangles - 1) / chunkTriangles);
+
+    // Whatever order the triangles came in, each chunk should hold
+    // neighbours, otherwise there is nothing for the cache to reuse
+    if (chunkCount > 1)
+        SortSpatially(indices, indexCount, positions);
+    std::vector<std::vector<uint32_t>> chunkClusters(chunkCount);
+
+    WorkerPool::ParallelFor(chunkCount, [&](uint32_t chunk) {
+        size_t begin = chunk * chunkTriangles;
+        size_t end = std::min(begin + chunkTriangles, triangleCount);
+        uint32_t *chunkIndices = indices + begin * 3;
+        size_t chunkIndexCount = (end - begin) * 3;
+
+        // Renumber the chunk's vertices densely, so its adjacency doesn't
+        // scale with the whole mesh
+        std::vector<uint32_t> vertices(chunkIndices, chunkIndices + chunkIndexCount);
+        std::sort(vertices.begin(), vertices.end());
+        vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+
+        std::vector<uint32_t> local(chunkIndexCount);
+        for (size_t i = 0; i < chunkIndexCount; i++)
+            local[i] = (uint32_t) (std::lower_bound(vertices.begin(), vertices.end(), chunkIndices[i]) - vertices.begin());
+
+        std::vector<uint32_t> optimized(chunkIndexCount);
+        Tipsify(local.data(), end - begin, (uint32_t) vertices.size(), cacheSize, optimized.data(), chunkClusters[chunk]);
+
+        for (size_t i = 0; i < chunkIndexCount; i++)
+            chunkIndices[i] = vertices[optimized[i]];
+        for (uint32_t &cluster : chunkClusters[chunk])
+            cluster += (uint32_t) begin;
+    });
+
+    if (clusters != nullptr) {
+        clusters->clear();
+        for (const std::vector<uint32_t> &chunk : chunkClusters)
+            clusters->insert(clusters->end(), chunk.begin(), chunk.end());
+    }
+}
+
+void MeshOptimizer::SortSpatially(uint32_t *indices, size_t indexCount, const Positions &positions)
+{
+    size_t triangleCount = indexCount / 3;
+
+    glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+    for (size_t i = 0; i < indexCount; i++) {
+        glm::vec3 p = Position(positions, indices[i]);
+        boundsMin = glm::min(boundsMin, p);
+        boundsMax = glm::max(boundsMax, p);
+    }
+    glm::vec3 extent = boundsMax - boundsMin;
+    float scale = 1023.0f / std::max({ extent.x, extent.y, extent.z, FLT_MIN });
+
+    // Morton code of the triangle center above, triangle below, so one sort
+    // orders both
+    std::vector<uint64_t> keys(triangleCount);
+    uint32_t taskCount = (uint32_t) ((triangleCount + chunkTriangles - 1) / chunkTriangles);
+    WorkerPool::ParallelFor(taskCount, [&](uint32_t task) {
+        size_t end = std::min((task + 1) * chunkTriangles, triangleCount);
+        for (size_t triangle = task * chunkTriangles; triangle < end; triangle++) {
+            glm::vec3 center = (Position(positions, indices[triangle * 3 + 0]) +
+                                Position(positions, indices[triangle * 3 + 1]) +
+                                Position(positions, indices[triangle * 3 + 2])) * (1.0f / 3.0f);
+            glm::vec3 cell = (center - boundsMin) * scale;
+            uint32_t morton = SpreadBits((uint32_t) cell.x) | SpreadBits((uint32_t) cell.y) << 1 | SpreadBits((uint32_t) cell.z) << 2;
+            keys[triangle] = (uint64_t) morton << 32 | triangle;
+        }
+    });
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<uint32_t> sorted(indexCount);
+    for (size_t i = 0; i < triangleCount; i++)
+        memcpy(&sorted[i * 3], &indices[(keys[i] & 0xffffffff) * 3], 3 * sizeof(uint32_t));
+    memcpy(indices, sorted.data(), indexCount * sizeof(uint32_t));
+}
+
+void MeshOptimizer::Tipsify(const uint32_t *indices, size_t triangleCount, uint32_t vertexCount, uint32_t cacheSize,
+                            uint32_t *output, std::vector<uint32_t> &clusters)
+{
+    // Triangles of every vertex, as offsets into one array
+    std::vector<uint32_t> live(vertexCount, 0);
+    for (size_t i = 0; i < triangleCount * 3; i++)
+        live[indices[i]]++;
+
+    std::vector<uint32_t> offsets(vertexCount + 1, 0);
+    for (uint32_t vertex = 0; vertex < vertexCount; vertex++)
+        offsets[vertex + 1] = offsets[vertex] + live[vertex];
+
+    std::vector<uint32_t> adjacency(triangleCount * 3);
+    std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < triangleCount * 3; i++)
+        adjacency[fill[indices[i]]++] = (uint32_t) (i / 3);
+
+    std::vector<uint32_t> cacheTime(vertexCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<uint32_t> deadEnd;
+    std::vector<uint32_t> candidates;
+    uint32_t time = cacheSize + 1;
+    uint32_t cursor = 0;
+    size_t outputCount = 0;
+
+    // Fanning starts at the first vertex, and every time the walk has to
+    // jump somewhere the cache knows nothing about a new cluster begins
+    int64_t fanning = vertexCount > 0 ? 0 : -1;
+    clusters.push_back(0);
+
+    while (fanning >= 0) {
+        candidates.clear();
+
+        uint32_t vertex = (uint32_t) fanning;
+        for (uint32_t a = offsets[vertex]; a < offsets[vertex + 1]; a++) {
+            uint32_t triangle = adjacency[a];
+            if (emitted[triangle])
+                continue;
+
+            for (int corner = 0; corner < 3; corner++) {
+                uint32_t v = indices[triangle * 3 + corner];
+                output[outputCount++] = v;
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (time - cacheTime[v] > cacheSize)
+                    cacheTime[v] = time++;
+            }
+            emitted[triangle] = true;
+        }
+
+        // Prefer the candidate that has been in the cache longest and will
+        // still be there after its remaining triangles are emitted
+        int64_t best = -1;
+        int64_t bestPriority = -1;
+        for (uint32_t v : candidates) {
+            if (live[v] == 0)
+                continue;
+            int64_t priority = 0;
+            if (time - cacheTime[v] + 2 * live[v] <= cacheSize)
+                priority = time - cacheTime[v];
+            if (priority > bestPriority) {
+                best = v;
+                bestPriority = priority;
+            }
+        }
+
+        if (best < 0) {
+            while (!deadEnd.empty() && best < 0) {
+                uint32_t v = deadEnd.back();
+                deadEnd.pop_back();
+                if (live[v] > 0)
+                    best = v;
+            }
+            while (best < 0 && cursor < vertexCount) {
+                if (live[cursor] > 0)
+                    best = cursor;
+                cursor++;
+            }
+            if (best >= 0 && outputCount < triangleCount * 3)
+                clusters.push_back((uint32_t) (outputCount / 3));
+        }
+        fanning = best;
+    }
+}
+
+void MeshOptimizer::OptimizeOverdraw(uint32_t *indices, size_t indexCount, const Positions &positions, uint32_t vertexCount,
+                                     const std::vector<uint32_t> &clusters, float threshold, uint32_t cacheSize)
+{
+    size_t triangleCount = indexCount / 3;
+    if (triangleCount == 0)
+        return;
+
+    // Split the hard clusters further wherever the part so far is within
+    // threshold of the whole cluster's ACMR. Smaller clusters sort better,
+    // and starting one there costs little cache efficiency
+    std::vector<uint32_t> cacheTime(vertexCount, 0);
+    uint32_t time = cacheSize + 1;
+    std::vector<uint32_t> softClusters;
+
+    for (size_t c = 0; c < clusters.size(); c++) {
+        size_t begin = clusters[c];
+        size_t end = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount;
+
+        time += cacheSize + 1;
+        float clusterAcmr = SimulateCache(indices, begin, end, cacheSize, cacheTime, time) / (float) (end - begin);
+
+        time += cacheSize + 1;
+        size_t start = begin;
+        uint32_t misses = 0;
+        softClusters.push_back((uint32_t) begin);
+        for (size_t triangle = begin; triangle < end; triangle++) {
+            misses += SimulateCache(indices, triangle, triangle + 1, cacheSize, cacheTime, time);
+            if (triangle + 1 < end && misses / (float) (triangle + 1 - start) <= clusterAcmr * threshold) {
+                softClusters.push_back((uint32_t) (triangle + 1));
+                time += cacheSize + 1;
+                start = triangle + 1;
+                misses = 0;
+            }
+        }
+    }
+
+    // Area weighted centroid and normal of every cluster, then of the mesh
+    size_t clusterCount = softClusters.size();
+    std::vector<glm::vec3> centroids(clusterCount);
+    std::vector<glm::vec3> normals(clusterCount);
+    std::vector<float> areas(clusterCount);
+
+    WorkerPool::ParallelFor((uint32_t) ((clusterCount + 1023) / 1024), [&](uint32_t task) {
+        size_t last = std::min<size_t>((task + 1) * 1024, clusterCount);
+        for (size_t c = task * 1024; c < last; c++) {
+            size_t end = c + 1 < clusterCount ? softClusters[c + 1] : triangleCount;
+            glm::vec3 centroid(0.0f), normal(0.0f);
+            float area = 0.0f;
+            for (size_t triangle = softClusters[c]; triangle < end; triangle++) {
+                glm::vec3 p0 = Position(positions, indices[triangle * 3 + 0]);
+                glm::vec3 p1 = Position(positions, indices[triangle * 3 + 1]);
+                glm::vec3 p2 = Position(positions, indices[triangle * 3 + 2]);
+                glm::vec3 faceNormal = glm::cross(p1 - p0, p2 - p0);
+                float faceArea = glm::length(faceNormal);
+                centroid += (p0 + p1 + p2) * (faceArea / 3.0f);
+                normal += faceNormal;
+                area += faceArea;
+            }
+            centroids[c] = area > 0.0f ? centroid / area : centroid;
+            float normalLength = glm::length(normal);
+            normals[c] = normalLength > 0.0f ? normal / normalLength : normal;
+            areas[c] = area;
+        }
+    });
+
+    glm::vec3 meshCentroid(0.0f);
+    float meshArea = 0.0f;
+    for (size_t c = 0; c < clusterCount; c++) {
+        meshCentroid += centroids[c] * areas[c];
+        meshArea += areas[c];
+    }
+    if (meshArea > 0.0f)
+        meshCentroid = meshCentroid * (1.0f / meshArea);
+
+    // Clusters facing out from the center are drawn first
+    std::vector<float> keys(clusterCount);
+    for (size_t c = 0; c < clusterCount; c++)
+        keys[c] = glm::dot(centroids[c] - meshCentroid, normals[c]);
+
+    std::vector<uint32_t> order(clusterCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&keys](uint32_t a, uint32_t b) { return keys[a] > keys[b]; });
+
+    std::vector<uint32_t> sorted;
+    sorted.reserve(indexCount);
+    for (uint32_t c : order) {
+        size_t end = c + 1 < clusterCount ? softClusters[c + 1] : triangleCount;
+        sorted.insert(sorted.end(), indices + softClusters[c] * 3, indices + end * 3);
+    }
+    memcpy(indices, sorted.data(), indexCount * sizeof(uint32_t));
+}
+
+uint32_t MeshOptimizer::OptimizeVertexFetch(uint32_t *indices, size_t indexCount, void *vertices, uint32_t vertexCount, size_t vertexSize)
+{
+    // New numbers in order of first use, vertices no index refers to are
+    // dropped off the end
+    std::vector<uint32_t> remap(vertexCount, UINT32_MAX);
+    uint32_t nextVertex = 0;
+    for (size_t i = 0; i < indexCount; i++) {
+        uint32_t &newVertex = remap[indices[i]];
+        if (newVertex == UINT32_MAX)
+            newVertex = nextVertex++;
+        indices[i] = newVertex;
+    }
+
+    uint8_t *bytes = (uint8_t *) vertices;
+    std::vector<uint8_t> reordered((size_t) nextVertex * vertexSize);
+    for (uint32_t vertex = 0; vertex < vertexCount; vertex++)
+        if (remap[vertex] != UINT32_MAX)
+            memcpy(&reordered[remap[vertex] * vertexSize], bytes + vertex * vertexSize, vertexSize);
+    memcpy(bytes, reordered.data(), reordered.size());
+
+    return nextVertex;
+}
+
+uint32_t MeshOptimizer::Optimize(uint32_t *indices, size_t indexCount, void *vertices, uint32_t vertexCount, size_t vertexSize,
+                                 size_t positionOffset)
+{
+    Positions positions = { (const float *) ((const uint8_t *) vertices + positionOffset), vertexSize };
+
+    std::vector<uint32_t> clusters;
+    OptimizeVertexCache(indices, indexCount, positions, &clusters);
+    OptimizeOverdraw(indices, indexCount, positions, vertexCount, clusters);
+
+    // Returns how many vertices are left, unused ones are dropped
+    return OptimizeVertexFetch(indices, indexCount, vertices, vertexCount, vertexSize);
+}
+
+void MeshOptimizer::RasterizeOverdraw(const uint32_t *indices, size_t indexCount, const Positions &positions,
+                                      const glm::vec3 &boundsMin, const glm::vec3 &boundsMax, int view,
+                                      uint64_t *coveredPixels, uint64_t *shadedPixels)
+{
+    // Looking down one axis, from the negative side for even views and the
+    // positive side for odd ones, orthographic over the mesh bounds
+    int axis = view / 2;
+    int uAxis = (axis + 1) % 3;
+    int vAxis = (axis + 2) % 3;
+    float depthSign = view % 2 == 0 ? 1.0f : -1.0f;
+
+    const int size = overdrawGridSize;
+    glm::vec3 extent = boundsMax - boundsMin;
+    float uScale = extent[uAxis] > 0.0f ? size / extent[uAxis] : 0.0f;
+    float vScale = extent[vAxis] > 0.0f ? size / extent[vAxis] : 0.0f;
+
+    std::vector<float> depth(size * size, FLT_MAX);
+    uint64_t shaded = 0;
+
+    for (size_t i = 0; i + 2 < indexCount; i += 3) {
+        float x[3], y[3], z[3];
+        for (int corner = 0; corner < 3; corner++) {
+            glm::vec3 p = Position(positions, indices[i + corner]);
+            x[corner] = (p[uAxis] - boundsMin[uAxis]) * uScale;
+            y[corner] = (p[vAxis] - boundsMin[vAxis]) * vScale;
+            z[corner] = p[axis] * depthSign;
+        }
+
+        float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if (fabsf(area) < 1e-12f)
+            continue;
+        float inverseArea = 1.0f / area;
+
+        int minX = std::max((int) floorf(std::min({ x[0], x[1], x[2] })), 0);
+        int maxX = std::min((int) ceilf(std::max({ x[0], x[1], x[2] })), size - 1);
+        int minY = std::max((int) floorf(std::min({ y[0], y[1], y[2] })), 0);
+        int maxY = std::min((int) ceilf(std::max({ y[0], y[1], y[2] })), size - 1);
+
+        // Both windings count, nothing in here culls back faces
+        for (int py = minY; py <= maxY; py++) {
+            for (int px = minX; px <= maxX; px++) {
+                float cx = px + 0.5f, cy = py + 0.5f;
+                float w0 = ((x[2] - x[1]) * (cy - y[1]) - (cx - x[1]) * (y[2] - y[1])) * inverseArea;
+                float w1 = ((x[0] - x[2]) * (cy - y[2]) - (cx - x[2]) * (y[0] - y[2])) * inverseArea;
+                float w2 = 1.0f - w0 - w1;
+                if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+                    continue;
+
+                float d = w0 * z[0] + w1 * z[1] + w2 * z[2];
+                float &stored = depth[py * size + px];
+                if (d < stored) {
+                    stored = d;
+                    shaded++;
+                }
+            }
+        }
+    }
+
+    uint64_t covered = 0;
+    for (float d : depth)
+        covered += d != FLT_MAX;
+
+    *coveredPixels = covered;
+    *shadedPixels = shaded;
+}
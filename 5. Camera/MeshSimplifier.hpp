@@ -0,0 +1,356 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "MeshOptimizer.hpp"
+
+// Simplifies indexed triangle meshes by edge collapse with quadric error
+// metrics (Garland and Heckbert 1997). Every vertex carries the sum of the
+// squared distances to the planes of the triangles around it, weighted by
+// their area; collapsing an edge moves one end onto the other and costs
+// that sum evaluated at the new position. Collapses only ever remove
+// vertices, so every level of detail indexes the original vertex buffer
+// and only needs its own indices.
+//
+//  - open borders get extra planes through their edges, and border
+//    vertices can only slide along the border, so holes don't grow
+//  - vertices that share a position with another vertex (attribute
+//    seams) never move, so the seam can't tear open
+//  - a collapse that would flip a triangle over is skipped
+//
+// Collapses are done in passes: every pass sorts all edges by cost and
+// takes the cheapest ones that don't touch each other.
+namespace MeshSimplifier {
+    struct Level {
+        std::vector<uint32_t> indices;
+        float error;
+    };
+
+    static size_t Simplify(uint32_t *destination, const uint32_t *indices, size_t indexCount,
+                           const MeshOptimizer::Positions &positions, uint32_t vertexCount,
+                           size_t targetIndexCount, float targetError, float *resultError);
+    static std::vector<Level> BuildLevels(const uint32_t *indices, size_t indexCount,
+                                          const MeshOptimizer::Positions &positions, uint32_t vertexCount,
+                                          int maxLevels = 6, float reduction = 0.5f);
+}
+
+namespace MeshSimplifier {
+    // Border planes count this much more than the surface around them
+    static const double borderWeight = 10.0;
+
+    // Symmetric 4x4 matrix of a sum of plane equations, and the total
+    // weight, to turn the sum back into a mean squared distance
+    struct Quadric {
+        double a2, b2, c2, d2, ab, ac, ad, bc, bd, cd;
+        double weight;
+    };
+
+    static void AddPlane(Quadric &quadric, const glm::dvec3 &normal, double distance, double weight)
+    {
+        quadric.a2 += weight * normal.x * normal.x;
+        quadric.b2 += weight * normal.y * normal.y;
+        quadric.c2 += weight * normal.z * normal.z;
+        quadric.d2 += weight * distance * distance;
+        quadric.ab += weight * normal.x * normal.y;
+        quadric.ac += weight * normal.x * normal.z;
+        quadric.ad += weight * normal.x * distance;
+        quadric.bc += weight * normal.y * normal.z;
+        quadric.bd += weight * normal.y * distance;
+        quadric.cd += weight * normal.z * distance;
+        quadric.weight += weight;
+    }
+
+    static void AddQuadric(Quadric &quadric, const Quadric &other)
+    {
+        quadric.a2 += other.a2; quadric.b2 += other.b2; quadric.c2 += other.c2; quadric.d2 += other.d2;
+        quadric.ab += other.ab; quadric.ac += other.ac; quadric.ad += other.ad;
+        quadric.bc += other.bc; quadric.bd += other.bd; quadric.cd += other.cd;
+        quadric.weight += other.weight;
+    }
+
+    // Mean squared distance of point to the planes
+    static double Evaluate(const Quadric &quadric, const glm::dvec3 &p)
+    {
+        double error = quadric.a2 * p.x * p.x + quadric.b2 * p.y * p.y + quadric.c2 * p.z * p.z + quadric.d2
+                     + 2.0 * (quadric.ab * p.x * p.y + quadric.ac * p.x * p.z + quadric.bc * p.y * p.z)
+                     + 2.0 * (quadric.ad * p.x + quadric.bd * p.y + quadric.cd * p.z);
+        return quadric.weight > 0.0 ? std::max(error, 0.0) / quadric.weight : 0.0;
+    }
+
+    struct Collapse {
+        double cost;
+        uint32_t from;
+        uint32_t to;
+    };
+
+    // An edge of a triangle, keyed by its two ends whichever way round
+    // the triangle goes through it
+    struct Edge {
+        uint64_t key;
+        uint32_t corner;
+    };
+
+    static uint64_t EdgeKey(uint32_t a, uint32_t b)
+    {
+        return a < b ? (uint64_t) a << 32 | b : (uint64_t) b << 32 | a;
+    }
+
+    // A position by the bits of its three floats, so only vertices exactly
+    // on top of each other compare equal. Adding zero turns -0 into 0 first
+    struct PositionKey {
+        uint32_t bits[3];
+
+        explicit PositionKey(const float *p)
+        {
+            float canonical[3] = { p[0] + 0.0f, p[1] + 0.0f, p[2] + 0.0f };
+            memcpy(bits, canonical, sizeof(bits));
+        }
+
+        bool operator==(const PositionKey &other) const
+        {
+            return bits[0] == other.bits[0] && bits[1] == other.bits[1] && bits[2] == other.bits[2];
+        }
+    };
+
+    struct PositionHash {
+        size_t operator()(const PositionKey &key) const
+        {
+            return ((uint64_t) key.bits[0] * 73856093u) ^ ((uint64_t) key.bits[1] * 19349663u << 16) ^
+                   ((uint64_t) key.bits[2] * 83492791u << 32);
+        }
+    };
+}
+
+size_t MeshSimplifier::Simplify(uint32_t *destination, const uint32_t *indices, size_t indexCount,
+                                const MeshOptimizer::Positions &positions, uint32_t vertexCount,
+                                size_t targetIndexCount, float targetError, float *resultError)
+{
+    std::vector<glm::dvec3> points(vertexCount);
+    for (uint32_t vertex = 0; vertex < vertexCount; vertex++)
+        points[vertex] = glm::dvec3(MeshOptimizer::Position(positions, vertex));
+
+    // Seams: more than one vertex at the same position
+    std::vector<uint8_t> locked(vertexCount, 0);
+    {
+        std::unordered_map<PositionKey, uint32_t, PositionHash> first;
+        for (uint32_t vertex = 0; vertex < vertexCount; vertex++) {
+            const float *p = (const float *) ((const uint8_t *) positions.data + vertex * positions.stride);
+            auto inserted = first.emplace(PositionKey(p), vertex);
+            if (!inserted.second)
+                locked[vertex] = locked[inserted.first->second] = 1;
+        }
+    }
+
+    std::vector<uint32_t> result(indices, indices + indexCount);
+    std::vector<Quadric> quadrics(vertexCount, Quadric());
+
+    // Edges sorted so the triangles sharing one are next to each other.
+    // An edge only one triangle uses is on a border, borderCorner marks
+    // the corner it starts at
+    std::vector<Edge> edges;
+    std::vector<uint8_t> borderCorner;
+    auto findEdges = [&]() {
+        edges.clear();
+        for (size_t i = 0; i < result.size(); i += 3)
+            for (int corner = 0; corner < 3; corner++)
+                edges.push_back({ EdgeKey(result[i + corner], result[i + (corner + 1) % 3]), (uint32_t) (i + corner) });
+        std::sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) { return a.key < b.key; });
+
+        borderCorner.assign(result.size(), 0);
+        for (size_t i = 0; i < edges.size(); i++)
+            borderCorner[edges[i].corner] = (i == 0 || edges[i - 1].key != edges[i].key) &&
+                                            (i + 1 == edges.size() || edges[i + 1].key != edges[i].key);
+    };
+
+    // Faces and borders of the input, every later pass keeps adding to these
+    findEdges();
+    for (size_t i = 0; i < result.size(); i += 3) {
+        const glm::dvec3 &p0 = points[result[i]], &p1 = points[result[i + 1]], &p2 = points[result[i + 2]];
+        glm::dvec3 cross = glm::cross(p1 - p0, p2 - p0);
+        double length = glm::length(cross);
+        if (length == 0.0)
+            continue;
+        glm::dvec3 normal = cross / length;
+        double area = length * 0.5;
+        for (int corner = 0; corner < 3; corner++)
+            AddPlane(quadrics[result[i + corner]], normal, -glm::dot(normal, p0), area);
+
+        for (int corner = 0; corner < 3; corner++) {
+            uint32_t a = result[i + corner], b = result[i + (corner + 1) % 3];
+            if (!borderCorner[i + corner])
+                continue;
+            glm::dvec3 edge = points[b] - points[a];
+            double edgeLength = glm::length(edge);
+            if (edgeLength == 0.0)
+                continue;
+            glm::dvec3 borderNormal = glm::normalize(glm::cross(edge, normal));
+            double weight = edgeLength * edgeLength * borderWeight;
+            AddPlane(quadrics[a], borderNormal, -glm::dot(borderNormal, points[a]), weight);
+            AddPlane(quadrics[b], borderNormal, -glm::dot(borderNormal, points[a]), weight);
+        }
+    }
+
+    double errorLimit = (double) targetError * targetError;
+    double maxError = 0.0;
+    std::vector<uint8_t> border(vertexCount), touched(vertexCount);
+    std::vector<uint32_t> collapseTo(vertexCount);
+    std::vector<uint32_t> triangleStart(vertexCount + 1), vertexTriangles;
+    std::vector<Collapse> collapses;
+
+    while (result.size() > targetIndexCount) {
+        size_t triangleCount = result.size() / 3;
+        findEdges();
+
+        std::fill(border.begin(), border.end(), 0);
+        for (size_t i = 0; i < result.size(); i++)
+            if (borderCorner[i])
+                border[result[i]] = border[result[i - i % 3 + (i % 3 + 1) % 3]] = 1;
+
+        // Triangles around every vertex, for the flip test
+        std::fill(triangleStart.begin(), triangleStart.end(), 0);
+        for (uint32_t vertex : result)
+            triangleStart[vertex + 1]++;
+        for (uint32_t vertex = 0; vertex < vertexCount; vertex++)
+            triangleStart[vertex + 1] += triangleStart[vertex];
+        vertexTriangles.resize(result.size());
+        {
+            std::vector<uint32_t> fill(triangleStart.begin(), triangleStart.end() - 1);
+            for (size_t i = 0; i < result.size(); i++)
+                vertexTriangles[fill[result[i]]++] = (uint32_t) (i / 3);
+        }
+
+        // The cheaper direction of every edge that is allowed to collapse
+        collapses.clear();
+        for (size_t i = 0; i < edges.size(); i++) {
+            if (i > 0 && edges[i - 1].key == edges[i].key)
+                continue;
+            uint32_t a = (uint32_t) (edges[i].key >> 32), b = (uint32_t) edges[i].key;
+            bool borderEdge = borderCorner[edges[i].corner];
+
+            Collapse best = { DBL_MAX, 0, 0 };
+            for (int direction = 0; direction < 2; direction++) {
+                uint32_t from = direction == 0 ? a : b, to = direction == 0 ? b : a;
+                if (locked[from] || (border[from] && !borderEdge))
+                    continue;
+                Quadric merged = quadrics[from];
+                AddQuadric(merged, quadrics[to]);
+                double cost = Evaluate(merged, points[to]);
+                if (cost < best.cost)
+                    best = { cost, from, to };
+            }
+            if (best.cost <= errorLimit)
+                collapses.push_back(best);
+        }
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse &a, const Collapse &b) {
+            return a.cost < b.cost || (a.cost == b.cost && (a.from < b.from || (a.from == b.from && a.to < b.to)));
+        });
+
+        for (uint32_t vertex = 0; vertex < vertexCount; vertex++)
+            collapseTo[vertex] = vertex;
+        std::fill(touched.begin(), touched.end(), 0);
+
+        size_t collapseCount = 0;
+        size_t targetTriangles = targetIndexCount / 3;
+        for (const Collapse &collapse : collapses) {
+            if (triangleCount <= targetTriangles)
+                break;
+            if (touched[collapse.from] || touched[collapse.to])
+                continue;
+
+            // Every triangle that keeps existing has to keep facing the
+            // same way once from moves onto to
+            bool flips = false;
+            size_t removed = 0;
+            for (uint32_t t = triangleStart[collapse.from]; t < triangleStart[collapse.from + 1] && !flips; t++) {
+                const uint32_t *triangle = &result[vertexTriangles[t] * 3];
+                if (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to) {
+                    removed++;
+                    continue;
+                }
+                glm::dvec3 p[3], moved[3];
+                for (int corner = 0; corner < 3; corner++) {
+                    p[corner] = points[triangle[corner]];
+                    moved[corner] = triangle[corner] == collapse.from ? points[collapse.to] : p[corner];
+                }
+                glm::dvec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+                glm::dvec3 after = glm::cross(moved[1] - moved[0], moved[2] - moved[0]);
+                flips = glm::dot(before, after) <= 1e-3 * glm::dot(before, before);
+            }
+            if (flips)
+                continue;
+
+            // Nothing around from may move again this pass, or the flip
+            // test above would be out of date
+            for (uint32_t t = triangleStart[collapse.from]; t < triangleStart[collapse.from + 1]; t++)
+                for (int corner = 0; corner < 3; corner++)
+                    touched[result[vertexTriangles[t] * 3 + corner]] = 1;
+            touched[collapse.to] = 1;
+
+            collapseTo[collapse.from] = collapse.to;
+            AddQuadric(quadrics[collapse.to], quadrics[collapse.from]);
+            maxError = std::max(maxError, collapse.cost);
+            triangleCount -= removed;
+            collapseCount++;
+        }
+
+        if (collapseCount == 0)
+            break;
+
+        // Apply the collapses and drop the triangles that lost an area
+        size_t kept = 0;
+        for (size_t i = 0; i < result.size(); i += 3) {
+            uint32_t a = collapseTo[result[i]], b = collapseTo[result[i + 1]], c = collapseTo[result[i + 2]];
+            if (a == b || b == c || c == a)
+                continue;
+            result[kept++] = a;
+            result[kept++] = b;
+            result[kept++] = c;
+        }
+        result.resize(kept);
+    }
+
+    memcpy(destination, result.data(), result.size() * sizeof(uint32_t));
+    if (resultError != nullptr)
+        *resultError = (float) sqrt(maxError);
+    return result.size();
+}
+
+std::vector<MeshSimplifier::Level> MeshSimplifier::BuildLevels(const uint32_t *indices, size_t indexCount,
+                                                               const MeshOptimizer::Positions &positions, uint32_t vertexCount,
+                                                               int maxLevels, float reduction)
+{
+    // Each level starts from the one before it, which is both faster and
+    // keeps the levels nested. Errors add up along the chain so they stay
+    // measured against the full mesh
+    std::vector<Level> levels;
+    levels.push_back({ std::vector<uint32_t>(indices, indices + indexCount), 0.0f });
+
+    while ((int) levels.size() < maxLevels) {
+        const Level &previous = levels.back();
+        size_t target = (size_t) (previous.indices.size() / 3 * reduction) * 3;
+        if (target < 3)
+            break;
+
+        Level level;
+        float error;
+        level.indices.resize(previous.indices.size());
+        level.indices.resize(Simplify(level.indices.data(), previous.indices.data(), previous.indices.size(), positions,
+                                      vertexCount, target, FLT_MAX, &error));
+        level.error = previous.error + error;
+
+        // Stop once the mesh won't get much smaller
+        if (level.indices.empty() || level.indices.size() > previous.indices.size() * 0.85f)
+            break;
+        levels.push_back(std::move(level));
+    }
+
+    return levels;
+}
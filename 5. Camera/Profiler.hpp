@@ -0,0 +1,345 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+
+// Frame profiler. CPU scopes are timed with steady_clock, GPU scopes with
+// GL_TIME_ELAPSED queries that are read back a few frames later so the
+// CPU never waits on the GPU. Every finished scope lands in a lock-free
+// ring buffer which can be exported as Chrome/Perfetto trace JSON, along
+// with per frame counters.
+namespace Profiler {
+    struct Event {
+        const char *name;
+        uint64_t beginNs;
+        uint64_t durationNs;
+        uint32_t thread;
+        uint32_t frame;
+
+        // Counter samples have a value instead of a duration
+        bool counter = false;
+        int64_t value = 0;
+    };
+
+    // Times the enclosing block on the CPU and, unless gpu is false, on the
+    // GPU. GPU scopes can't nest, only one GL_TIME_ELAPSED query may be
+    // active at a time
+    class Scope {
+    public:
+        explicit Scope(const char *name, bool gpu = true);
+        ~Scope();
+
+    private:
+        const char *name;
+        uint64_t beginNs;
+        int gpuSlot;
+    };
+
+    static void Initialize();
+    static void Shutdown();
+    static void BeginFrame();
+    static void EndFrame();
+    static void Record(const Event &event);
+    static void Counter(const char *name, int64_t value);
+    static bool WriteChromeTrace(const std::string &path);
+    static void PrintSummary();
+    static uint64_t NowNs();
+    static uint32_t ThreadId();
+    static void SetThreadName(const char *name);
+}
+
+namespace Profiler {
+    // How many frames a query result may lag behind before it is dropped.
+    // The GPU is rarely more than two frames behind, four leaves headroom
+    static const int queryLatency = 4;
+    static const int maxGpuScopes = 16;
+    static const size_t eventCapacity = 1 << 16;
+
+    // Thread id used on the GPU track in the exported trace
+    static const uint32_t gpuThread = 0;
+
+    struct GpuFrame {
+        GLuint timestampQuery;
+        GLuint queries[maxGpuScopes];
+        const char *names[maxGpuScopes];
+        int count;
+        uint32_t frame;
+        uint64_t cpuBeginNs;
+        bool pending;
+    };
+
+    // Written by the thread that renders, read by scopes on any thread
+    static std::atomic<bool> enabled{false};
+    static std::atomic<uint32_t> frameNumber{0};
+    static GpuFrame gpuFrames[queryLatency];
+    static GpuFrame *currentGpuFrame = nullptr;
+    static int64_t gpuClockOffsetNs = 0;
+    static uint64_t droppedGpuFrames = 0;
+
+    static std::vector<Event> events(eventCapacity);
+    static std::atomic<uint64_t> eventWriteIndex{0};
+    static std::atomic<uint32_t> nextThreadId{1};
+
+    // Track names by thread id, threads past the last one go unnamed
+    static const uint32_t maxNamedThreads = 64;
+    static std::atomic<const char *> threadNames[maxNamedThreads];
+
+    // Per frame totals used by PrintSummary()
+    static double cpuFrameMsTotal = 0.0;
+    static double gpuFrameMsTotal = 0.0;
+    static uint32_t cpuFramesMeasured = 0;
+    static uint32_t gpuFramesMeasured = 0;
+    static uint64_t frameBeginNs = 0;
+}
+
+uint64_t Profiler::NowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint32_t Profiler::ThreadId()
+{
+    // Every thread gets its own track in the trace, numbered in the order
+    // they first record. SetThreadName() says which is which
+    thread_local uint32_t threadId = nextThreadId.fetch_add(1, std::memory_order_relaxed);
+    return threadId;
+}
+
+void Profiler::SetThreadName(const char *name)
+{
+    uint32_t thread = ThreadId();
+    if (thread < maxNamedThreads)
+        threadNames[thread].store(name, std::memory_order_relaxed);
+}
+
+void Profiler::Initialize()
+{
+    for (GpuFrame &gpuFrame : gpuFrames) {
+        glGenQueries(1, &gpuFrame.timestampQuery);
+        glGenQueries(maxGpuScopes, gpuFrame.queries);
+        gpuFrame.count = 0;
+        gpuFrame.pending = false;
+    }
+
+    // GL_TIMESTAMP and steady_clock have different origins, remember the
+    // difference so GPU scopes line up with the CPU ones in the trace
+    GLint64 gpuNow;
+    glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+    gpuClockOffsetNs = (int64_t) NowNs() - gpuNow;
+
+    enabled.store(true, std::memory_order_relaxed);
+}
+
+void Profiler::Shutdown()
+{
+    if (!enabled.load(std::memory_order_relaxed))
+        return;
+
+    for (GpuFrame &gpuFrame : gpuFrames) {
+        glDeleteQueries(1, &gpuFrame.timestampQuery);
+        glDeleteQueries(maxGpuScopes, gpuFrame.queries);
+    }
+    enabled.store(false, std::memory_order_relaxed);
+}
+
+void Profiler::BeginFrame()
+{
+    if (!enabled.load(std::memory_order_relaxed))
+        return;
+
+    // Frames are begun on whichever thread renders, threaded or not
+    if (frameNumber.load(std::memory_order_relaxed) == 0)
+        SetThreadName("Render");
+
+    GpuFrame &gpuFrame = gpuFrames[frameNumber.load(std::memory_order_relaxed) % queryLatency];
+
+    // Results for this slot were issued queryLatency frames ago. Only read
+    // them if they are ready, otherwise throw the frame away instead of
+    // stalling the pipeline
+    if (gpuFrame.pending) {
+        GLint available = GL_FALSE;
+        GLuint lastQuery = gpuFrame.count > 0 ? gpuFrame.queries[gpuFrame.count - 1] : gpuFrame.timestampQuery;
+        glGetQueryObjectiv(lastQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+
+        if (available) {
+            GLuint64 timestamp;
+            glGetQueryObjectui64v(gpuFrame.timestampQuery, GL_QUERY_RESULT, &timestamp);
+
+            GLuint64 elapsed[maxGpuScopes];
+            uint64_t frameNs = 0;
+            for (int i = 0; i < gpuFrame.count; i++) {
+                glGetQueryObjectui64v(gpuFrame.queries[i], GL_QUERY_RESULT, &elapsed[i]);
+                frameNs += elapsed[i];
+            }
+
+            // The GPU can't have spent longer on the frame than the wall time
+            // since it was submitted. Some drivers (llvmpipe) report garbage
+            // for the very first query, skip such frames
+            if (frameNs <= NowNs() - gpuFrame.cpuBeginNs) {
+                // TIME_ELAPSED only gives durations, so the scopes are laid
+                // out back to back from the frame's first timestamp
+                uint64_t beginNs = timestamp + gpuClockOffsetNs;
+                for (int i = 0; i < gpuFrame.count; i++) {
+                    Record({ gpuFrame.names[i], beginNs, elapsed[i], gpuThread, gpuFrame.frame });
+                    beginNs += elapsed[i];
+                }
+
+                gpuFrameMsTotal += frameNs / 1e6;
+                gpuFramesMeasured++;
+            } else {
+                droppedGpuFrames++;
+            }
+        } else {
+            droppedGpuFrames++;
+        }
+    }
+
+    frameBeginNs = NowNs();
+
+    gpuFrame.count = 0;
+    gpuFrame.frame = frameNumber.load(std::memory_order_relaxed);
+    gpuFrame.cpuBeginNs = frameBeginNs;
+    gpuFrame.pending = true;
+    glQueryCounter(gpuFrame.timestampQuery, GL_TIMESTAMP);
+    currentGpuFrame = &gpuFrame;
+}
+
+void Profiler::EndFrame()
+{
+    if (!enabled.load(std::memory_order_relaxed))
+        return;
+
+    uint64_t endNs = NowNs();
+    Record({ "Frame", frameBeginNs, endNs - frameBeginNs, ThreadId(), frameNumber.load(std::memory_order_relaxed) });
+    cpuFrameMsTotal += (endNs - frameBeginNs) / 1e6;
+    cpuFramesMeasured++;
+
+    currentGpuFrame = nullptr;
+    frameNumber.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Profiler::Record(const Event &event)
+{
+    // Reserving a slot is the only synchronization, so any thread may
+    // record. Once the ring wraps the oldest events are overwritten
+    uint64_t index = eventWriteIndex.fetch_add(1, std::memory_order_relaxed);
+    events[index % eventCapacity] = event;
+}
+
+void Profiler::Counter(const char *name, int64_t value)
+{
+    if (!enabled.load(std::memory_order_relaxed))
+        return;
+
+    Record({ name, NowNs(), 0, ThreadId(), frameNumber.load(std::memory_order_relaxed), true, value });
+}
+
+inline Profiler::Scope::Scope(const char *name, bool gpu)
+    : name(name), beginNs(0), gpuSlot(-1)
+{
+    if (!enabled.load(std::memory_order_relaxed))
+        return;
+
+    if (gpu && currentGpuFrame != nullptr && currentGpuFrame->count < maxGpuScopes) {
+        gpuSlot = currentGpuFrame->count++;
+        currentGpuFrame->names[gpuSlot] = name;
+        glBeginQuery(GL_TIME_ELAPSED, currentGpuFrame->queries[gpuSlot]);
+    }
+    beginNs = NowNs();
+}
+
+inline Profiler::Scope::~Scope()
+{
+    if (!enabled.load(std::memory_order_relaxed))
+        return;
+
+    uint64_t endNs = NowNs();
+    if (gpuSlot >= 0)
+        glEndQuery(GL_TIME_ELAPSED);
+
+    Record({ name, beginNs, endNs - beginNs, ThreadId(), frameNumber.load(std::memory_order_relaxed) });
+}
+
+bool Profiler::WriteChromeTrace(const std::string &path)
+{
+    std::ofstream trace(path);
+    if (!trace.is_open()) {
+        std::cerr << "Failed to open trace file: " << path << std::endl;
+        return false;
+    }
+
+    uint64_t end = eventWriteIndex.load(std::memory_order_acquire);
+    uint64_t begin = end > eventCapacity ? end - eventCapacity : 0;
+
+    // Trace timestamps are microseconds relative to the first event
+    uint64_t originNs = UINT64_MAX;
+    for (uint64_t i = begin; i < end; i++)
+        originNs = std::min(originNs, events[i % eventCapacity].beginNs);
+
+    // A name for every track that has events, those nobody named get a
+    // number
+    std::vector<bool> seen;
+    for (uint64_t i = begin; i < end; i++) {
+        const Event &event = events[i % eventCapacity];
+        if (event.counter || event.thread == gpuThread)
+            continue;
+        seen.resize(std::max(seen.size(), (size_t) event.thread + 1));
+        seen[event.thread] = true;
+    }
+
+    trace << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    trace << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << gpuThread << ",\"args\":{\"name\":\"GPU\"}}";
+    for (uint32_t thread = 0; thread < seen.size(); thread++) {
+        if (!seen[thread])
+            continue;
+        const char *name = thread < maxNamedThreads ? threadNames[thread].load(std::memory_order_relaxed) : nullptr;
+        trace << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread << ",\"args\":{\"name\":\"";
+        if (name != nullptr)
+            trace << name;
+        else
+            trace << "Thread " << thread;
+        trace << "\"}}";
+    }
+
+    for (uint64_t i = begin; i < end; i++) {
+        const Event &event = events[i % eventCapacity];
+        if (event.counter) {
+            trace << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"C\",\"pid\":1"
+                  << ",\"ts\":" << (event.beginNs - originNs) / 1000.0
+                  << ",\"args\":{\"value\":" << event.value << "}}";
+            continue;
+        }
+
+        trace << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"" << (event.thread == gpuThread ? "gpu" : "cpu")
+              << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+              << ",\"ts\":" << (event.beginNs - originNs) / 1000.0
+              << ",\"dur\":" << event.durationNs / 1000.0
+              << ",\"args\":{\"frame\":" << event.frame << "}}";
+    }
+    trace << "\n]}\n";
+
+    std::cout << "Wrote " << end - begin << " profiler events to " << path << std::endl;
+    return true;
+}
+
+void Profiler::PrintSummary()
+{
+    if (cpuFramesMeasured == 0)
+        return;
+
+    double cpuMs = cpuFrameMsTotal / cpuFramesMeasured;
+    double gpuMs = gpuFramesMeasured > 0 ? gpuFrameMsTotal / gpuFramesMeasured : 0.0;
+
+    std::cout << "Profiler: CPU " << cpuMs << " ms/frame, GPU " << gpuMs << " ms/frame ("
+              << (gpuMs > cpuMs ? "GPU" : "CPU") << " bound), "
+              << droppedGpuFrames << " GPU frames dropped" << std::endl;
+}
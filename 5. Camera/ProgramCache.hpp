@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+
+// On-disk cache of linked program binaries. Entries are keyed by a hash of
+// everything that affects the driver's output: the shader sources, their
+// defines and the GL vendor, renderer and version strings. A binary the
+// driver rejects (after a driver update for example) counts as a miss and
+// the caller compiles from source and stores the new binary over it.
+namespace ProgramCache {
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint64_t key;
+        GLenum format;
+        uint32_t length;
+    };
+
+    static void SetDirectory(const std::string &path);
+    static bool Supported();
+    static uint64_t Key(const std::vector<std::string> &parts);
+    static GLuint Load(uint64_t key);
+    static void Store(uint64_t key, GLuint program);
+    static void PrintStats();
+}
+
+namespace ProgramCache {
+    static const uint32_t formatVersion = 1;
+
+    // An empty directory disables the cache
+    static std::string directory = ".shader-cache";
+    static uint32_t hits = 0;
+    static uint32_t misses = 0;
+    static uint32_t rejected = 0;
+
+    static std::string EntryPath(uint64_t key)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long) key);
+        return directory + "/" + name;
+    }
+}
+
+void ProgramCache::SetDirectory(const std::string &path)
+{
+    directory = path;
+}
+
+bool ProgramCache::Supported()
+{
+    if (directory.empty() || !(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary))
+        return false;
+
+    // Drivers may expose the entry points but no binary format at all
+    GLint formatCount = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+    return formatCount > 0;
+}
+
+uint64_t ProgramCache::Key(const std::vector<std::string> &parts)
+{
+    // FNV-1a over the driver strings and every part. A separator byte
+    // after each part keeps "ab" + "c" and "a" + "bc" apart
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](const char *data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            hash ^= (uint8_t) data[i];
+            hash *= 1099511628211ull;
+        }
+        hash ^= 0xff;
+        hash *= 1099511628211ull;
+    };
+
+    for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+        const char *string = (const char *) glGetString(name);
+        mix(string, string != nullptr ? strlen(string) : 0);
+    }
+    for (const std::string &part : parts)
+        mix(part.data(), part.size());
+
+    return hash;
+}
+
+GLuint ProgramCache::Load(uint64_t key)
+{
+    if (!Supported())
+        return 0;
+
+    std::ifstream file(EntryPath(key), std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        misses++;
+        return 0;
+    }
+    std::streamoff fileSize = file.tellg();
+    file.seekg(0);
+
+    // The length is checked against what is actually there before anything
+    // is allocated for it, a truncated or corrupted entry is just a miss
+    Header header;
+    std::vector<char> binary;
+    bool valid = file.read((char *) &header, sizeof(header))
+              && std::string(header.magic, 4) == "GLPB"
+              && header.version == formatVersion
+              && header.key == key
+              && header.length == fileSize - (std::streamoff) sizeof(header);
+    if (valid) {
+        binary.resize(header.length);
+        valid = (bool) file.read(binary.data(), binary.size());
+    }
+
+    GLuint program = 0;
+    if (valid) {
+        program = glCreateProgram();
+        glProgramBinary(program, header.format, binary.data(), binary.size());
+
+        GLint success;
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
+        if (!success) {
+            glDeleteProgram(program);
+            program = 0;
+        }
+    }
+
+    if (program == 0) {
+        rejected++;
+        misses++;
+        return 0;
+    }
+
+    hits++;
+    return program;
+}
+
+void ProgramCache::Store(uint64_t key, GLuint program)
+{
+    if (!Supported())
+        return;
+
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    Header header = { { 'G', 'L', 'P', 'B' }, formatVersion, key, 0, (uint32_t) length };
+    std::vector<char> binary(length);
+    glGetProgramBinary(program, length, nullptr, &header.format, binary.data());
+
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+
+    // Write to a temporary file and rename it into place so a concurrent
+    // or interrupted run never sees a half written entry
+    std::string path = EntryPath(key);
+    std::string temporaryPath = path + ".tmp";
+    {
+        std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            std::cerr << "Failed to write program cache entry: " << path << std::endl;
+            return;
+        }
+        file.write((const char *) &header, sizeof(header));
+        file.write(binary.data(), binary.size());
+    }
+    std::filesystem::rename(temporaryPath, path, error);
+}
+
+void ProgramCache::PrintStats()
+{
+    std::cout << "Program cache: " << hits << " hits, " << misses << " misses";
+    if (rejected > 0)
+        std::cout << " (" << rejected << " stale)";
+    std::cout << std::endl;
+}
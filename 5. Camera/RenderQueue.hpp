@@ -0,0 +1,177 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "WorkerPool.hpp"
+
+// Draws recorded with a 64-bit key that says where they go in the frame,
+// then sorted by that key and submitted in order. The key puts the pass
+// first, so passes never mix, and within a pass orders by whatever saves
+// the most: opaque draws group by program and then material to keep state
+// changes down, and go front to back inside a group so early-Z rejects as
+// much as it can. Transparent draws have to go back to front, so depth
+// comes first for them.
+//
+//   opaque       pass:4 | program:12 | material:16 | depth:32
+//   transparent  pass:4 | ~depth:32  | program:12  | material:16
+//
+// Depth is the bit pattern of a non-negative float, which sorts the same
+// as the float. Sorting is an LSD radix sort over 8-bit digits that skips
+// every digit all keys agree on, so unused key bits cost nothing. Large
+// queues are sorted by every thread of the WorkerPool at once.
+namespace RenderQueue {
+    enum Pass {
+        Opaque = 0,
+        Transparent = 1
+    };
+
+    struct Item {
+        uint64_t key;
+        uint32_t value;
+    };
+
+    struct Queue {
+        std::vector<Item> items;
+        std::vector<Item> scratch;
+    };
+
+    static const uint32_t maxPrograms = 1 << 12;
+    static const uint32_t maxMaterials = 1 << 16;
+
+    static uint64_t MakeKey(Pass pass, uint32_t program, uint32_t material, float depth);
+    static void Clear(Queue &queue);
+    static void Push(Queue &queue, uint64_t key, uint32_t value);
+    static void Sort(Queue &queue);
+    static void SortItems(Item *items, Item *scratch, size_t count);
+    static uint32_t Material(uint64_t key);
+}
+
+namespace RenderQueue {
+    static const int digitBits = 8;
+    static const int digitCount = 64 / digitBits;
+    static const int bucketCount = 1 << digitBits;
+
+    // Below this a queue is sorted on the calling thread alone
+    static const size_t parallelThreshold = 1 << 16;
+
+    static uint32_t DepthBits(float depth)
+    {
+        // Anything behind the eye counts as right at it; -0.0 and NaN would
+        // otherwise sort as huge
+        if (!(depth > 0.0f))
+            return 0;
+        uint32_t bits;
+        memcpy(&bits, &depth, sizeof(bits));
+        return bits;
+    }
+}
+
+uint64_t RenderQueue::MakeKey(Pass pass, uint32_t program, uint32_t material, float depth)
+{
+    uint64_t depthBits = DepthBits(depth);
+    uint64_t state = (uint64_t) (program & (maxPrograms - 1)) << 16 | (material & (maxMaterials - 1));
+    if (pass == Transparent)
+        return (uint64_t) pass << 60 | (uint64_t) (0xffffffffu - depthBits) << 28 | state;
+    return (uint64_t) pass << 60 | state << 32 | depthBits;
+}
+
+void RenderQueue::Clear(Queue &queue)
+{
+    queue.items.clear();
+}
+
+void RenderQueue::Push(Queue &queue, uint64_t key, uint32_t value)
+{
+    queue.items.push_back({ key, value });
+}
+
+void RenderQueue::Sort(Queue &queue)
+{
+    queue.scratch.resize(queue.items.size());
+    SortItems(queue.items.data(), queue.scratch.data(), queue.items.size());
+}
+
+void RenderQueue::SortItems(Item *items, Item *scratch, size_t count)
+{
+    if (count == 0)
+        return;
+
+    // Stable, so draws with equal keys stay in the order they were pushed.
+    // The queue is cut into one slice per thread; every slice counts its
+    // own keys and writes them out after those of the slices before it
+    uint32_t sliceCount = count < parallelThreshold ? 1 : (uint32_t) WorkerPool::ThreadCount();
+    size_t sliceSize = (count + sliceCount - 1) / sliceCount;
+    std::vector<uint32_t> histograms((size_t) sliceCount * digitCount * bucketCount);
+    auto histogram = [&](uint32_t slice, int digit) {
+        return &histograms[((size_t) slice * digitCount + digit) * bucketCount];
+    };
+    auto countDigits = [&](const Item *source, int firstDigit, int lastDigit) {
+        WorkerPool::ParallelFor(sliceCount, [&](uint32_t slice) {
+            size_t end = std::min((slice + 1) * sliceSize, count);
+            for (int digit = firstDigit; digit <= lastDigit; digit++)
+                memset(histogram(slice, digit), 0, bucketCount * sizeof(uint32_t));
+            for (size_t i = slice * sliceSize; i < end; i++) {
+                uint64_t key = source[i].key;
+                for (int digit = firstDigit; digit <= lastDigit; digit++)
+                    histogram(slice, digit)[(key >> (digit * digitBits)) & (bucketCount - 1)]++;
+            }
+        });
+    };
+
+    // One pass over the keys counts every digit at once, which is enough
+    // to tell which digits need sorting at all
+    countDigits(items, 0, digitCount - 1);
+    bool sorted[digitCount];
+    for (int digit = 0; digit < digitCount; digit++) {
+        uint32_t firstBucket = (items[0].key >> (digit * digitBits)) & (bucketCount - 1);
+        size_t same = 0;
+        for (uint32_t slice = 0; slice < sliceCount; slice++)
+            same += histogram(slice, digit)[firstBucket];
+        sorted[digit] = same == count;
+    }
+
+    Item *source = items, *destination = scratch;
+    bool moved = false;
+    for (int digit = 0; digit < digitCount; digit++) {
+        if (sorted[digit])
+            continue;
+
+        // Slices only keep their counts until the first pass moves keys
+        // from one slice to another
+        if (moved && sliceCount > 1)
+            countDigits(source, digit, digit);
+
+        uint32_t offset = 0;
+        for (int bucket = 0; bucket < bucketCount; bucket++)
+            for (uint32_t slice = 0; slice < sliceCount; slice++) {
+                uint32_t size = histogram(slice, digit)[bucket];
+                histogram(slice, digit)[bucket] = offset;
+                offset += size;
+            }
+
+        uint32_t shift = digit * digitBits;
+        WorkerPool::ParallelFor(sliceCount, [&](uint32_t slice) {
+            uint32_t *offsets = histogram(slice, digit);
+            size_t end = std::min((slice + 1) * sliceSize, count);
+            for (size_t i = slice * sliceSize; i < end; i++)
+                destination[offsets[(source[i].key >> shift) & (bucketCount - 1)]++] = source[i];
+        });
+        std::swap(source, destination);
+        moved = true;
+    }
+
+    if (source != items)
+        memcpy(items, source, count * sizeof(Item));
+}
+
+uint32_t RenderQueue::Material(uint64_t key)
+{
+    // Where MakeKey() put it for the pass in the top bits
+    if ((Pass) (key >> 60) == Transparent)
+        return (uint32_t) key & (maxMaterials - 1);
+    return (uint32_t) (key >> 32) & (maxMaterials - 1);
+}
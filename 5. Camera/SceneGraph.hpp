@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "JobSystem.hpp"
+#include "TransformBatch.hpp"
+
+// Transform hierarchy with lazily updated world matrices. Every node keeps
+// its local translation, rotation and scale, in the same structure of
+// arrays TransformBatch reads, and a cached world matrix. Nodes are stored
+// flat with every parent ahead of its children, so one pass from front to
+// back sees a parent's new world matrix before any child needs it.
+//
+// Changing a node only marks it dirty. Update() carries the marks down to
+// the descendants, rebuilds the world matrices of everything marked and
+// clears the marks again. Nodes in front of the first dirty one are not
+// even looked at, and a frame where nothing moved costs nothing.
+namespace SceneGraph {
+    static const uint32_t noParent = 0xffffffff;
+
+    struct Graph {
+        std::vector<uint32_t> parent;
+        std::vector<float> positionX, positionY, positionZ;
+        std::vector<float> angle;
+        std::vector<float> axisX, axisY, axisZ;
+        std::vector<float> scaleX, scaleY, scaleZ;
+        std::vector<glm::mat4> world;
+        std::vector<uint8_t> dirty;
+        uint32_t firstDirty;
+    };
+
+    static void Create(Graph &graph, uint32_t capacity = 0);
+    static uint32_t AddNode(Graph &graph, uint32_t parent, const glm::vec3 &position, float angleDegrees,
+                            const glm::vec3 &axis, const glm::vec3 &scale);
+    static void SetPosition(Graph &graph, uint32_t node, const glm::vec3 &position);
+    static void SetRotation(Graph &graph, uint32_t node, float angleDegrees);
+    static void SetRotation(Graph &graph, uint32_t node, float angleDegrees, const glm::vec3 &axis);
+    static void SetScale(Graph &graph, uint32_t node, const glm::vec3 &scale);
+    static uint32_t Update(Graph &graph);
+    static const glm::mat4 &World(const Graph &graph, uint32_t node);
+    static uint32_t NodeCount(const Graph &graph);
+}
+
+namespace SceneGraph {
+    static void MarkDirty(Graph &graph, uint32_t node)
+    {
+        graph.dirty[node] = 1;
+        graph.firstDirty = std::min(graph.firstDirty, node);
+    }
+}
+
+void SceneGraph::Create(Graph &graph, uint32_t capacity)
+{
+    graph = Graph();
+    graph.firstDirty = 0;
+
+    graph.parent.reserve(capacity);
+    for (std::vector<float> *field : { &graph.positionX, &graph.positionY, &graph.positionZ, &graph.angle,
+                                       &graph.axisX, &graph.axisY, &graph.axisZ,
+                                       &graph.scaleX, &graph.scaleY, &graph.scaleZ })
+        field->reserve(capacity);
+    graph.world.reserve(capacity);
+    graph.dirty.reserve(capacity);
+}
+
+uint32_t SceneGraph::AddNode(Graph &graph, uint32_t parent, const glm::vec3 &position, float angleDegrees,
+                             const glm::vec3 &axis, const glm::vec3 &scale)
+{
+    // Parents have to exist already, which is what keeps the order
+    // topological without ever sorting. Anything else makes a root
+    uint32_t node = (uint32_t) graph.parent.size();
+    graph.parent.push_back(parent < node ? parent : noParent);
+    graph.positionX.push_back(position.x);
+    graph.positionY.push_back(position.y);
+    graph.positionZ.push_back(position.z);
+    graph.angle.push_back(angleDegrees);
+    graph.axisX.push_back(axis.x);
+    graph.axisY.push_back(axis.y);
+    graph.axisZ.push_back(axis.z);
+    graph.scaleX.push_back(scale.x);
+    graph.scaleY.push_back(scale.y);
+    graph.scaleZ.push_back(scale.z);
+    graph.world.emplace_back(1.0f);
+    graph.dirty.push_back(0);
+    MarkDirty(graph, node);
+    return node;
+}
+
+void SceneGraph::SetPosition(Graph &graph, uint32_t node, const glm::vec3 &position)
+{
+    graph.positionX[node] = position.x;
+    graph.positionY[node] = position.y;
+    graph.positionZ[node] = position.z;
+    MarkDirty(graph, node);
+}
+
+void SceneGraph::SetRotation(Graph &graph, uint32_t node, float angleDegrees)
+{
+    graph.angle[node] = angleDegrees;
+    MarkDirty(graph, node);
+}
+
+void SceneGraph::SetRotation(Graph &graph, uint32_t node, float angleDegrees, const glm::vec3 &axis)
+{
+    graph.axisX[node] = axis.x;
+    graph.axisY[node] = axis.y;
+    graph.axisZ[node] = axis.z;
+    SetRotation(graph, node, angleDegrees);
+}
+
+void SceneGraph::SetScale(Graph &graph, uint32_t node, const glm::vec3 &scale)
+{
+    graph.scaleX[node] = scale.x;
+    graph.scaleY[node] = scale.y;
+    graph.scaleZ[node] = scale.z;
+    MarkDirty(graph, node);
+}
+
+uint32_t SceneGraph::Update(Graph &graph)
+{
+    static const TransformBatch::Kernel kernel = TransformBatch::SelectKernel();
+    uint32_t count = NodeCount(graph);
+    if (graph.firstDirty >= count)
+        return 0;
+
+    // A node whose parent moved has moved too. Parents come first, so
+    // their mark is final by the time their children are looked at
+    uint32_t first = graph.firstDirty;
+    for (uint32_t node = first; node < count; node++) {
+        uint32_t parent = graph.parent[node];
+        if (parent != noParent && graph.dirty[parent])
+            graph.dirty[node] = 1;
+    }
+
+    // Runs of dirty nodes get their local matrices built in one go, spread
+    // over the JobSystem when long enough, straight into the world matrices.
+    // Then they are put under their parents' in order. No node needs its
+    // local matrix again, so none are kept
+    TransformBatch::Transforms transforms = {
+            graph.positionX.data(), graph.positionY.data(), graph.positionZ.data(),
+            graph.angle.data(),
+            graph.axisX.data(), graph.axisY.data(), graph.axisZ.data(),
+            graph.scaleX.data(), graph.scaleY.data(), graph.scaleZ.data()
+    };
+    uint32_t updated = 0;
+    uint32_t begin = first;
+    while (begin < count) {
+        if (!graph.dirty[begin]) {
+            begin++;
+            continue;
+        }
+
+        uint32_t end = begin + 1;
+        while (end < count && graph.dirty[end])
+            end++;
+
+        JobSystem::ParallelFor(begin, end, TransformBatch::grainSize, [&](uint32_t rangeBegin, uint32_t rangeEnd) {
+            kernel(transforms, rangeBegin, rangeEnd, graph.world.data());
+        });
+        for (uint32_t node = begin; node < end; node++) {
+            uint32_t parent = graph.parent[node];
+            if (parent != noParent)
+                graph.world[node] = graph.world[parent] * graph.world[node];
+            graph.dirty[node] = 0;
+        }
+        updated += end - begin;
+        begin = end;
+    }
+
+    graph.firstDirty = count;
+    return updated;
+}
+
+const glm::mat4 &SceneGraph::World(const Graph &graph, uint32_t node)
+{
+    return graph.world[node];
+}
+
+uint32_t SceneGraph::NodeCount(const Graph &graph)
+{
+    return (uint32_t) graph.parent.size();
+}
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <GL/glew.h>
+
+#include "ProgramCache.hpp"
+
+// Programs are built in two steps. SubmitShaderProgram() hands the sources
+// to the driver without asking for any status, so a batch of programs can
+// be submitted up front and compiled while the application does other
+// startup work (in parallel with GL_KHR_parallel_shader_compile).
+// FinishShaderProgram() checks the result when the program is first needed.
+namespace Shader {
+	struct PendingProgram {
+		GLuint program;
+		GLuint vertexShader;
+		GLuint fragmentShader;
+		uint64_t cacheKey;
+		std::string vertexPath;
+		std::string fragmentPath;
+		bool linked;
+	};
+
+	static GLuint CreateShaderProgram(const std::string &vertexPath, const std::string &fragmentPath, const std::string &defines = "");
+	static PendingProgram SubmitShaderProgram(const std::string &vertexPath, const std::string &fragmentPath, const std::string &defines = "");
+	static PendingProgram SubmitShaderSources(const std::string &vertexSource, const std::string &fragmentSource, const std::string &defines,
+	                                          const std::string &vertexPath, const std::string &fragmentPath);
+	static bool IsShaderProgramReady(const PendingProgram &pending);
+	static GLuint FinishShaderProgram(PendingProgram &pending);
+	static void DiscardShaderProgram(PendingProgram &pending);
+	static GLuint CreateComputeProgram(const std::string &computePath, const std::string &defines = "");
+	static GLuint LinkShaders(GLuint vertexShader, GLuint fragmentShader);
+	static GLuint CompileShader(GLenum shaderType, const std::string &shaderCode);
+	static bool CheckCompileStatus(GLuint shader, const std::string &shaderFilePath);
+	static bool CheckLinkStatus(GLuint program);
+	static std::string ReadShaderFile(const std::string &shaderFilePath);
+	static std::string InsertDefines(const std::string &shaderCode, const std::string &defines);
+}
+
+GLuint Shader::CreateShaderProgram(const std::string &vertexPath, const std::string &fragmentPath, const std::string &defines)
+{
+    PendingProgram pending = Shader::SubmitShaderProgram(vertexPath, fragmentPath, defines);
+    return Shader::FinishShaderProgram(pending);
+}
+
+Shader::PendingProgram Shader::SubmitShaderProgram(const std::string &vertexPath, const std::string &fragmentPath, const std::string &defines)
+{
+    return Shader::SubmitShaderSources(Shader::ReadShaderFile(vertexPath), Shader::ReadShaderFile(fragmentPath), defines,
+                                       vertexPath, fragmentPath);
+}
+
+Shader::PendingProgram Shader::SubmitShaderSources(const std::string &vertexCode, const std::string &fragmentCode, const std::string &defines,
+                                                   const std::string &vertexPath, const std::string &fragmentPath)
+{
+    // Let the driver use as many compiler threads as it likes
+    static bool parallelCompileEnabled = false;
+    if (!parallelCompileEnabled && GLEW_KHR_parallel_shader_compile) {
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+        parallelCompileEnabled = true;
+    }
+
+    PendingProgram pending = { 0, 0, 0, 0, vertexPath, fragmentPath, false };
+
+    std::string vertexSource    = Shader::InsertDefines(vertexCode, defines);
+    std::string fragmentSource  = Shader::InsertDefines(fragmentCode, defines);
+
+    // The defines are part of both sources already, the key hashes them
+    // separately anyway so the key says what it covers
+    pending.cacheKey = ProgramCache::Key({ vertexSource, fragmentSource, defines });
+    pending.program = ProgramCache::Load(pending.cacheKey);
+    if (pending.program != 0) {
+        pending.linked = true;
+        return pending;
+    }
+
+    pending.vertexShader    = Shader::CompileShader(GL_VERTEX_SHADER, vertexSource);
+    pending.fragmentShader  = Shader::CompileShader(GL_FRAGMENT_SHADER, fragmentSource);
+
+    pending.program = Shader::LinkShaders(pending.vertexShader, pending.fragmentShader);
+
+    return pending;
+}
+
+bool Shader::IsShaderProgramReady(const PendingProgram &pending)
+{
+    // Without the extension there is no way to ask, and every status query
+    // blocks, so the program counts as ready
+    if (pending.vertexShader == 0 || !GLEW_KHR_parallel_shader_compile)
+        return true;
+
+    int completed;
+    glGetProgramiv(pending.program, GL_COMPLETION_STATUS_KHR, &completed);
+    return completed;
+}
+
+GLuint Shader::FinishShaderProgram(PendingProgram &pending)
+{
+    // Programs loaded from the cache were already validated
+    if (pending.vertexShader == 0)
+        return pending.program;
+
+    // These block until the driver is done with the shader or program
+    bool success = Shader::CheckCompileStatus(pending.vertexShader, pending.vertexPath);
+    success = Shader::CheckCompileStatus(pending.fragmentShader, pending.fragmentPath) && success;
+    success = success && Shader::CheckLinkStatus(pending.program);
+
+    glDeleteShader(pending.vertexShader);
+    glDeleteShader(pending.fragmentShader);
+    pending.vertexShader = 0;
+    pending.fragmentShader = 0;
+
+    pending.linked = success;
+    if (success)
+        ProgramCache::Store(pending.cacheKey, pending.program);
+
+    return pending.program;
+}
+
+void Shader::DiscardShaderProgram(PendingProgram &pending)
+{
+    // Nothing asks how the compile went, so nothing waits for it either.
+    // Deleting shader 0 is ignored, which covers cached programs
+    glDeleteShader(pending.vertexShader);
+    glDeleteShader(pending.fragmentShader);
+    glDeleteProgram(pending.program);
+    pending = { 0, 0, 0, 0, pending.vertexPath, pending.fragmentPath, false };
+}
+
+GLuint Shader::CreateComputeProgram(const std::string &computePath, const std::string &defines)
+{
+    // Only used for a handful of startup programs, so compiled right away.
+    // Returns 0 when the shader doesn't build
+    std::string computeSource = Shader::InsertDefines(Shader::ReadShaderFile(computePath), defines);
+
+    uint64_t cacheKey = ProgramCache::Key({ computeSource, defines });
+    GLuint program = ProgramCache::Load(cacheKey);
+    if (program != 0)
+        return program;
+
+    GLuint computeShader = Shader::CompileShader(GL_COMPUTE_SHADER, computeSource);
+    program = glCreateProgram();
+    glAttachShader(program, computeShader);
+    if (ProgramCache::Supported())
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program);
+
+    bool success = Shader::CheckCompileStatus(computeShader, computePath) && Shader::CheckLinkStatus(program);
+    glDeleteShader(computeShader);
+    if (!success) {
+        glDeleteProgram(program);
+        return 0;
+    }
+
+    ProgramCache::Store(cacheKey, program);
+    return program;
+}
+
+GLuint Shader::LinkShaders(GLuint vertexShader, GLuint fragmentShader)
+{
+    GLuint programID = glCreateProgram();
+    glAttachShader(programID, vertexShader);
+    glAttachShader(programID, fragmentShader);
+
+    // Some drivers only keep a retrievable binary around when asked before linking
+    if (ProgramCache::Supported())
+        glProgramParameteri(programID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(programID);
+
+    return programID;
+}
+
+GLuint Shader::CompileShader(GLenum shaderType, const std::string &shaderCode)
+{
+    GLuint shaderID = glCreateShader(shaderType);
+    const char *shaderCodeStr = shaderCode.c_str();
+
+    glShaderSource(shaderID, 1, &shaderCodeStr, nullptr);
+    glCompileShader(shaderID);
+
+    return shaderID;
+}
+
+bool Shader::CheckCompileStatus(GLuint shader, const std::string &shaderFilePath)
+{
+    int success;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        char infoLog[512];
+        glGetShaderInfoLog(shader, 512, nullptr, infoLog);
+        std::cerr << "Shader compilation error in " << shaderFilePath << ": " << infoLog << std::endl;
+    }
+    return success;
+}
+
+bool Shader::CheckLinkStatus(GLuint program)
+{
+    int success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success) {
+        char infoLog[512];
+        glGetProgramInfoLog(program, 512, nullptr, infoLog);
+        std::cerr << "Shader program linking error: " << infoLog << std::endl;
+    }
+    return success;
+}
+
+std::string Shader::ReadShaderFile(const std::string &shaderFilePath)
+{
+    std::ifstream shaderFile(shaderFilePath);
+    if (!shaderFile.is_open()) {
+        std::cerr << "Failed to open shader file: " << shaderFilePath << std::endl;
+        return "";
+    }
+
+    std::stringstream shaderStream;
+    shaderStream << shaderFile.rdbuf();
+    shaderFile.close();
+
+    return shaderStream.str();
+}
+
+std::string Shader::InsertDefines(const std::string &shaderCode, const std::string &defines)
+{
+    if (defines.empty())
+        return shaderCode;
+
+    // #version has to stay the first line, the defines go right after it
+    size_t versionEnd = 0;
+    if (shaderCode.compare(0, 8, "#version") == 0) {
+        versionEnd = shaderCode.find('\n');
+        versionEnd = versionEnd == std::string::npos ? shaderCode.size() : versionEnd + 1;
+    }
+
+    std::string result = shaderCode.substr(0, versionEnd);
+    if (!result.empty() && result.back() != '\n')
+        result += '\n';
+    result += defines;
+    if (result.back() != '\n')
+        result += '\n';
+    result += shaderCode.substr(versionEnd);
+    return result;
+}
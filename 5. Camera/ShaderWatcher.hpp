@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "Shader.hpp"
+#include "SpscQueue.hpp"
+
+// Watches shader files with inotify on a background thread. When one is
+// saved the thread reads it with Shader::ReadShaderFile and queues the new
+// source, so the render thread never touches the file system and only has
+// to compile. Directories are watched rather than the files themselves
+// because most editors save by writing a new file and renaming it over the
+// old one, which would silently end a watch on the file.
+namespace ShaderWatcher {
+    struct Change {
+        std::string path;
+        std::string source;
+    };
+
+    static bool Start(const std::vector<std::string> &paths);
+    static bool Poll(Change &change);
+    static void Stop();
+}
+
+namespace ShaderWatcher {
+    struct WatchedFile {
+        std::string path;
+        std::string directory;
+        std::string name;
+        int watch;
+    };
+
+    static int inotifyFd = -1;
+    static std::vector<WatchedFile> watchedFiles;
+    static std::thread watchThread;
+    static std::atomic<bool> running{false};
+    static SpscQueue<Change, 16> changes;
+
+    static void WatchLoop();
+}
+
+bool ShaderWatcher::Start(const std::vector<std::string> &paths)
+{
+    inotifyFd = inotify_init1(IN_CLOEXEC);
+    if (inotifyFd < 0) {
+        std::cerr << "Failed to initialize inotify, shader hot-reload is off" << std::endl;
+        return false;
+    }
+
+    for (const std::string &path : paths) {
+        size_t slash = path.find_last_of('/');
+        WatchedFile file;
+        file.path = path;
+        file.directory = slash == std::string::npos ? "." : path.substr(0, slash);
+        file.name = slash == std::string::npos ? path : path.substr(slash + 1);
+
+        // Watching the same directory twice returns the same descriptor
+        file.watch = inotify_add_watch(inotifyFd, file.directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (file.watch < 0) {
+            std::cerr << "Failed to watch shader file: " << path << std::endl;
+            continue;
+        }
+        watchedFiles.push_back(file);
+    }
+
+    running = true;
+    watchThread = std::thread(WatchLoop);
+    return true;
+}
+
+bool ShaderWatcher::Poll(Change &change)
+{
+    return changes.TryPop(change);
+}
+
+void ShaderWatcher::Stop()
+{
+    if (!running)
+        return;
+
+    running = false;
+    watchThread.join();
+    close(inotifyFd);
+    inotifyFd = -1;
+    watchedFiles.clear();
+}
+
+void ShaderWatcher::WatchLoop()
+{
+    alignas(inotify_event) char buffer[4096];
+    std::vector<bool> changed(watchedFiles.size());
+
+    while (running) {
+        // Wake up regularly to notice Stop()
+        pollfd descriptor = { inotifyFd, POLLIN, 0 };
+        if (poll(&descriptor, 1, 100) <= 0)
+            continue;
+
+        ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+        if (length <= 0)
+            continue;
+
+        // One save can produce several events, only read each file once
+        std::fill(changed.begin(), changed.end(), false);
+        for (char *pointer = buffer; pointer < buffer + length; ) {
+            const inotify_event *event = (const inotify_event *) pointer;
+            pointer += sizeof(inotify_event) + event->len;
+
+            if (event->len == 0)
+                continue;
+            for (size_t i = 0; i < watchedFiles.size(); i++)
+                if (watchedFiles[i].watch == event->wd && watchedFiles[i].name == event->name)
+                    changed[i] = true;
+        }
+
+        for (size_t i = 0; i < watchedFiles.size(); i++) {
+            if (!changed[i])
+                continue;
+
+            Change change = { watchedFiles[i].path, Shader::ReadShaderFile(watchedFiles[i].path) };
+            if (change.source.empty())
+                continue;
+
+            // The render thread drains the queue every frame, so it only
+            // fills up if it is stuck. The next save will try again
+            if (!changes.TryPush(std::move(change)))
+                std::cerr << "Shader reload queue full, dropped " << watchedFiles[i].path << std::endl;
+        }
+    }
+}
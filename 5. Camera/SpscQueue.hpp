@@ -0,0 +1,60 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Each side owns one index and only reads the other's, so a push or
+// pop is a couple of loads and one release store. Capacity must be a power
+// of two; one slot is kept free to tell a full queue from an empty one.
+template <typename T, size_t Capacity>
+class SpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "SpscQueue capacity must be a power of two");
+
+public:
+    bool TryPush(T &&value);
+    bool TryPop(T &value);
+    bool Empty() const;
+
+private:
+    static const size_t mask = Capacity - 1;
+
+    // Producer and consumer indices live on separate cache lines so the
+    // two threads don't keep stealing the line from each other
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) std::array<T, Capacity> slots;
+};
+
+template <typename T, size_t Capacity>
+bool SpscQueue<T, Capacity>::TryPush(T &&value)
+{
+    size_t currentTail = tail.load(std::memory_order_relaxed);
+    size_t nextTail = (currentTail + 1) & mask;
+    if (nextTail == head.load(std::memory_order_acquire))
+        return false;
+
+    slots[currentTail] = std::move(value);
+    tail.store(nextTail, std::memory_order_release);
+    return true;
+}
+
+template <typename T, size_t Capacity>
+bool SpscQueue<T, Capacity>::TryPop(T &value)
+{
+    size_t currentHead = head.load(std::memory_order_relaxed);
+    if (currentHead == tail.load(std::memory_order_acquire))
+        return false;
+
+    value = std::move(slots[currentHead]);
+    head.store((currentHead + 1) & mask, std::memory_order_release);
+    return true;
+}
+
+template <typename T, size_t Capacity>
+bool SpscQueue<T, Capacity>::Empty() const
+{
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+}
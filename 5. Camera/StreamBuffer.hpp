@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+
+#include <GL/glew.h>
+
+#include "GlState.hpp"
+
+// Ring of per-frame regions in one buffer object for data that changes
+// every frame (instance transforms, particles, debug lines...). The CPU
+// writes region N while the GPU may still be reading N-1 and N-2; a fence
+// per region makes sure a region is only reused once the GPU is done with
+// it, so writes never stall the driver or pay for glBufferData orphaning.
+//
+// With ARB_buffer_storage the whole buffer is mapped once, persistently
+// and coherently. Without it each region is mapped with
+// GL_MAP_UNSYNCHRONIZED_BIT, which is safe because of the same fences.
+namespace StreamBuffer {
+    static const int regionCount = 3;
+
+    struct Buffer {
+        GLuint buffer;
+        GLenum target;
+        GLsizeiptr regionSize;
+        int region;
+        bool persistent;
+        uint8_t *persistentPointer;
+        GLsync fences[regionCount];
+        uint64_t stalls;
+    };
+
+    static void Create(Buffer &buffer, GLenum target, GLsizeiptr size, bool allowPersistent = true);
+    static void *Map(Buffer &buffer, GLintptr *offset);
+    static void Unmap(Buffer &buffer);
+    static void Fence(Buffer &buffer);
+    static void Destroy(Buffer &buffer);
+}
+
+void StreamBuffer::Create(Buffer &buffer, GLenum target, GLsizeiptr size, bool allowPersistent)
+{
+    // Region offsets have to work for uniform and storage buffer bindings
+    // too, 256 bytes covers every implementation's offset alignment
+    const GLsizeiptr alignment = 256;
+
+    buffer.target = target;
+    buffer.regionSize = (size + alignment - 1) / alignment * alignment;
+    buffer.region = 0;
+    buffer.persistent = allowPersistent && (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage);
+    buffer.persistentPointer = nullptr;
+    buffer.stalls = 0;
+    for (GLsync &fence : buffer.fences)
+        fence = nullptr;
+
+    glGenBuffers(1, &buffer.buffer);
+    GlState::BindBuffer(target, buffer.buffer);
+
+    GLsizeiptr totalSize = buffer.regionSize * regionCount;
+    if (buffer.persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(target, totalSize, nullptr, flags);
+        buffer.persistentPointer = (uint8_t *) glMapBufferRange(target, 0, totalSize, flags);
+    } else {
+        glBufferData(target, totalSize, nullptr, GL_STREAM_DRAW);
+    }
+}
+
+void *StreamBuffer::Map(Buffer &buffer, GLintptr *offset)
+{
+    // Only wait if the GPU is still reading this region from regionCount
+    // frames ago, which means it is more than two frames behind
+    GLsync &fence = buffer.fences[buffer.region];
+    if (fence != nullptr) {
+        if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+            buffer.stalls++;
+            glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        }
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+
+    *offset = buffer.region * buffer.regionSize;
+    if (buffer.persistent)
+        return buffer.persistentPointer + *offset;
+
+    GlState::BindBuffer(buffer.target, buffer.buffer);
+    return glMapBufferRange(buffer.target, *offset, buffer.regionSize,
+                            GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+}
+
+void StreamBuffer::Unmap(Buffer &buffer)
+{
+    // Coherent persistent mappings need no flush or unmap
+    if (buffer.persistent)
+        return;
+
+    GlState::BindBuffer(buffer.target, buffer.buffer);
+    glUnmapBuffer(buffer.target);
+}
+
+void StreamBuffer::Fence(Buffer &buffer)
+{
+    // Call after the last draw reading the current region was issued
+    buffer.fences[buffer.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    buffer.region = (buffer.region + 1) % regionCount;
+}
+
+void StreamBuffer::Destroy(Buffer &buffer)
+{
+    for (GLsync &fence : buffer.fences) {
+        if (fence != nullptr)
+            glDeleteSync(fence);
+        fence = nullptr;
+    }
+
+    if (buffer.persistent) {
+        GlState::BindBuffer(buffer.target, buffer.buffer);
+        glUnmapBuffer(buffer.target);
+    }
+    GlState::DeleteBuffers(1, &buffer.buffer);
+    buffer.buffer = 0;
+}
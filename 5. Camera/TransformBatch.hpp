@@ -0,0 +1,345 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+
+#include <glm/glm.hpp>
+
+#include "JobSystem.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TRANSFORM_BATCH_X86 1
+#endif
+
+// Batched version of CoordinateSystem::ModelMatrix for many objects at once.
+// Translation, rotation and scale are fused into a single pass that writes
+// the final matrix directly, instead of three full matrix products per
+// object. Inputs are structure of arrays so 4 (SSE) or 8 (AVX2) objects are
+// built per iteration; the widest kernel the CPU supports is picked at
+// runtime, with a scalar fallback everywhere else. Large batches are split
+// across the JobSystem's threads.
+namespace TransformBatch {
+    struct Transforms {
+        const float *positionX;
+        const float *positionY;
+        const float *positionZ;
+        const float *angleDegrees;
+        const float *axisX;
+        const float *axisY;
+        const float *axisZ;
+        const float *scaleX;
+        const float *scaleY;
+        const float *scaleZ;
+    };
+
+    typedef void (*Kernel)(const Transforms &transforms, size_t begin, size_t end, glm::mat4 *matrices);
+
+    static void ModelMatrices(const Transforms &transforms, size_t count, glm::mat4 *matrices);
+    static void ModelMatricesScalar(const Transforms &transforms, size_t begin, size_t end, glm::mat4 *matrices);
+#ifdef TRANSFORM_BATCH_X86
+    static void ModelMatricesSSE(const Transforms &transforms, size_t begin, size_t end, glm::mat4 *matrices);
+    static void ModelMatricesAVX2(const Transforms &transforms, size_t begin, size_t end, glm::mat4 *matrices);
+#endif
+    static Kernel SelectKernel(const char **name = nullptr);
+}
+
+namespace TransformBatch {
+    // Matrices per job, 256 KB of output
+    static const uint32_t grainSize = 4096;
+}
+
+void TransformBatch::ModelMatrices(const Transforms &transforms, size_t count, glm::mat4 *matrices)
+{
+    static const Kernel kernel = SelectKernel();
+    JobSystem::ParallelFor(0, (uint32_t) count, grainSize, [&](uint32_t begin, uint32_t end) {
+        kernel(transforms, begin, end, matrices);
+    });
+}
+
+TransformBatch::Kernel TransformBatch::SelectKernel(const char **name)
+{
+#ifdef TRANSFORM_BATCH_X86
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        if (name != nullptr)
+            *name = "avx2";
+        return ModelMatricesAVX2;
+    }
+
+    // SSE2 is part of x86-64, so this kernel is always available there
+    if (name != nullptr)
+        *name = "sse";
+    return ModelMatricesSSE;
+#else
+    if (name != nullptr)
+        *name = "scalar";
+    return ModelMatricesScalar;
+#endif
+}
+
+void TransformBatch::ModelMatricesScalar(const Transforms &transforms, size_t begin, size_t end, glm::mat4 *matrices)
+{
+    for (size_t i = begin; i < end; i++) {
+        float angleRadians = glm::radians(transforms.angleDegrees[i]);
+        float c = cosf(angleRadians);
+        float s = sinf(angleRadians);
+        float t = 1.0f - c;
+
+        float inverseLength = 1.0f / sqrtf(transforms.axisX[i] * transforms.axisX[i] +
+                                           transforms.axisY[i] * transforms.axisY[i] +
+                                           transforms.axisZ[i] * transforms.axisZ[i]);
+        float x = transforms.axisX[i] * inverseLength;
+        float y = transforms.axisY[i] * inverseLength;
+        float z = transforms.axisZ[i] * inverseLength;
+
+        float sx = transforms.scaleX[i];
+        float sy = transforms.scaleY[i];
+        float sz = transforms.scaleZ[i];
+
+        // Same rotation convention as Transformation::Rotation, with the
+        // scale folded into the columns and the translation in the last one
+        glm::mat4 &m = matrices[i];
+        m[0] = glm::vec4((c + x * x * t) * sx, (x * y * t - z * s) * sx, (x * z * t + y * s) * sx, 0.0f);
+        m[1] = glm::vec4((y * x * t + z * s) * sy, (c + y * y * t) * sy, (y * z * t - x * s) * sy, 0.0f);
+        m[2] = glm::vec4((z * x * t - y * s) * sz, (z * y * t + x * s) * sz, (c + z * z * t) * sz, 0.0f);
+        m[3] = glm::vec4(transforms.positionX[i], transforms.positionY[i], transforms.positionZ[i], 1.0f);
+    }
+}
+
+#ifdef TRANSFORM_BATCH_X86
+
+// sincos on 4/8 lanes. The angle is reduced to [-pi/4, pi/4] around the
+// nearest multiple of pi/2 (Cody-Waite, three parts), then the Cephes
+// minimax polynomials are evaluated and sin/cos swapped and negated based
+// on the quadrant. Absolute error is around 1e-7 for angles of a few
+// thousand radians, which is plenty for transforms.
+namespace TransformBatch {
+    static const float twoOverPi = 0.636619772367581343f;
+    static const float piOverTwo1 = 1.5703125f;
+    static const float piOverTwo2 = 4.837512969970703125e-4f;
+    static const float piOverTwo3 = 7.54978995489188216e-8f;
+
+    static const float sinCoefficient0 = -1.9515295891e-4f;
+    static const float sinCoefficient1 = 8.3321608736e-3f;
+    static const float sinCoefficient2 = -1.6666654611e-1f;
+    static const float cosCoefficient0 = 2.443315711809948e-5f;
+    static const float cosCoefficient1 = -1.388731625493765e-3f;
+    static const float cosCoefficient2 = 4.166664568298827e-2f;
+
+    static void SinCos(__m128 angle, __m128 *sine, __m128 *cosine);
+    static void SinCos(__m256 angle, __m256 *sine, __m256 *cosine);
+    static void StoreMatrices(__m128 columns[4][4], glm::mat4 *matrices);
+    static void StoreMatrices(__m256 columns[4][4], glm::mat4 *matrices);
+}
+
+void TransformBatch::SinCos(__m128 angle, __m128 *sine, __m128 *cosine)
+{
+    __m128i quadrant = _mm_cvtps_epi32(_mm_mul_ps(angle, _mm_set1_ps(twoOverPi)));
+    __m128 q = _mm_cvtepi32_ps(quadrant);
+
+    __m128 r = _mm_sub_ps(angle, _mm_mul_ps(q, _mm_set1_ps(piOverTwo1)));
+    r = _mm_sub_ps(r, _mm_mul_ps(q, _mm_set1_ps(piOverTwo2)));
+    r = _mm_sub_ps(r, _mm_mul_ps(q, _mm_set1_ps(piOverTwo3)));
+    __m128 r2 = _mm_mul_ps(r, r);
+
+    __m128 s = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(sinCoefficient0), r2), _mm_set1_ps(sinCoefficient1));
+    s = _mm_add_ps(_mm_mul_ps(s, r2), _mm_set1_ps(sinCoefficient2));
+    s = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(s, r2), r), r);
+
+    __m128 c = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(cosCoefficient0), r2), _mm_set1_ps(cosCoefficient1));
+    c = _mm_add_ps(_mm_mul_ps(c, r2), _mm_set1_ps(cosCoefficient2));
+    c = _mm_mul_ps(_mm_mul_ps(c, r2), r2);
+    c = _mm_add_ps(_mm_sub_ps(c, _mm_mul_ps(r2, _mm_set1_ps(0.5f))), _mm_set1_ps(1.0f));
+
+    // Odd quadrants swap sin and cos, quadrants 2 and 3 negate sin, 1 and 2
+    // negate cos
+    __m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(quadrant, _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+    __m128 sinSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(quadrant, _mm_set1_epi32(2)), 30));
+    __m128 cosSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(quadrant, _mm_set1_epi32(1)), _mm_set1_epi32(2)), 30));
+
+    __m128 sinResult = _mm_or_ps(_mm_and_ps(swap, c), _mm_andnot_ps(swap, s));
+    __m128 cosResult = _mm_or_ps(_mm_and_ps(swap, s), _mm_andnot_ps(swap, c));
+    *sine = _mm_xor_ps(sinResult, sinSign);
+    *cosine = _mm_xor_ps(cosResult, cosSign);
+}
+
+__attribute__((target("avx2,fma")))
+void TransformBatch::SinCos(__m256 angle, __m256 *sine, __m256 *cosine)
+{
+    __m256i quadrant = _mm256_cvtps_epi32(_mm256_mul_ps(angle, _mm256_set1_ps(twoOverPi)));
+    __m256 q = _mm256_cvtepi32_ps(quadrant);
+
+    __m256 r = _mm256_fnmadd_ps(q, _mm256_set1_ps(piOverTwo1), angle);
+    r = _mm256_fnmadd_ps(q, _mm256_set1_ps(piOverTwo2), r);
+    r = _mm256_fnmadd_ps(q, _mm256_set1_ps(piOverTwo3), r);
+    __m256 r2 = _mm256_mul_ps(r, r);
+
+    __m256 s = _mm256_fmadd_ps(_mm256_set1_ps(sinCoefficient0), r2, _mm256_set1_ps(sinCoefficient1));
+    s = _mm256_fmadd_ps(s, r2, _mm256_set1_ps(sinCoefficient2));
+    s = _mm256_fmadd_ps(_mm256_mul_ps(s, r2), r, r);
+
+    __m256 c = _mm256_fmadd_ps(_mm256_set1_ps(cosCoefficient0), r2, _mm256_set1_ps(cosCoefficient1));
+    c = _mm256_fmadd_ps(c, r2, _mm256_set1_ps(cosCoefficient2));
+    c = _mm256_mul_ps(_mm256_mul_ps(c, r2), r2);
+    c = _mm256_add_ps(_mm256_fnmadd_ps(r2, _mm256_set1_ps(0.5f), c), _mm256_set1_ps(1.0f));
+
+    __m256 swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(quadrant, _mm256_set1_epi32(1)), _mm256_set1_epi32(1)));
+    __m256 sinSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(quadrant, _mm256_set1_epi32(2)), 30));
+    __m256 cosSign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(quadrant, _mm256_set1_epi32(1)), _mm256_set1_epi32(2)), 30));
+
+    *sine = _mm256_xor_ps(_mm256_blendv_ps(s, c, swap), sinSign);
+    *cosine = _mm256_xor_ps(_mm256_blendv_ps(c, s, swap), cosSign);
+}
+
+// columns[column][row] holds that element for every lane. Each column is
+// transposed so lane i becomes one glm::vec4 of matrix i
+void TransformBatch::StoreMatrices(__m128 columns[4][4], glm::mat4 *matrices)
+{
+    for (int column = 0; column < 4; column++) {
+        __m128 r0 = columns[column][0];
+        __m128 r1 = columns[column][1];
+        __m128 r2 = columns[column][2];
+        __m128 r3 = columns[column][3];
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+        _mm_storeu_ps(&matrices[0][column][0], r0);
+        _mm_storeu_ps(&matrices[1][column][0], r1);
+        _mm_storeu_ps(&matrices[2][column][0], r2);
+        _mm_storeu_ps(&matrices[3][column][0], r3);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void TransformBatch::StoreMatrices(__m256 columns[4][4], glm::mat4 *matrices)
+{
+    // After the in-lane transpose, vectors[column][k] holds column 'column'
+    // of matrix k in the low half and of matrix k + 4 in the high half
+    __m256 vectors[4][4];
+    for (int column = 0; column < 4; column++) {
+        __m256 t0 = _mm256_unpacklo_ps(columns[column][0], columns[column][1]);
+        __m256 t1 = _mm256_unpackhi_ps(columns[column][0], columns[column][1]);
+        __m256 t2 = _mm256_unpacklo_ps(columns[column][2], columns[column][3]);
+        __m256 t3 = _mm256_unpackhi_ps(columns[column][2], columns[column][3]);
+
+        vectors[column][0] = _mm256_shuffle_ps(t0, t2, 0x44);
+        vectors[column][1] = _mm256_shuffle_ps(t0, t2, 0xEE);
+        vectors[column][2] = _mm256_shuffle_ps(t1, t3, 0x44);
+        vectors[column][3] = _mm256_shuffle_ps(t1, t3, 0xEE);
+    }
+
+    // Two columns of the same matrix make one 32 byte store
+    for (int k = 0; k < 4; k++) {
+        float *low = &matrices[k][0][0];
+        float *high = &matrices[k + 4][0][0];
+
+        _mm256_storeu_ps(low, _mm256_permute2f128_ps(vectors[0][k], vectors[1][k], 0x20));
+        _mm256_storeu_ps(low + 8, _mm256_permute2f128_ps(vectors[2][k], vectors[3][k], 0x20));
+        _mm256_storeu_ps(high, _mm256_permute2f128_ps(vectors[0][k], vectors[1][k], 0x31));
+        _mm256_storeu_ps(high + 8, _mm256_permute2f128_ps(vectors[2][k], vectors[3][k], 0x31));
+    }
+}
+
+void TransformBatch::ModelMatricesSSE(const Transforms &transforms, size_t begin, size_t end, glm::mat4 *matrices)
+{
+    const __m128 degreesToRadians = _mm_set1_ps(0.01745329251994329577f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 zero = _mm_setzero_ps();
+
+    size_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 s, c;
+        SinCos(_mm_mul_ps(_mm_loadu_ps(transforms.angleDegrees + i), degreesToRadians), &s, &c);
+        __m128 t = _mm_sub_ps(one, c);
+
+        __m128 x = _mm_loadu_ps(transforms.axisX + i);
+        __m128 y = _mm_loadu_ps(transforms.axisY + i);
+        __m128 z = _mm_loadu_ps(transforms.axisZ + i);
+
+        // rsqrt estimate plus one Newton-Raphson step
+        __m128 lengthSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+        __m128 estimate = _mm_rsqrt_ps(lengthSquared);
+        __m128 inverseLength = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), estimate),
+                                          _mm_sub_ps(_mm_set1_ps(3.0f), _mm_mul_ps(_mm_mul_ps(lengthSquared, estimate), estimate)));
+        x = _mm_mul_ps(x, inverseLength);
+        y = _mm_mul_ps(y, inverseLength);
+        z = _mm_mul_ps(z, inverseLength);
+
+        __m128 sx = _mm_loadu_ps(transforms.scaleX + i);
+        __m128 sy = _mm_loadu_ps(transforms.scaleY + i);
+        __m128 sz = _mm_loadu_ps(transforms.scaleZ + i);
+
+        __m128 xt = _mm_mul_ps(x, t);
+        __m128 yt = _mm_mul_ps(y, t);
+        __m128 zt = _mm_mul_ps(z, t);
+        __m128 xs = _mm_mul_ps(x, s);
+        __m128 ys = _mm_mul_ps(y, s);
+        __m128 zs = _mm_mul_ps(z, s);
+        __m128 xyt = _mm_mul_ps(xt, y);
+        __m128 xzt = _mm_mul_ps(xt, z);
+        __m128 yzt = _mm_mul_ps(yt, z);
+
+        __m128 columns[4][4] = {
+                { _mm_mul_ps(_mm_add_ps(c, _mm_mul_ps(xt, x)), sx), _mm_mul_ps(_mm_sub_ps(xyt, zs), sx), _mm_mul_ps(_mm_add_ps(xzt, ys), sx), zero },
+                { _mm_mul_ps(_mm_add_ps(xyt, zs), sy), _mm_mul_ps(_mm_add_ps(c, _mm_mul_ps(yt, y)), sy), _mm_mul_ps(_mm_sub_ps(yzt, xs), sy), zero },
+                { _mm_mul_ps(_mm_sub_ps(xzt, ys), sz), _mm_mul_ps(_mm_add_ps(yzt, xs), sz), _mm_mul_ps(_mm_add_ps(c, _mm_mul_ps(zt, z)), sz), zero },
+                { _mm_loadu_ps(transforms.positionX + i), _mm_loadu_ps(transforms.positionY + i), _mm_loadu_ps(transforms.positionZ + i), one }
+        };
+        StoreMatrices(columns, matrices + i);
+    }
+
+    ModelMatricesScalar(transforms, i, end, matrices);
+}
+
+__attribute__((target("avx2,fma")))
+void TransformBatch::ModelMatricesAVX2(const Transforms &transforms, size_t begin, size_t end, glm::mat4 *matrices)
+{
+    const __m256 degreesToRadians = _mm256_set1_ps(0.01745329251994329577f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 zero = _mm256_setzero_ps();
+
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 s, c;
+        SinCos(_mm256_mul_ps(_mm256_loadu_ps(transforms.angleDegrees + i), degreesToRadians), &s, &c);
+        __m256 t = _mm256_sub_ps(one, c);
+
+        __m256 x = _mm256_loadu_ps(transforms.axisX + i);
+        __m256 y = _mm256_loadu_ps(transforms.axisY + i);
+        __m256 z = _mm256_loadu_ps(transforms.axisZ + i);
+
+        __m256 lengthSquared = _mm256_fmadd_ps(z, z, _mm256_fmadd_ps(y, y, _mm256_mul_ps(x, x)));
+        __m256 estimate = _mm256_rsqrt_ps(lengthSquared);
+        __m256 inverseLength = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), estimate),
+                                             _mm256_fnmadd_ps(_mm256_mul_ps(lengthSquared, estimate), estimate, _mm256_set1_ps(3.0f)));
+        x = _mm256_mul_ps(x, inverseLength);
+        y = _mm256_mul_ps(y, inverseLength);
+        z = _mm256_mul_ps(z, inverseLength);
+
+        __m256 sx = _mm256_loadu_ps(transforms.scaleX + i);
+        __m256 sy = _mm256_loadu_ps(transforms.scaleY + i);
+        __m256 sz = _mm256_loadu_ps(transforms.scaleZ + i);
+
+        __m256 xt = _mm256_mul_ps(x, t);
+        __m256 yt = _mm256_mul_ps(y, t);
+        __m256 zt = _mm256_mul_ps(z, t);
+        __m256 xs = _mm256_mul_ps(x, s);
+        __m256 ys = _mm256_mul_ps(y, s);
+        __m256 zs = _mm256_mul_ps(z, s);
+        __m256 xyt = _mm256_mul_ps(xt, y);
+        __m256 xzt = _mm256_mul_ps(xt, z);
+        __m256 yzt = _mm256_mul_ps(yt, z);
+
+        __m256 columns[4][4] = {
+                { _mm256_mul_ps(_mm256_fmadd_ps(xt, x, c), sx), _mm256_mul_ps(_mm256_sub_ps(xyt, zs), sx), _mm256_mul_ps(_mm256_add_ps(xzt, ys), sx), zero },
+                { _mm256_mul_ps(_mm256_add_ps(xyt, zs), sy), _mm256_mul_ps(_mm256_fmadd_ps(yt, y, c), sy), _mm256_mul_ps(_mm256_sub_ps(yzt, xs), sy), zero },
+                { _mm256_mul_ps(_mm256_sub_ps(xzt, ys), sz), _mm256_mul_ps(_mm256_add_ps(yzt, xs), sz), _mm256_mul_ps(_mm256_fmadd_ps(zt, z, c), sz), zero },
+                { _mm256_loadu_ps(transforms.positionX + i), _mm256_loadu_ps(transforms.positionY + i), _mm256_loadu_ps(transforms.positionZ + i), one }
+        };
+        StoreMatrices(columns, matrices + i);
+    }
+
+    // Leftovers go through the 4 wide kernel first, then the scalar one
+    ModelMatricesSSE(transforms, i, end, matrices);
+}
+
+#endif
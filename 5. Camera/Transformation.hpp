@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+namespace Transformation {
+    static glm::mat4 Translation(glm::mat4 const &matrix, glm::vec3 const &position);
+    static glm::mat4 Rotation(glm::mat4 const &matrix, float angleDegrees, glm::vec3 const &axis);
+    static glm::mat4 Scaling(glm::mat4 const &matrix, glm::vec3 const &scale);
+}
+
+glm::mat4 Transformation::Translation(const glm::mat4 &matrix, const glm::vec3 &position)
+{
+    glm::mat4 translationMatrix(1.0f);
+
+    translationMatrix[3] =  matrix[0] * position[0] +
+                            matrix[1] * position[1] +
+                            matrix[2] * position[2] +
+                            matrix[3];
+
+    return translationMatrix;
+}
+
+glm::mat4 Transformation::Rotation(glm::mat4 const &matrix, float angleDegrees, glm::vec3 const &axis)
+{
+    float angleRadians = glm::radians(angleDegrees);
+    float cosA = cosf(angleRadians);
+    float sinA = sinf(angleRadians);
+    glm::vec3 normalizedAxis = glm::normalize(axis);
+
+    float x = normalizedAxis.x;
+    float y = normalizedAxis.y;
+    float z = normalizedAxis.z;
+
+    float oneMinusCosA = 1.0f - cosA;
+
+    glm::mat4 rotate(1.0f);
+    rotate[0][0] = cosA + x * x * oneMinusCosA;
+    rotate[0][1] = x * y * oneMinusCosA - z * sinA;
+    rotate[0][2] = x * z * oneMinusCosA + y * sinA;
+
+    rotate[1][0] = y * x * oneMinusCosA + z * sinA;
+    rotate[1][1] = cosA + y * y * oneMinusCosA;
+    rotate[1][2] = y * z * oneMinusCosA - x * sinA;
+
+    rotate[2][0] = z * x * oneMinusCosA - y * sinA;
+    rotate[2][1] = z * y * oneMinusCosA + x * sinA;
+    rotate[2][2] = cosA + z * z * oneMinusCosA;
+
+    glm::mat4 rotationMatrix(1.0f);
+    rotationMatrix[0] = matrix[0] * rotate[0][0] + matrix[1] * rotate[0][1] + matrix[2] * rotate[0][2];
+    rotationMatrix[1] = matrix[0] * rotate[1][0] + matrix[1] * rotate[1][1] + matrix[2] * rotate[1][2];
+    rotationMatrix[2] = matrix[0] * rotate[2][0] + matrix[1] * rotate[2][1] + matrix[2] * rotate[2][2];
+    rotationMatrix[3] = matrix[3];
+
+    return rotationMatrix;
+}
+
+glm::mat4 Transformation::Scaling(glm::mat4 const &matrix, glm::vec3 const &scale)
+{
+    glm::mat4 scalingMatrix(1.0f);
+
+    scalingMatrix[0] = matrix[0] * scale[0];
+    scalingMatrix[1] = matrix[1] * scale[1];
+    scalingMatrix[2] = matrix[2] * scale[2];
+    scalingMatrix[3] = matrix[3];
+
+    return scalingMatrix;
+}
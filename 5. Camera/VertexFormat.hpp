@@ -0,0 +1,297 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+// Vertex layouts for the GPU side of a mesh. Meshes are written with full
+// float attributes and encoded into one of these when they are uploaded,
+// which is where the bytes per vertex, and so vertex fetch bandwidth, are
+// decided:
+//
+//  - positions as 32-bit floats, half floats, or snorm16 for meshes that
+//    fit in [-1, 1] (the unit sized meshes here all do)
+//  - normals, when the mesh has any, as floats or packed into
+//    GL_INT_2_10_10_10_REV
+//  - colors as floats or unorm8
+//
+// Every attribute starts on a 4 byte boundary, so a three component 16-bit
+// position takes 8 bytes.
+namespace VertexFormat {
+    enum PositionEncoding { PositionFloat, PositionHalf, PositionSnorm16 };
+    enum NormalEncoding { NormalNone, NormalFloat, NormalPacked };
+    enum ColorEncoding { ColorFloat, ColorUnorm8 };
+
+    struct Layout {
+        PositionEncoding position;
+        NormalEncoding normal;
+        ColorEncoding color;
+        GLsizei stride;
+        GLuint positionOffset;
+        GLuint normalOffset;
+        GLuint colorOffset;
+    };
+
+    // Where to read the full precision attributes from. Any of them may
+    // live in an array of structs, stride is the distance between vertices
+    // in bytes. normal may be null
+    struct Source {
+        const glm::vec3 *position;
+        const glm::vec3 *normal;
+        const glm::vec3 *color;
+        size_t stride;
+    };
+
+    // Locations 2 to 5 are taken by the instance matrix
+    static const GLuint positionLocation = 0;
+    static const GLuint colorLocation = 1;
+    static const GLuint normalLocation = 6;
+
+    static Layout MakeLayout(PositionEncoding position, NormalEncoding normal, ColorEncoding color);
+    static bool ParseLayout(const std::string &name, Layout &layout);
+    static std::string Describe(const Layout &layout);
+    static GLsizei FloatStride(const Layout &layout);
+    static float PositionLimit(PositionEncoding encoding);
+    static void Encode(const Layout &layout, const Source &source, uint32_t count, uint8_t *vertices);
+    static glm::vec3 DecodePosition(const Layout &layout, const uint8_t *vertex);
+    static void SetAttributes(const Layout &layout);
+    static uint16_t FloatToHalf(float value);
+    static float HalfToFloat(uint16_t value);
+}
+
+namespace VertexFormat {
+    static GLuint PositionSize(PositionEncoding encoding)
+    {
+        return encoding == PositionFloat ? 3 * sizeof(float) : 4 * sizeof(uint16_t);
+    }
+
+    static GLuint NormalSize(NormalEncoding encoding)
+    {
+        return encoding == NormalNone ? 0 : encoding == NormalFloat ? 3 * sizeof(float) : sizeof(uint32_t);
+    }
+
+    static GLuint ColorSize(ColorEncoding encoding)
+    {
+        return encoding == ColorFloat ? 3 * sizeof(float) : 4 * sizeof(uint8_t);
+    }
+
+    static int16_t FloatToSnorm16(float value)
+    {
+        return (int16_t) lrintf(std::min(std::max(value, -1.0f), 1.0f) * 32767.0f);
+    }
+
+    static uint32_t FloatToSnorm10(float value)
+    {
+        return (uint32_t) lrintf(std::min(std::max(value, -1.0f), 1.0f) * 511.0f) & 0x3ff;
+    }
+
+    static uint8_t FloatToUnorm8(float value)
+    {
+        return (uint8_t) lrintf(std::min(std::max(value, 0.0f), 1.0f) * 255.0f);
+    }
+}
+
+VertexFormat::Layout VertexFormat::MakeLayout(PositionEncoding position, NormalEncoding normal, ColorEncoding color)
+{
+    Layout layout;
+    layout.position = position;
+    layout.normal = normal;
+    layout.color = color;
+    layout.positionOffset = 0;
+    layout.normalOffset = layout.positionOffset + PositionSize(position);
+    layout.colorOffset = layout.normalOffset + NormalSize(normal);
+    layout.stride = layout.colorOffset + ColorSize(color);
+    return layout;
+}
+
+bool VertexFormat::ParseLayout(const std::string &name, Layout &layout)
+{
+    if (name == "float")
+        layout = MakeLayout(PositionFloat, NormalNone, ColorFloat);
+    else if (name == "half")
+        layout = MakeLayout(PositionHalf, NormalNone, ColorUnorm8);
+    else if (name == "snorm16")
+        layout = MakeLayout(PositionSnorm16, NormalNone, ColorUnorm8);
+    else
+        return false;
+    return true;
+}
+
+std::string VertexFormat::Describe(const Layout &layout)
+{
+    static const char *positionNames[] = { "float", "half", "snorm16" };
+    static const char *normalNames[] = { "", ", float normals", ", 2_10_10_10 normals" };
+    static const char *colorNames[] = { "float", "unorm8" };
+
+    return std::string(positionNames[layout.position]) + " positions" + normalNames[layout.normal] +
+           ", " + colorNames[layout.color] + " colors";
+}
+
+GLsizei VertexFormat::FloatStride(const Layout &layout)
+{
+    // The same attributes as plain floats, what the layout is saving on
+    return MakeLayout(PositionFloat, layout.normal == NormalNone ? NormalNone : NormalFloat, ColorFloat).stride;
+}
+
+float VertexFormat::PositionLimit(PositionEncoding encoding)
+{
+    // Largest coordinate the encoding holds, anything beyond it is clamped
+    if (encoding == PositionSnorm16)
+        return 1.0f;
+    if (encoding == PositionHalf)
+        return 65504.0f;
+    return INFINITY;
+}
+
+void VertexFormat::Encode(const Layout &layout, const Source &source, uint32_t count, uint8_t *vertices)
+{
+    const uint8_t *positions = (const uint8_t *) source.position;
+    const uint8_t *normals = (const uint8_t *) source.normal;
+    const uint8_t *colors = (const uint8_t *) source.color;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t *vertex = vertices + i * layout.stride;
+        const glm::vec3 &position = *(const glm::vec3 *) (positions + i * source.stride);
+        const glm::vec3 &color = *(const glm::vec3 *) (colors + i * source.stride);
+
+        // memcpy rather than stores through casted pointers, the packed
+        // attributes don't have to be aligned for their type
+        if (layout.position == PositionFloat) {
+            memcpy(vertex + layout.positionOffset, &position, 3 * sizeof(float));
+        } else {
+            uint16_t packed[4];
+            for (int c = 0; c < 3; c++)
+                packed[c] = layout.position == PositionHalf ? FloatToHalf(position[c]) : (uint16_t) FloatToSnorm16(position[c]);
+            packed[3] = 0;
+            memcpy(vertex + layout.positionOffset, packed, sizeof(packed));
+        }
+
+        if (layout.normal != NormalNone) {
+            glm::vec3 normal = normals != nullptr ? *(const glm::vec3 *) (normals + i * source.stride) : glm::vec3(0.0f, 0.0f, 1.0f);
+            if (layout.normal == NormalFloat) {
+                memcpy(vertex + layout.normalOffset, &normal, 3 * sizeof(float));
+            } else {
+                uint32_t packed = FloatToSnorm10(normal.x) | FloatToSnorm10(normal.y) << 10 | FloatToSnorm10(normal.z) << 20;
+                memcpy(vertex + layout.normalOffset, &packed, sizeof(packed));
+            }
+        }
+
+        if (layout.color == ColorFloat) {
+            memcpy(vertex + layout.colorOffset, &color, 3 * sizeof(float));
+        } else {
+            uint8_t packed[4] = { FloatToUnorm8(color.x), FloatToUnorm8(color.y), FloatToUnorm8(color.z), 255 };
+            memcpy(vertex + layout.colorOffset, packed, sizeof(packed));
+        }
+    }
+}
+
+glm::vec3 VertexFormat::DecodePosition(const Layout &layout, const uint8_t *vertex)
+{
+    // Back to floats the way the GPU reads them, for whatever needs the
+    // positions of an already encoded mesh on the CPU
+    glm::vec3 position;
+    if (layout.position == PositionFloat) {
+        memcpy(&position, vertex + layout.positionOffset, 3 * sizeof(float));
+        return position;
+    }
+
+    uint16_t packed[3];
+    memcpy(packed, vertex + layout.positionOffset, sizeof(packed));
+    for (int c = 0; c < 3; c++)
+        position[c] = layout.position == PositionHalf ? HalfToFloat(packed[c])
+                                                      : std::max((int16_t) packed[c] / 32767.0f, -1.0f);
+    return position;
+}
+
+void VertexFormat::SetAttributes(const Layout &layout)
+{
+    // Expects the VAO and the vertex buffer to be bound
+    switch (layout.position) {
+    case PositionFloat:
+        glVertexAttribPointer(positionLocation, 3, GL_FLOAT, GL_FALSE, layout.stride, (void *) (uintptr_t) layout.positionOffset);
+        break;
+    case PositionHalf:
+        glVertexAttribPointer(positionLocation, 3, GL_HALF_FLOAT, GL_FALSE, layout.stride, (void *) (uintptr_t) layout.positionOffset);
+        break;
+    case PositionSnorm16:
+        glVertexAttribPointer(positionLocation, 3, GL_SHORT, GL_TRUE, layout.stride, (void *) (uintptr_t) layout.positionOffset);
+        break;
+    }
+    glEnableVertexAttribArray(positionLocation);
+
+    if (layout.normal != NormalNone) {
+        if (layout.normal == NormalFloat)
+            glVertexAttribPointer(normalLocation, 3, GL_FLOAT, GL_FALSE, layout.stride, (void *) (uintptr_t) layout.normalOffset);
+        else
+            glVertexAttribPointer(normalLocation, 4, GL_INT_2_10_10_10_REV, GL_TRUE, layout.stride, (void *) (uintptr_t) layout.normalOffset);
+        glEnableVertexAttribArray(normalLocation);
+    }
+
+    if (layout.color == ColorFloat)
+        glVertexAttribPointer(colorLocation, 3, GL_FLOAT, GL_FALSE, layout.stride, (void *) (uintptr_t) layout.colorOffset);
+    else
+        glVertexAttribPointer(colorLocation, 4, GL_UNSIGNED_BYTE, GL_TRUE, layout.stride, (void *) (uintptr_t) layout.colorOffset);
+    glEnableVertexAttribArray(colorLocation);
+}
+
+uint16_t VertexFormat::FloatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = (int32_t) ((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    // NaN stays NaN, everything too large becomes infinity
+    if (((bits >> 23) & 0xff) == 0xff)
+        return (uint16_t) (sign | 0x7c00 | (mantissa != 0 ? 0x200 | mantissa >> 13 : 0));
+    if (exponent >= 31)
+        return (uint16_t) (sign | 0x7c00);
+
+    // Too small for a normal half, shift the implicit one into a denormal
+    if (exponent <= 0) {
+        if (exponent < -10)
+            return (uint16_t) sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return (uint16_t) (sign | half);
+    }
+
+    // Round to nearest even, a carry out of the mantissa correctly bumps
+    // the exponent
+    uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return (uint16_t) half;
+}
+
+float VertexFormat::HalfToFloat(uint16_t value)
+{
+    uint32_t sign = (uint32_t) (value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1f;
+    uint32_t mantissa = value & 0x3ff;
+
+    // Denormal halves are normal floats, ldexp takes care of that. The
+    // largest exponent is infinity or NaN in both
+    if (exponent == 0) {
+        float magnitude = ldexpf((float) mantissa, -24);
+        return sign != 0 ? -magnitude : magnitude;
+    }
+
+    uint32_t bits = sign | (exponent == 31 ? 0xff << 23 : (exponent - 15 + 127) << 23) | mantissa << 13;
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
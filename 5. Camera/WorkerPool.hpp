@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+#include "JobSystem.hpp"
+
+// Data parallel loops over task indices, run on the JobSystem. Start() and
+// Stop() bring its threads up and down. ParallelFor() hands the tasks out
+// as ranges the threads steal from each other, with the calling thread
+// taking part, and returns once every task has run. Loops may be nested,
+// or run from several threads at once; they all share the same workers.
+namespace WorkerPool {
+    static void Start(int workerCount);
+    static void Stop();
+    static int ThreadCount();
+    static void ParallelFor(uint32_t taskCount, const std::function<void(uint32_t task)> &function);
+}
+
+void WorkerPool::Start(int workerCount)
+{
+    JobSystem::Start(workerCount);
+}
+
+void WorkerPool::Stop()
+{
+    JobSystem::Stop();
+}
+
+int WorkerPool::ThreadCount()
+{
+    return JobSystem::ThreadCount();
+}
+
+void WorkerPool::ParallelFor(uint32_t taskCount, const std::function<void(uint32_t task)> &function)
+{
+    // Callers already size their tasks to be worth a thread each
+    JobSystem::ParallelFor(0, taskCount, 1, [&function](uint32_t begin, uint32_t end) {
+        for (uint32_t task = begin; task < end; task++)
+            function(task);
+    });
+}
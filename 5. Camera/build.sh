@@ -1,6 +1,8 @@
 #!/bin/bash
 
 CC=g++
-LDFLAGS=$(pkg-config --libs glew glfw3)
+LDFLAGS=$(pkg-config --libs glew glfw3 egl)
 
-$CC Camera.cpp "$LDFLAGS"
+$CC Camera.cpp $LDFLAGS -pthread
+$CC -O2 Benchmark.cpp $LDFLAGS -pthread -o benchmark
+$CC -O2 MeshConvert.cpp $LDFLAGS -pthread -o meshconvert
@@ -0,0 +1,73 @@
+#version 430 core
+
+// One invocation per instance. A visible instance builds its model matrix
+// and claims the next slot in the output range of its mesh with an atomic
+// add on the instance count of that mesh's indirect draw command, so the
+// CPU never has to know how many survived
+layout (local_size_x = 64) in;
+
+struct Instance {
+    vec4 PositionRadius;    // Bounding sphere center is the position
+    vec4 AxisSpeed;         // Rotation axis, degrees per second
+    vec4 Scale;             // w is the index of the draw command
+};
+
+layout (std430, binding = 0) readonly buffer Instances {
+    Instance instances[];
+};
+
+layout (std430, binding = 1) writeonly buffer Matrices {
+    mat4 matrices[];
+};
+
+// Same layout as DrawElementsIndirectCommand, one per mesh
+struct DrawCommand {
+    uint Count;
+    uint InstanceCount;
+    uint FirstIndex;
+    int BaseVertex;
+    uint BaseInstance;
+};
+
+layout (std430, binding = 2) buffer Commands {
+    DrawCommand commands[];
+};
+
+// Normalized planes, xyz is the normal and w the distance
+uniform vec4 FrustumPlanes[6];
+uniform uint TotalCount;
+uniform float Time;
+
+void main()
+{
+    uint index = gl_GlobalInvocationID.x;
+    if (index >= TotalCount)
+        return;
+
+    Instance instance = instances[index];
+    vec3 center = instance.PositionRadius.xyz;
+    float radius = instance.PositionRadius.w;
+
+    for (int plane = 0; plane < 6; plane++)
+        if (dot(FrustumPlanes[plane].xyz, center) + FrustumPlanes[plane].w < -radius)
+            return;
+
+    // Same rotation convention as TransformBatch, with the scale folded
+    // into the columns and the translation in the last one
+    float angle = radians(Time * instance.AxisSpeed.w);
+    float c = cos(angle);
+    float s = sin(angle);
+    float t = 1.0 - c;
+    vec3 axis = normalize(instance.AxisSpeed.xyz);
+    float x = axis.x, y = axis.y, z = axis.z;
+    vec3 scale = instance.Scale.xyz;
+
+    mat4 model = mat4(
+        vec4((c + x * x * t) * scale.x, (x * y * t - z * s) * scale.x, (x * z * t + y * s) * scale.x, 0.0),
+        vec4((y * x * t + z * s) * scale.y, (c + y * y * t) * scale.y, (y * z * t - x * s) * scale.y, 0.0),
+        vec4((z * x * t - y * s) * scale.z, (z * y * t + x * s) * scale.z, (c + z * z * t) * scale.z, 0.0),
+        vec4(center, 1.0));
+
+    uint command = uint(instance.Scale.w);
+    matrices[commands[command].BaseInstance + atomicAdd(commands[command].InstanceCount, 1u)] = model;
+}
@@ -0,0 +1,19 @@
+#version 330 core
+
+layout (location = 0) in vec3 Position;
+layout (location = 1) in vec3 Color;
+layout (location = 2) in mat4 InstanceModelMatrix;
+
+out vec3 outColor;
+
+layout (std140) uniform Camera {
+    mat4 ViewMatrix;
+    mat4 ProjectionMatrix;
+    mat4 ViewProjectionMatrix;
+};
+
+void main()
+{
+    gl_Position = ViewProjectionMatrix * (InstanceModelMatrix * vec4(Position, 1.0));
+    outColor = Color;
+}
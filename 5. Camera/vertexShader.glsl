@@ -5,12 +5,16 @@ layout (location = 1) in vec3 Color;
 
 out vec3 outColor;
 
+layout (std140) uniform Camera {
+    mat4 ViewMatrix;
+    mat4 ProjectionMatrix;
+    mat4 ViewProjectionMatrix;
+};
+
 uniform mat4 ModelMatrix;
-uniform mat4 ViewMatrix;
-uniform mat4 ProjectionMatrix;
 
 void main()
 {
-    gl_Position = ProjectionMatrix * ViewMatrix * ModelMatrix * vec4(Position, 1.0);
+    gl_Position = ViewProjectionMatrix * (ModelMatrix * vec4(Position, 1.0));
     outColor = Color;
 }